@@ -0,0 +1,155 @@
+#ifndef EFANNA2E_CANDIDATE_POOL_H
+#define EFANNA2E_CANDIDATE_POOL_H
+
+#include <x86intrin.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <utility>
+#include <vector>
+
+namespace efanna2e {
+
+// Fixed-capacity candidate queue of the greedy search, sorted by distance.
+// Distances, ids and the expanded flags live in separate arrays so the rank
+// of a new candidate is found by comparing packed distances, and a cursor
+// remembers the closest candidate that has not been expanded yet.
+class CandidatePool {
+ public:
+  CandidatePool() : size_(0), capacity_(0), cursor_(0) {}
+
+  explicit CandidatePool(unsigned capacity) : CandidatePool() {
+    Init(capacity);
+  }
+
+  void Init(unsigned capacity) {
+    capacity_ = capacity;
+    // Slots past size() hold +inf, so rank counting may read a whole window
+    // beyond the last candidate without special cases.
+    dists_.assign(capacity + kWindow + kLanes,
+                  std::numeric_limits<float>::max());
+    ids_.resize(capacity + 1);
+    expanded_.resize(capacity + 1);
+    sort_buf_.resize(capacity);
+    size_ = 0;
+    cursor_ = 0;
+  }
+
+  inline void Clear() {
+    std::fill(dists_.begin(), dists_.begin() + size_,
+              std::numeric_limits<float>::max());
+    size_ = 0;
+    cursor_ = 0;
+  }
+
+  inline unsigned size() const { return size_; }
+  inline unsigned capacity() const { return capacity_; }
+  inline bool full() const { return size_ == capacity_; }
+  inline unsigned id(unsigned i) const { return ids_[i]; }
+  inline float distance(unsigned i) const { return dists_[i]; }
+
+  // Distance a new candidate has to beat to enter the pool.
+  inline float Bound() const {
+    return full() ? dists_[size_ - 1] : std::numeric_limits<float>::max();
+  }
+
+  // Appends without keeping the order, for the initial candidates. Call
+  // Sort() once afterwards.
+  inline void PushUnsorted(unsigned id, float dist) {
+    if (full()) return;
+    dists_[size_] = dist;
+    ids_[size_] = id;
+    expanded_[size_] = 0;
+    size_++;
+  }
+
+  void Sort() {
+    for (unsigned i = 0; i < size_; i++) {
+      sort_buf_[i] = std::make_pair(dists_[i], ids_[i]);
+    }
+    std::sort(sort_buf_.begin(), sort_buf_.begin() + size_);
+    for (unsigned i = 0; i < size_; i++) {
+      dists_[i] = sort_buf_[i].first;
+      ids_[i] = sort_buf_[i].second;
+      expanded_[i] = 0;
+    }
+    cursor_ = 0;
+  }
+
+  // Inserts a candidate at its rank. Returns the position, or capacity()
+  // when the candidate is not closer than Bound() or already present.
+  inline unsigned Insert(unsigned id, float dist) {
+    if (dist >= Bound()) return capacity_;
+    unsigned pos = UpperBound(dist);
+    for (unsigned j = pos; j > 0 && dists_[j - 1] == dist; --j) {
+      if (ids_[j - 1] == id) return capacity_;
+    }
+    unsigned tail = (full() ? size_ - 1 : size_) - pos;
+    std::memmove(&dists_[pos + 1], &dists_[pos], tail * sizeof(float));
+    std::memmove(&ids_[pos + 1], &ids_[pos], tail * sizeof(unsigned));
+    std::memmove(&expanded_[pos + 1], &expanded_[pos], tail);
+    dists_[pos] = dist;
+    ids_[pos] = id;
+    expanded_[pos] = 0;
+    if (!full()) size_++;
+    if (pos < cursor_) cursor_ = pos;
+    return pos;
+  }
+
+  // Marks the closest unexpanded candidate as expanded and returns its id
+  // through id. Returns false once every candidate has been expanded.
+  inline bool PopUnexpanded(unsigned &id) {
+    while (cursor_ < size_ && expanded_[cursor_]) cursor_++;
+    if (cursor_ == size_) return false;
+    expanded_[cursor_] = 1;
+    id = ids_[cursor_];
+    return true;
+  }
+
+ private:
+  static const unsigned kLanes = 8;
+  static const unsigned kWindow = 32;
+
+  // Number of candidates with distance <= dist. Branch-free halving narrows
+  // the range to kWindow entries, which are then counted with SIMD compares.
+  inline unsigned UpperBound(float dist) const {
+    const float *base = dists_.data();
+    unsigned len = size_;
+    while (len > kWindow) {
+      unsigned half = len / 2;
+      base = (base[half] <= dist) ? base + half : base;
+      len -= half;
+    }
+    unsigned count = 0;
+#if defined(__AVX__)
+    __m256 d = _mm256_set1_ps(dist);
+    for (unsigned i = 0; i < len; i += 8) {
+      __m256 v = _mm256_loadu_ps(base + i);
+      count += __builtin_popcount(
+          _mm256_movemask_ps(_mm256_cmp_ps(v, d, _CMP_LE_OQ)));
+    }
+#elif defined(__SSE2__)
+    __m128 d = _mm_set1_ps(dist);
+    for (unsigned i = 0; i < len; i += 4) {
+      __m128 v = _mm_loadu_ps(base + i);
+      count += __builtin_popcount(_mm_movemask_ps(_mm_cmple_ps(v, d)));
+    }
+#else
+    for (unsigned i = 0; i < len; i++) count += base[i] <= dist;
+#endif
+    return (unsigned)(base - dists_.data()) + count;
+  }
+
+  std::vector<float> dists_;
+  std::vector<unsigned> ids_;
+  std::vector<uint8_t> expanded_;
+  std::vector<std::pair<float, unsigned>> sort_buf_;
+  unsigned size_;
+  unsigned capacity_;
+  unsigned cursor_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_CANDIDATE_POOL_H
@@ -0,0 +1,91 @@
+#ifndef EFANNA2E_COMPACT_GRAPH_H
+#define EFANNA2E_COMPACT_GRAPH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace efanna2e {
+
+// Adjacency lists in CSR form: one id array, node i owning the slots
+// [offsets_[i], offsets_[i + 1]) of which the first degree(i) are its
+// neighbors. While a graph is built rows may keep spare slots for edges
+// appended later; Compact() removes them.
+class CompactGraph {
+ public:
+  // Neighbor ids of one node. Invalidated by changes to the row layout
+  // (Reset, AddEdges, Compact, Assign, Load*).
+  class Row {
+   public:
+    Row(const unsigned *begin, unsigned size) : begin_(begin), size_(size) {}
+    unsigned size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    const unsigned *data() const { return begin_; }
+    const unsigned *begin() const { return begin_; }
+    const unsigned *end() const { return begin_ + size_; }
+    unsigned operator[](size_t i) const { return begin_[i]; }
+
+   private:
+    const unsigned *begin_;
+    unsigned size_;
+  };
+
+  size_t size() const { return degrees_.size(); }
+  bool empty() const { return degrees_.empty(); }
+  Row operator[](size_t i) const {
+    return Row(ids_.data() + offsets_[i], degrees_[i]);
+  }
+  unsigned degree(size_t i) const { return degrees_[i]; }
+  unsigned capacity(size_t i) const {
+    return (unsigned)(offsets_[i + 1] - offsets_[i]);
+  }
+  size_t num_edges() const;
+  unsigned max_degree() const;
+
+  // Empties the graph and lays out n empty rows of capacity slots each.
+  void Reset(size_t n, unsigned capacity);
+  // Replaces the neighbors of node i with ids[0, n); n must not exceed the
+  // capacity of the row.
+  void SetRow(size_t i, const unsigned *ids, unsigned n);
+  // Appends id to the neighbors of node i. Returns false if the row is full.
+  bool Append(size_t i, unsigned id);
+  // Adds each edge (from, to) not yet in the graph, growing rows as needed.
+  void AddEdges(const std::vector<std::pair<unsigned, unsigned>> &edges);
+  // Gives every row room for at least capacity neighbors.
+  void Reserve(unsigned capacity);
+  // Appends n empty rows of capacity slots each.
+  void AddNodes(size_t n, unsigned capacity);
+  // Drops the spare slots of every row.
+  void Compact();
+  // Empties rows [begin, end) and returns the pages holding only their ids
+  // to the operating system, without changing the layout, so a graph that
+  // is consumed in row order shrinks as it goes.
+  void ReleaseRows(size_t begin, size_t end);
+
+  // Takes CSR arrays: offsets holds the n + 1 row boundaries into ids.
+  // Throws std::runtime_error unless they describe a graph of n nodes.
+  void Assign(std::vector<uint64_t> &&offsets, std::vector<unsigned> &&ids);
+  // Reads rows stored as a neighbor count followed by that many ids, from
+  // byte offset of filename to its end, at most max_rows of them. The file
+  // is mapped and the rows copied in parallel. Throws std::runtime_error if
+  // it cannot be read, a row is truncated or an id is not below the number
+  // of rows read.
+  void LoadRows(const char *filename, size_t offset,
+                size_t max_rows = SIZE_MAX);
+
+  void clear();
+  void swap(CompactGraph &other);
+
+ private:
+  // Throws std::runtime_error unless every id is below n.
+  static void CheckIds(const std::vector<unsigned> &ids, size_t n);
+
+  std::vector<uint64_t> offsets_;  // size() + 1 row boundaries into ids_
+  std::vector<unsigned> degrees_;
+  std::vector<unsigned> ids_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_COMPACT_GRAPH_H
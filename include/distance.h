@@ -6,325 +6,232 @@
 #define EFANNA2E_DISTANCE_H
 
 #include <x86intrin.h>
+#include <algorithm>
+#include <cassert>
+#include <cmath>
 #include <iostream>
+#include <vector>
+
+#include "distance_kernels.h"
+
 namespace efanna2e {
-enum Metric { L2 = 0, INNER_PRODUCT = 1, FAST_L2 = 2, PQ = 3 };
+enum Metric { L2 = 0, INNER_PRODUCT = 1, FAST_L2 = 2, PQ = 3, COSINE = 4 };
 class Distance {
  public:
   virtual float compare(const float *a, const float *b,
                         unsigned length) const = 0;
+  // Distances from q to each of the n vectors in xs, written to out.
+  virtual void compare_batch(const float *q, const float *const *xs,
+                             unsigned n, unsigned length, float *out) const {
+    for (unsigned i = 0; i < n; i++) out[i] = compare(q, xs[i], length);
+  }
+  // The same for vectors that are data rows with known ids (kNoRow for a
+  // vector outside the data set), so metrics can use values precomputed
+  // per row instead of recomputing them on every call.
+  static const unsigned kNoRow = (unsigned)-1;
+  virtual float compare_rows(const float *a, unsigned a_id, const float *b,
+                             unsigned b_id, unsigned length) const {
+    return compare(a, b, length);
+  }
+  virtual void compare_rows_batch(const float *q, unsigned q_id,
+                                  const float *const *xs, const unsigned *ids,
+                                  unsigned n, unsigned length,
+                                  float *out) const {
+    compare_batch(q, xs, n, length, out);
+  }
   virtual ~Distance() {}
 };
 
+// The kernels are picked at runtime for the host CPU, see distance_kernels.h.
 class DistanceL2 : public Distance {
  public:
-  float compare(const float *a, const float *b, unsigned size) const {
-    float result = 0;
-
-#ifdef __GNUC__
-#ifdef __AVX__
-
-#define AVX_L2SQR(addr1, addr2, dest, tmp1, tmp2) \
-  tmp1 = _mm256_loadu_ps(addr1);                  \
-  tmp2 = _mm256_loadu_ps(addr2);                  \
-  tmp1 = _mm256_sub_ps(tmp1, tmp2);               \
-  tmp1 = _mm256_mul_ps(tmp1, tmp1);               \
-  dest = _mm256_add_ps(dest, tmp1);
-
-    __m256 sum;
-    __m256 l0, l1;
-    __m256 r0, r1;
-    unsigned D = (size + 7) & ~7U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *r = b;
-    const float *e_l = l + DD;
-    const float *e_r = r + DD;
-    float unpack[8] __attribute__((aligned(32))) = {0, 0, 0, 0, 0, 0, 0, 0};
-
-    sum = _mm256_loadu_ps(unpack);
-    if (DR) {
-      AVX_L2SQR(e_l, e_r, sum, l0, r0);
-    }
-
-    for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      AVX_L2SQR(l, r, sum, l0, r0);
-      AVX_L2SQR(l + 8, r + 8, sum, l1, r1);
-    }
-    _mm256_storeu_ps(unpack, sum);
-    result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] +
-             unpack[5] + unpack[6] + unpack[7];
-
-#else
-#ifdef __SSE2__
-#define SSE_L2SQR(addr1, addr2, dest, tmp1, tmp2) \
-  tmp1 = _mm_load_ps(addr1);                      \
-  tmp2 = _mm_load_ps(addr2);                      \
-  tmp1 = _mm_sub_ps(tmp1, tmp2);                  \
-  tmp1 = _mm_mul_ps(tmp1, tmp1);                  \
-  dest = _mm_add_ps(dest, tmp1);
-
-    __m128 sum;
-    __m128 l0, l1, l2, l3;
-    __m128 r0, r1, r2, r3;
-    unsigned D = (size + 3) & ~3U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *r = b;
-    const float *e_l = l + DD;
-    const float *e_r = r + DD;
-    float unpack[4] __attribute__((aligned(16))) = {0, 0, 0, 0};
-
-    sum = _mm_load_ps(unpack);
-    switch (DR) {
-      case 12:
-        SSE_L2SQR(e_l + 8, e_r + 8, sum, l2, r2);
-      case 8:
-        SSE_L2SQR(e_l + 4, e_r + 4, sum, l1, r1);
-      case 4:
-        SSE_L2SQR(e_l, e_r, sum, l0, r0);
-      default:
-        break;
-    }
-    for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      SSE_L2SQR(l, r, sum, l0, r0);
-      SSE_L2SQR(l + 4, r + 4, sum, l1, r1);
-      SSE_L2SQR(l + 8, r + 8, sum, l2, r2);
-      SSE_L2SQR(l + 12, r + 12, sum, l3, r3);
-    }
-    _mm_storeu_ps(unpack, sum);
-    result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-
-// nomal distance
-#else
-
-    float diff0, diff1, diff2, diff3;
-    const float* last = a + size;
-    const float* unroll_group = last - 3;
+  DistanceL2()
+      : l2_(GetDistanceKernels().l2),
+        l2_batch_(GetDistanceKernels().l2_batch) {}
 
-    /* Process 4 items with each loop for efficiency. */
-    while (a < unroll_group) {
-      diff0 = a[0] - b[0];
-      diff1 = a[1] - b[1];
-      diff2 = a[2] - b[2];
-      diff3 = a[3] - b[3];
-      result += diff0 * diff0 + diff1 * diff1 + diff2 * diff2 + diff3 * diff3;
-      a += 4;
-      b += 4;
-    }
-    /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-    while (a < last) {
-      diff0 = *a++ - *b++;
-      result += diff0 * diff0;
-    }
-#endif
-#endif
-#endif
-
-    return result;
+  float compare(const float *a, const float *b, unsigned size) const {
+    return l2_(a, b, size);
   }
+  void compare_batch(const float *q, const float *const *xs, unsigned n,
+                     unsigned size, float *out) const {
+    l2_batch_(q, xs, n, size, out);
+  }
+
+ private:
+  float (*l2_)(const float *, const float *, unsigned);
+  void (*l2_batch_)(const float *, const float *const *, unsigned, unsigned,
+                    float *);
 };
 
 class DistanceInnerProduct : public Distance {
  public:
-  float compare(const float *a, const float *b, unsigned size) const {
-    float result = 0;
-#ifdef __GNUC__
-#ifdef __AVX__
-#define AVX_DOT(addr1, addr2, dest, tmp1, tmp2) \
-  tmp1 = _mm256_loadu_ps(addr1);                \
-  tmp2 = _mm256_loadu_ps(addr2);                \
-  tmp1 = _mm256_mul_ps(tmp1, tmp2);             \
-  dest = _mm256_add_ps(dest, tmp1);
+  DistanceInnerProduct()
+      : inner_product_(GetDistanceKernels().inner_product),
+        inner_product_batch_(GetDistanceKernels().inner_product_batch) {}
 
-    __m256 sum;
-    __m256 l0, l1;
-    __m256 r0, r1;
-    unsigned D = (size + 7) & ~7U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *r = b;
-    const float *e_l = l + DD;
-    const float *e_r = r + DD;
-    float unpack[8] __attribute__((aligned(32))) = {0, 0, 0, 0, 0, 0, 0, 0};
+  float compare(const float *a, const float *b, unsigned size) const {
+    return inner_product_(a, b, size);
+  }
+  void compare_batch(const float *q, const float *const *xs, unsigned n,
+                     unsigned size, float *out) const {
+    inner_product_batch_(q, xs, n, size, out);
+  }
 
-    sum = _mm256_loadu_ps(unpack);
-    if (DR) {
-      AVX_DOT(e_l, e_r, sum, l0, r0);
-    }
+ private:
+  float (*inner_product_)(const float *, const float *, unsigned);
+  void (*inner_product_batch_)(const float *, const float *const *, unsigned,
+                               unsigned, float *);
+};
 
-    for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      AVX_DOT(l, r, sum, l0, r0);
-      AVX_DOT(l + 8, r + 8, sum, l1, r1);
-    }
-    _mm256_storeu_ps(unpack, sum);
-    result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] +
-             unpack[5] + unpack[6] + unpack[7];
+class DistanceFastL2 : public DistanceInnerProduct {
+ public:
+  DistanceFastL2() : norm_(GetDistanceKernels().norm) {}
 
-#else
-#ifdef __SSE2__
-#define SSE_DOT(addr1, addr2, dest, tmp1, tmp2) \
-  tmp1 = _mm_loadu_ps(addr1);                \
-  tmp2 = _mm_loadu_ps(addr2);                \
-  tmp1 = _mm_mul_ps(tmp1, tmp2);             \
-  dest = _mm_add_ps(dest, tmp1);
-    __m128 sum;
-    __m128 l0, l1, l2, l3;
-    __m128 r0, r1, r2, r3;
-    unsigned D = (size + 3) & ~3U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *r = b;
-    const float *e_l = l + DD;
-    const float *e_r = r + DD;
-    float unpack[4] __attribute__((aligned(16))) = {0, 0, 0, 0};
+  float norm(const float *a, unsigned size) const { return norm_(a, size); }
+  using DistanceInnerProduct::compare;
+  using DistanceInnerProduct::compare_batch;
+  float compare(const float *a, const float *b, float norm,
+                unsigned size) const {  // not implement
+    float result = -2 * DistanceInnerProduct::compare(a, b, size);
+    result += norm;
+    return result;
+  }
 
-    sum = _mm_load_ps(unpack);
-    switch (DR) {
-      case 12:
-        SSE_DOT(e_l + 8, e_r + 8, sum, l2, r2);
-      case 8:
-        SSE_DOT(e_l + 4, e_r + 4, sum, l1, r1);
-      case 4:
-        SSE_DOT(e_l, e_r, sum, l0, r0);
-      default:
-        break;
-    }
-    for (unsigned i = 0; i < DD; i += 16, l += 16, r += 16) {
-      SSE_DOT(l, r, sum, l0, r0);
-      SSE_DOT(l + 4, r + 4, sum, l1, r1);
-      SSE_DOT(l + 8, r + 8, sum, l2, r2);
-      SSE_DOT(l + 12, r + 12, sum, l3, r3);
-    }
-    _mm_storeu_ps(unpack, sum);
-    result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-#else
+ private:
+  float (*norm_)(const float *, unsigned);
+};
 
-    float dot0, dot1, dot2, dot3;
-    const float* last = a + size;
-    const float* unroll_group = last - 3;
+// Squared L2 distance between the unit-normalized vectors, 2 - 2 cos(a, b),
+// so cosine graphs are built and pruned exactly like L2 graphs. The inverse
+// norms of the data rows are set once by SetRows(); other vectors have
+// theirs computed on the fly.
+class DistanceCosine : public Distance {
+ public:
+  DistanceCosine()
+      : inner_product_(GetDistanceKernels().inner_product),
+        inner_product_batch_(GetDistanceKernels().inner_product_batch),
+        norm_(GetDistanceKernels().norm) {}
+
+  // inverse_norms[i] is 1 / |x_i| of data row i, 0 for a zero row.
+  void SetRows(std::vector<float> &&inverse_norms) {
+    inverse_norms_.swap(inverse_norms);
+  }
 
-    /* Process 4 items with each loop for efficiency. */
-    while (a < unroll_group) {
-      dot0 = a[0] * b[0];
-      dot1 = a[1] * b[1];
-      dot2 = a[2] * b[2];
-      dot3 = a[3] * b[3];
-      result += dot0 + dot1 + dot2 + dot3;
-      a += 4;
-      b += 4;
+  float compare(const float *a, const float *b, unsigned size) const {
+    return Cosine(inner_product_(a, b, size), InverseNorm(a, size),
+                  InverseNorm(b, size));
+  }
+  void compare_batch(const float *q, const float *const *xs, unsigned n,
+                     unsigned size, float *out) const {
+    inner_product_batch_(q, xs, n, size, out);
+    const float inv_q = InverseNorm(q, size);
+    for (unsigned i = 0; i < n; i++) {
+      out[i] = Cosine(out[i], inv_q, InverseNorm(xs[i], size));
     }
-    /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-    while (a < last) {
-      result += *a++ * *b++;
+  }
+  float compare_rows(const float *a, unsigned a_id, const float *b,
+                     unsigned b_id, unsigned size) const {
+    return Cosine(inner_product_(a, b, size), RowInverseNorm(a, a_id, size),
+                  RowInverseNorm(b, b_id, size));
+  }
+  void compare_rows_batch(const float *q, unsigned q_id,
+                          const float *const *xs, const unsigned *ids,
+                          unsigned n, unsigned size, float *out) const {
+    inner_product_batch_(q, xs, n, size, out);
+    const float inv_q = RowInverseNorm(q, q_id, size);
+    for (unsigned i = 0; i < n; i++) {
+      out[i] = Cosine(out[i], inv_q, RowInverseNorm(xs[i], ids[i], size));
     }
-#endif
-#endif
-#endif
-    return result;
   }
-};
-class DistanceFastL2 : public DistanceInnerProduct {
- public:
-  float norm(const float *a, unsigned size) const {
-    float result = 0;
-#ifdef __GNUC__
-#ifdef __AVX__
-#define AVX_L2NORM(addr, dest, tmp) \
-  tmp = _mm256_loadu_ps(addr);      \
-  tmp = _mm256_mul_ps(tmp, tmp);    \
-  dest = _mm256_add_ps(dest, tmp);
 
-    __m256 sum;
-    __m256 l0, l1;
-    unsigned D = (size + 7) & ~7U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *e_l = l + DD;
-    float unpack[8] __attribute__((aligned(32))) = {0, 0, 0, 0, 0, 0, 0, 0};
+ private:
+  static float Cosine(float ip, float inv_a, float inv_b) {
+    if (inv_a == 0 || inv_b == 0) return 2;
+    return std::max(2 - 2 * ip * inv_a * inv_b, 0.0f);
+  }
+  float InverseNorm(const float *x, unsigned size) const {
+    float norm = norm_(x, size);
+    return norm > 0 ? 1 / std::sqrt(norm) : 0;
+  }
+  float RowInverseNorm(const float *x, unsigned id, unsigned size) const {
+    if (id == kNoRow) return InverseNorm(x, size);
+    assert(id < inverse_norms_.size());
+    return inverse_norms_[id];
+  }
 
-    sum = _mm256_loadu_ps(unpack);
-    if (DR) {
-      AVX_L2NORM(e_l, sum, l0);
-    }
-    for (unsigned i = 0; i < DD; i += 16, l += 16) {
-      AVX_L2NORM(l, sum, l0);
-      AVX_L2NORM(l + 8, sum, l1);
-    }
-    _mm256_storeu_ps(unpack, sum);
-    result = unpack[0] + unpack[1] + unpack[2] + unpack[3] + unpack[4] +
-             unpack[5] + unpack[6] + unpack[7];
-#else
-#ifdef __SSE2__
-#define SSE_L2NORM(addr, dest, tmp) \
-  tmp = _mm_loadu_ps(addr);      \
-  tmp = _mm_mul_ps(tmp, tmp);    \
-  dest = _mm_add_ps(dest, tmp);
+  std::vector<float> inverse_norms_;
+  float (*inner_product_)(const float *, const float *, unsigned);
+  void (*inner_product_batch_)(const float *, const float *const *, unsigned,
+                               unsigned, float *);
+  float (*norm_)(const float *, unsigned);
+};
 
-    __m128 sum;
-    __m128 l0, l1, l2, l3;
-    unsigned D = (size + 3) & ~3U;
-    unsigned DR = D % 16;
-    unsigned DD = D - DR;
-    const float *l = a;
-    const float *e_l = l + DD;
-    float unpack[4] __attribute__((aligned(16))) = {0, 0, 0, 0};
+// Maximum inner product search reduced to L2: every vector x is extended
+// with the coordinate sqrt(M - |x|^2), where M is the largest squared norm
+// of the data set, so all extended vectors have norm sqrt(M) and a smaller
+// L2 distance means a larger inner product. The extra coordinates of the
+// data rows are set once by SetRows() and looked up by row id; other
+// vectors (e.g. a centroid) are extended on the fly. Call SetRows() first.
+class DistanceMaxInnerProduct : public Distance {
+ public:
+  DistanceMaxInnerProduct()
+      : max_squared_norm_(0),
+        l2_(GetDistanceKernels().l2),
+        l2_batch_(GetDistanceKernels().l2_batch),
+        norm_(GetDistanceKernels().norm) {}
+
+  // The max_squared_norm M of the data set, with extra[i] the extra
+  // coordinate of data row i.
+  void SetRows(float max_squared_norm, std::vector<float> &&extra) {
+    max_squared_norm_ = max_squared_norm;
+    extra_.swap(extra);
+  }
+  float max_squared_norm() const { return max_squared_norm_; }
 
-    sum = _mm_load_ps(unpack);
-    switch (DR) {
-      case 12:
-        SSE_L2NORM(e_l + 8, sum, l2);
-      case 8:
-        SSE_L2NORM(e_l + 4, sum, l1);
-      case 4:
-        SSE_L2NORM(e_l, sum, l0);
-      default:
-        break;
+  float compare(const float *a, const float *b, unsigned size) const {
+    return compare_rows(a, kNoRow, b, kNoRow, size);
+  }
+  void compare_batch(const float *q, const float *const *xs, unsigned n,
+                     unsigned size, float *out) const {
+    l2_batch_(q, xs, n, size, out);
+    const float eq = Extra(q, size);
+    for (unsigned i = 0; i < n; i++) {
+      float e = eq - Extra(xs[i], size);
+      out[i] += e * e;
     }
-    for (unsigned i = 0; i < DD; i += 16, l += 16) {
-      SSE_L2NORM(l, sum, l0);
-      SSE_L2NORM(l + 4, sum, l1);
-      SSE_L2NORM(l + 8, sum, l2);
-      SSE_L2NORM(l + 12, sum, l3);
+  }
+  float compare_rows(const float *a, unsigned a_id, const float *b,
+                     unsigned b_id, unsigned size) const {
+    float e = RowExtra(a, a_id, size) - RowExtra(b, b_id, size);
+    return l2_(a, b, size) + e * e;
+  }
+  void compare_rows_batch(const float *q, unsigned q_id,
+                          const float *const *xs, const unsigned *ids,
+                          unsigned n, unsigned size, float *out) const {
+    l2_batch_(q, xs, n, size, out);
+    const float eq = RowExtra(q, q_id, size);
+    for (unsigned i = 0; i < n; i++) {
+      float e = eq - RowExtra(xs[i], ids[i], size);
+      out[i] += e * e;
     }
-    _mm_storeu_ps(unpack, sum);
-    result += unpack[0] + unpack[1] + unpack[2] + unpack[3];
-#else
-    float dot0, dot1, dot2, dot3;
-    const float* last = a + size;
-    const float* unroll_group = last - 3;
+  }
 
-    /* Process 4 items with each loop for efficiency. */
-    while (a < unroll_group) {
-      dot0 = a[0] * a[0];
-      dot1 = a[1] * a[1];
-      dot2 = a[2] * a[2];
-      dot3 = a[3] * a[3];
-      result += dot0 + dot1 + dot2 + dot3;
-      a += 4;
-    }
-    /* Process last 0-3 pixels.  Not needed for standard vector lengths. */
-    while (a < last) {
-      result += (*a) * (*a);
-      a++;
-    }
-#endif
-#endif
-#endif
-    return result;
+ private:
+  float Extra(const float *x, unsigned size) const {
+    return std::sqrt(std::max(max_squared_norm_ - norm_(x, size), 0.0f));
   }
-  using DistanceInnerProduct::compare;
-  float compare(const float *a, const float *b, float norm,
-                unsigned size) const {  // not implement
-    float result = -2 * DistanceInnerProduct::compare(a, b, size);
-    result += norm;
-    return result;
+  float RowExtra(const float *x, unsigned id, unsigned size) const {
+    if (id == kNoRow) return Extra(x, size);
+    assert(id < extra_.size());
+    return extra_[id];
   }
+
+  float max_squared_norm_;
+  std::vector<float> extra_;
+  float (*l2_)(const float *, const float *, unsigned);
+  void (*l2_batch_)(const float *, const float *const *, unsigned, unsigned,
+                    float *);
+  float (*norm_)(const float *, unsigned);
 };
 }  // namespace efanna2e
 
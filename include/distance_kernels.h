@@ -0,0 +1,58 @@
+#ifndef EFANNA2E_DISTANCE_KERNELS_H
+#define EFANNA2E_DISTANCE_KERNELS_H
+
+#include <cstdint>
+
+namespace efanna2e {
+
+// Distance kernels bound once, at first use, to the widest instruction set
+// the running CPU supports (generic, SSE2, AVX2+FMA or AVX-512). The kernels
+// accept any vector length; padding rows to a multiple of 8 only helps speed.
+//
+// The SSG_ISA environment variable (generic, sse2, avx2, avx512) caps the
+// selection, e.g. to compare kernels on the same host.
+struct DistanceKernels {
+  const char *isa;
+  float (*l2)(const float *a, const float *b, unsigned size);
+  float (*inner_product)(const float *a, const float *b, unsigned size);
+  float (*norm)(const float *a, unsigned size);
+  // Squared L2 distance that may stop early: once a partial sum over the
+  // leading dimensions exceeds bound it is returned instead. The result
+  // exceeds bound exactly when the full distance does.
+  float (*l2_bounded)(const float *a, const float *b, unsigned size,
+                      float bound);
+  // One query against n candidates: out[i] = l2(q, xs[i]). The query is
+  // loaded once per group of four candidates and the four horizontal sums
+  // are reduced together.
+  void (*l2_batch)(const float *q, const float *const *xs, unsigned n,
+                   unsigned size, float *out);
+  void (*inner_product_batch)(const float *q, const float *const *xs,
+                              unsigned n, unsigned size, float *out);
+  // Hamming distance between two bit strings of `words` 32-bit words.
+  unsigned (*hamming)(const unsigned *a, const unsigned *b, unsigned words);
+  // Float query against a scalar-quantized vector (see quantizer.h): the
+  // inner product with the raw bytes, or with the decoded half floats.
+  float (*inner_product_sq8)(const float *q, const uint8_t *code,
+                             unsigned size);
+  float (*inner_product_fp16)(const float *q, const uint16_t *code,
+                              unsigned size);
+  // Asymmetric distance of a product-quantized code (see
+  // product_quantizer.h): sum over m of table[m * 256 + code[m]].
+  float (*pq_distance)(const float *table, const uint8_t *code,
+                       unsigned num_subspaces);
+};
+
+const DistanceKernels &GetDistanceKernels();
+
+// Kernels compiled for vectors of exactly dim floats (96, 100, 104, 128, 200,
+// 256 or 960), whose size arguments are ignored. Other dimensions get the
+// generic table above.
+const DistanceKernels &GetDistanceKernels(unsigned dim);
+
+// IEEE half precision conversions, rounding to nearest even.
+float HalfToFloat(uint16_t h);
+uint16_t FloatToHalf(float f);
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_DISTANCE_KERNELS_H
@@ -41,11 +41,17 @@ class Index {
 
   inline const float *GetDataset() const { return data_; }
 
+  inline Metric GetMetric() const { return metric_; }
+
  protected:
   const size_t dimension_;
   const float *data_;
   size_t nd_;
   bool has_built;
+  // Graph construction always works on an L2-like distance_; for
+  // INNER_PRODUCT and COSINE it is the L2 distance of the transformed
+  // vectors (see distance.h).
+  Metric metric_;
   Distance *distance_;
 };
 
@@ -0,0 +1,109 @@
+#ifndef EFANNA2E_INDEX_FILE_H
+#define EFANNA2E_INDEX_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace efanna2e {
+
+// Sectioned container of the SSG index files:
+//   header: magic "SSGINDEX", format version, section count
+//   table of up to kMaxSections entries: id, CRC-32C, offset, size
+//   payloads, each starting at a multiple of kSectionAlignment unless
+//   written contiguous with the previous one
+// Page-aligned payloads can be mapped in place; the CRC of every section
+// lets a reader reject a truncated or corrupt file.
+enum SectionId : uint32_t {
+  SECTION_META = 1,             // IndexSSG parameters
+  SECTION_ENTRY_POINTS = 2,     // unsigned[num]
+  SECTION_GRAPH_OFFSETS = 3,    // uint64_t[nd + 1], CSR row offsets
+  SECTION_GRAPH_NEIGHBORS = 4,  // unsigned[], CSR neighbor ids
+  SECTION_REORDER = 5,          // unsigned[nd], node order of a reordered graph
+  SECTION_PCA = 6,              // PCARotation::Save()
+  SECTION_QUANTIZER = 7,        // ScalarQuantizer::Save()
+  SECTION_PQ = 8,               // ProductQuantizer::Save()
+  SECTION_NODES = 9,            // optimized graph nodes, as in memory
+  SECTION_HASH_CODES = 10,      // ADA-NNS hashed set
+  SECTION_HASH_FUNCTION = 11,   // ADA-NNS hash function
+};
+
+// CRC-32C (Castagnoli) of size bytes, continuing from crc. Uses the SSE4.2
+// instruction when the CPU has it.
+uint32_t Crc32c(const void *data, size_t size, uint32_t crc = 0);
+
+// Entry of the section table, as stored.
+struct SectionEntry {
+  uint32_t id;
+  uint32_t crc;
+  uint64_t offset;
+  uint64_t size;
+};
+
+class IndexFileWriter {
+ public:
+  static const size_t kMaxSections = 64;
+  static const size_t kSectionAlignment = 4096;
+
+  // Throws std::runtime_error if filename cannot be created.
+  explicit IndexFileWriter(const char *filename);
+
+  // Starts a section. contiguous places its payload right after the
+  // previous one, so a reader can map both as one region.
+  void Begin(uint32_t id, bool contiguous = false);
+  void Write(const void *data, size_t size);
+  void End();
+  void Add(uint32_t id, const void *data, size_t size) {
+    Begin(id);
+    Write(data, size);
+    End();
+  }
+  void Add(uint32_t id, const std::string &bytes) {
+    Add(id, bytes.data(), bytes.size());
+  }
+
+  // Writes the section table. Throws std::runtime_error on I/O errors.
+  void Finish();
+
+ private:
+  std::string filename_;
+  std::ofstream out_;
+  std::vector<SectionEntry> entries_;
+  uint64_t pos_;
+  bool open_section_;
+};
+
+class IndexFileReader {
+ public:
+  // Reads the section table. Throws std::runtime_error if filename is not
+  // a container or its table is corrupt.
+  explicit IndexFileReader(const char *filename);
+
+  // True if filename starts with the container magic.
+  static bool Recognize(const char *filename);
+
+  bool Has(uint32_t id) const { return Find(id) != nullptr; }
+  uint64_t offset(uint32_t id) const;
+  uint64_t size(uint32_t id) const;
+
+  // Reads section id, which must be exactly size bytes, into out and
+  // checks its CRC. Throws std::runtime_error.
+  void Read(uint32_t id, void *out, size_t size);
+  std::string Read(uint32_t id);
+  // Checks the CRC of section id against its payload already in memory.
+  void Verify(uint32_t id, const void *data) const;
+
+ private:
+  const SectionEntry *Find(uint32_t id) const;
+  const SectionEntry &Get(uint32_t id) const;
+
+  std::string filename_;
+  std::ifstream in_;
+  std::vector<SectionEntry> entries_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_INDEX_FILE_H
@@ -4,13 +4,18 @@
 #include <boost/dynamic_bitset.hpp>
 #include <cassert>
 #include <sstream>
-#include <stack>
 #include <string>
 #include <unordered_map>
 
+#include "compact_graph.h"
 #include "index.h"
+#include "memory_policy.h"
 #include "neighbor.h"
 #include "parameters.h"
+#include "pca.h"
+#include "product_quantizer.h"
+#include "quantizer.h"
+#include "search_context.h"
 #include "util.h"
 
 namespace efanna2e {
@@ -22,17 +27,125 @@ class IndexSSG : public Index {
 
   virtual ~IndexSSG();
 
+  // Writes the graph as an index file (see index_file.h): CSR adjacency and
+  // entry points, each with a checksum. Load() also reads the original
+  // unsectioned format. Both throw std::runtime_error on I/O errors or a
+  // corrupt file.
   virtual void Save(const char *filename) override;
   virtual void Load(const char *filename) override;
 
+  // Builds the graph from the kNN graph file "nn_graph_path" (efanna
+  // format) or, without one, from a kNN graph computed here by NN-Descent
+  // with the efanna parameters "nnd_K", "nnd_L", "nnd_iter", "nnd_S" and
+  // "nnd_R" (defaults 200, 200, 10, 10, 100). NN-Descent stops early once an
+  // iteration changes fewer than "nnd_delta" (default 0.002) of the K * n
+  // list entries. "nn_graph_save_path" optionally keeps the computed graph.
   virtual void Build(size_t n, const float *data,
                      const Parameters &parameters) override;
 
+  // Adds n rows (stride GetDimension()) as nodes nd_, nd_ + 1, ... of a
+  // built or optimized index, in batches searched in parallel: each new
+  // node is linked like in Build() to the nodes a search of "L" from the
+  // entry points meets, pruned to "R" with the angle "A", and its reverse
+  // edges are merged into the neighbors' lists (pruned again when full).
+  // Nodes left unreachable are linked as in Build(). The index keeps its
+  // own copy of all rows (GetDataset()), which the plain Search() must be
+  // given from then on. An optimized graph is rewritten with the trained
+  // PCA rotation and quantizers; with ADA-NNS the new nodes are hashed
+  // with the existing hash function (the hash files are not rewritten).
+  // Two effects are not undone and are reported on stderr: byte codes
+  // (SQ8, U8, I8) clamp new values outside the range fitted to the
+  // original rows, and for INNER_PRODUCT a new largest norm changes the
+  // MIPS transform under which the existing edges were chosen. Rebuild
+  // the index when either is large.
+  // Throws std::logic_error without a graph and its data rows (Load()
+  // alone, or OptimizeGraphFromFile()).
+  void Insert(const float *vecs, size_t n, const Parameters &parameters);
+
   virtual void Search(const float *query, const float *x, size_t k,
                       const Parameters &parameters, unsigned *indices) override;
-  void SearchWithOptGraph(const float *query, boost::dynamic_bitset<>& flags, size_t K,
-                          const Parameters &parameters, unsigned *indices);
+  // The search entry points below optionally write the K result distances
+  // to distances, which may be nullptr: squared L2, or for INNER_PRODUCT the
+  // inner product and for COSINE the cosine similarity (larger is closer).
+  SearchResult Search(const float *query, const float *x, size_t K,
+                      const Parameters &parameters, unsigned *indices,
+                      float *distances);
+  SearchResult SearchWithOptGraph(const float *query, size_t K,
+                                  const Parameters &parameters,
+                                  unsigned *indices,
+                                  float *distances = nullptr);
+  // Allocation-free variant: ctx must come from InitSearchContext() and must
+  // not be shared between concurrently running queries. Loading, optimizing
+  // or Insert() invalidates the contexts of an index; the next search
+  // through one re-initializes it, which allocates.
+  SearchResult SearchWithOptGraph(const float *query, SearchContext &ctx,
+                                  size_t K, unsigned *indices,
+                                  float *distances = nullptr);
+  void InitSearchContext(SearchContext &ctx,
+                         const Parameters &parameters) const;
+  // Searches nq queries (stride GetDimension()) in parallel and writes the
+  // K results of query i to ids[i * K]. dists and results may be nullptr.
+  void SearchBatch(const float *queries, size_t nq, size_t K,
+                   const Parameters &parameters, unsigned *ids, float *dists,
+                   SearchResult *results = nullptr);
+  // data must outlive the searches that use the "rerank" parameter.
   void OptimizeGraph(const float *data);
+  // Same, streaming the base vectors from a vector file (any format of
+  // vecs_file.h) into the nodes a few thousand rows at a time, so no copy
+  // of the data set is held. Rows are zero-padded to the index dimension;
+  // byte-valued files pair with the U8 / I8 encodings. Reranking is unavailable
+  // (no data rows are kept). Throws std::runtime_error if the file does
+  // not match the index.
+  void OptimizeGraphFromFile(const char *filename);
+  // Writes the optimized graph with everything the search needs (entry
+  // points, node order, PCA, quantizers, ADA-NNS hashes if generated) as an
+  // index file. The node array is stored exactly as in memory.
+  void SaveOptimized(const char *filename) const;
+  // Replaces Load() + OptimizeGraph(): maps the node array of a file from
+  // SaveOptimized() instead of rebuilding it, so the pages are loaded on
+  // demand and shared between processes. data (original rows, may be
+  // nullptr) is only used to rerank. populate prefaults the whole mapping;
+  // huge_pages asks for transparent huge pages. The node checksum is
+  // verified whenever the nodes are read in full (populate, or a copy).
+  // Throws std::runtime_error if the file does not match this index or is
+  // corrupt.
+  void LoadOptimized(const char *filename, const float *data = nullptr,
+                     bool populate = false, bool huge_pages = false);
+  // Stores the optimized graph in PCA-rotated coordinates, ordered by
+  // decreasing variance, and rotates each query on the fly. Distances are
+  // unchanged; early-abandoning search ("early_abandon") rejects candidates
+  // after fewer dimensions on high-dimensional data. Call before
+  // OptimizeGraph(). ADA-NNS hashes are computed in the rotated space.
+  void SetPCARotation(bool enable) { use_pca_ = enable; }
+  // Stores the optimized graph's vectors as FP16 or SQ8 codes (see
+  // quantizer.h) instead of floats: nodes shrink 2-4x at some loss of
+  // distance precision, which the "rerank" search parameter recovers. U8
+  // and I8 shrink byte-valued data sets 4x without loss.
+  // Early abandoning needs FP32. Call before OptimizeGraph().
+  void SetVectorEncoding(VectorEncoding encoding) { encoding_ = encoding; }
+  // Renumbers the nodes of the optimized graph in breadth-first order from
+  // the entry points, so expanding a node touches nearby memory. Results
+  // are still reported in the original ids. Call before OptimizeGraph().
+  void SetGraphReordering(bool enable) { reorder_ = enable; }
+  // Where the optimized graph is allocated (see memory_policy.h). With
+  // MEMORY_REPLICATE each query reads the copy on its thread's NUMA node,
+  // and SearchBatch() binds its threads evenly to the nodes while it runs. A
+  // policy other than MEMORY_DEFAULT makes LoadOptimized() copy the nodes
+  // instead of mapping the file. Call before OptimizeGraph() or
+  // LoadOptimized().
+  void SetMemoryPolicy(MemoryPolicy policy) { memory_policy_ = policy; }
+  // Bytes per node code of Metric PQ, one per subspace; 0 (default) uses
+  // dim / 4. Call before OptimizeGraph().
+  void SetPQSubspaces(unsigned num_subspaces) {
+    pq_subspaces_ = num_subspaces;
+  }
+
+  // Queries with L_search <= max_L track visited nodes in a small hash set
+  // instead of the dense per-thread table. 0 (default) always uses the table.
+  void SetSparseVisitedThreshold(const unsigned max_L) {
+    sparse_visited_L_ = max_L;
+    InitThreadContexts();
+  }
 
 #ifdef GET_DIST_COMP
   uint64_t GetTotalDistComp() { return total_dist_comp_; }
@@ -45,8 +158,12 @@ class IndexSSG : public Index {
   void GenerateHashedSet (char* file_name);
   bool ReadHashFunction (char* file_name);
   bool ReadHashedSet (char* file_name);
+  // True once the hash function and hashed set are in place, e.g. after
+  // LoadOptimized() of a file saved with them.
+  bool HasHashes() const { return hash_function_ != nullptr && hashed_set_ != nullptr; }
   void QueryHash (const float* query, unsigned* hashed_query, unsigned hash_size);
-  unsigned int CandidateSelection(const __m256i* hashed_query_avx, std::vector<HashNeighbor>& selected_pool, boost::dynamic_bitset<>& flags, const unsigned* neighbors, const unsigned MaxM, const unsigned hash_size);
+  template <typename Visited>
+  unsigned int CandidateSelection(const unsigned* hashed_query, const unsigned* hashed_set, std::vector<HashNeighbor>& selected_pool, const Visited& flags, const unsigned* neighbors, const unsigned MaxM, const unsigned hash_size);
 #endif
 #ifdef PROFILE
   void SetTimer(const uint32_t num_threads) { profile_time.resize(num_threads * 4, 0.0); }
@@ -60,7 +177,6 @@ class IndexSSG : public Index {
   size_t Get_nd() { return nd_; }
 
  protected:
-  typedef std::vector<std::vector<unsigned>> CompactGraph;
   typedef std::vector<SimpleNeighbors> LockGraph;
   typedef std::vector<nhood> KNNGraph;
 
@@ -69,37 +185,193 @@ class IndexSSG : public Index {
 
   void init_graph(const Parameters &parameters);
   void get_neighbors(const float *query, const Parameters &parameter,
-                     std::vector<Neighbor> &retset,
+                     CandidatePool &retset,
                      std::vector<Neighbor> &fullset);
+  // Fills ctx.pool with the candidates of node q.
   void get_neighbors(const unsigned q, const Parameters &parameter,
-                     std::vector<Neighbor> &pool);
-  void sync_prune(unsigned q, std::vector<Neighbor> &pool,
+                     BuildContext &ctx);
+  // Prunes ctx.pool plus the neighbors of node q into des_pool, R entries
+  // terminated by distance -1 if fewer.
+  void sync_prune(unsigned q, BuildContext &ctx,
                   const Parameters &parameter, float threshold,
-                  SimpleNeighbor *cut_graph_);
+                  SimpleNeighbor *des_pool);
+  // The SSG rule on pool, sorted by distance to its node: keeps a candidate
+  // unless its angle to a kept closer one is below acos(threshold), at most
+  // range of them.
+  void PruneByAngle(const std::vector<SimpleNeighbor> &pool, unsigned range,
+                    float threshold, std::vector<SimpleNeighbor> &result) const;
   void Link(const Parameters &parameters, SimpleNeighbor *cut_graph_);
-  void InterInsert(unsigned n, unsigned range, float threshold,
-                   std::vector<std::mutex> &locks, SimpleNeighbor *cut_graph_);
+  // Adds the reverse of every cut_graph_ edge to the destination's pool,
+  // pruning a pool once if its new edges overflow it. Lock-free: the edges
+  // are grouped by destination with a radix sort.
+  void InterInsert(unsigned range, float threshold, SimpleNeighbor *cut_graph_);
   void Load_nn_graph(const char *filename);
-  void strong_connect(const Parameters &parameter);
+  // NN-Descent (Dong et al., WWW'11) kNN graph of data_ into final_graph_,
+  // for Build() without "nn_graph_path". Uses nnd_graph while running.
+  void BuildKnnGraph(const Parameters &parameters);
+  void InitKnnGraph(unsigned L, unsigned S);
+  // One local join over every node; returns the number of pool updates.
+  size_t KnnJoin();
+  void KnnUpdate(unsigned L, unsigned S, unsigned R);
+  // Writes final_graph_ in the efanna kNN graph format of Load_nn_graph().
+  void SaveKnnGraph(const char *filename) const;
+  // Gives distance_ the per-row values of the data_ rows: the largest
+  // squared norm and the extra coordinates for INNER_PRODUCT, the inverse
+  // norms for COSINE. Call it whenever data_ changes. Returns the largest
+  // squared norm of rows [0, num_old) (0 for the other metrics).
+  float UpdateRowNorms(size_t num_old = 0);
+  // Values of rows [begin, nd_) of data_ that the byte codes of the
+  // optimized graph clamp.
+  size_t CountClamped(size_t begin) const;
+  // Load() of a graph in the original unsectioned format.
+  void LoadUnsectioned(const char *filename);
+  // Throws std::runtime_error if an entry point read from a file is not a
+  // node.
+  void CheckEntryPoints() const;
+  // Makes every node reachable from eps_ (n_try random nodes): each
+  // component left out is linked from the nearest node reachable from
+  // eps_, with all components searched in parallel. Deterministic for a
+  // given eps_.
+  void RepairConnectivity(const Parameters &parameter);
+  // The linking of RepairConnectivity() for the current eps_.
+  void LinkUnreachable(unsigned L);
+  // Marks the nodes reachable from frontier and not yet in reached, level by
+  // level, in parallel for large levels. Consumes frontier.
+  void MarkReachable(std::vector<unsigned> &frontier,
+                     std::vector<uint8_t> &reached) const;
+  // Closest node to node q with a free slot among those a search from eps_
+  // meets (the closest one if all are full).
+  unsigned NearestReachable(unsigned q, unsigned L, CandidatePool &retset,
+                            BuildContext &ctx) const;
+  // Search of width L for node q from eps_ over final_graph_. Leaves the
+  // closest nodes in retset and every node met, with its distance, in
+  // ctx.pool.
+  void SearchFromEntryPoints(unsigned q, unsigned L, CandidatePool &retset,
+                             BuildContext &ctx) const;
+  // Links nodes [begin, end) of Insert(), whose rows are empty.
+  void InsertBatch(size_t begin, size_t end, const Parameters &parameters);
+  // Rebuilds final_graph_, in original ids, from the optimized graph.
+  void RestoreGraph();
+  // Lays out opt_graph_ again for the current nd_ and width and refills it
+  // from data_, keeping the trained transforms and ADA-NNS hashes; nodes
+  // from old_nd on follow the old ones in a reordered graph.
+  void RelayoutOptGraph(size_t old_nd);
 
-  void DFS(boost::dynamic_bitset<> &flag,
-           std::vector<std::pair<unsigned, unsigned>> &edges, unsigned root,
-           unsigned &cnt);
-  bool check_edge(unsigned u, unsigned t);
-  void findroot(boost::dynamic_bitset<> &flag, unsigned &root,
-                const Parameters &parameter);
-  void DFS_expand(const Parameters &parameter);
+  // Ranking keys of the plain Search(): distance_, except for INNER_PRODUCT
+  // where it is -<q,x>.
+  void QueryDistances(const float *query, const float *const *xs, unsigned n,
+                      float *out) const;
+  // Converts a QueryDistances() key to the reported distance.
+  float ReportedDistance(float dist) const;
+  // Rescores the candidates left in ctx.retset with QueryDistances() on the
+  // original data_ rows and writes the best K. Returns how many.
+  unsigned RerankResults(const float *query, SearchContext &ctx, size_t K,
+                         unsigned *indices, float *distances) const;
+  // A data row as stored in the optimized graph: unit-normalized for COSINE
+  // and rotated with SetPCARotation(). unit and rotated are dim floats of
+  // scratch.
+  const float *TransformedRow(const float *row, float *unit,
+                              float *rotated) const;
+  // Sorted ids of the rows that train the PCA rotation and PQ codebooks.
+  std::vector<unsigned> SampleRows() const;
+  // Trains on samples (rows of SampleRows()), sets the node layout and
+  // allocates opt_graph_. Returns the old-to-new id map if reordering.
+  std::vector<unsigned> PrepareOptGraph(const std::vector<float> &samples);
+  // Writes the nodes of the n rows of original ids begin.. and releases
+  // their final_graph_ rows. Called on chunks of kStreamRows rows, so the
+  // graph shrinks while the nodes fill.
+  void FillNodes(const float *rows, size_t begin, size_t n,
+                 const std::vector<unsigned> &old_to_new);
+  // Fills new_to_old_ with the breadth-first order of final_graph_.
+  void ReorderGraph();
+  unsigned OriginalId(unsigned id) const {
+    return new_to_old_.empty() ? id : new_to_old_[id];
+  }
+  // Widens the per-dimension [min, max] to the n rows as transformed, for
+  // the SQ8 range of quantizer_.
+  void UpdateRange(const float *rows, size_t n, std::vector<float> &min,
+                   std::vector<float> &max) const;
+  // Fits the codebooks of pq_ to the n sample rows as transformed.
+  void TrainProductQuantizer(const float *samples, size_t n);
+  // Node vectors of the optimized graph: PQ codes for Metric PQ, otherwise
+  // encoded by quantizer_.
+  bool EncodedVectors() const { return metric_ == PQ || encoding_ != FP32; }
+  size_t CodeSize() const;
+  void EncodeRow(const float *row, char *code) const;
+  void DecodeRow(const char *code, float *row) const;
+
+  // Drops the per-thread contexts and invalidates those of callers.
+  void InitThreadContexts();
+  // Sizes the buffers of ctx for ctx.params and the current graph.
+  void ResizeSearchContext(SearchContext &ctx) const;
+  // Bytes of opt_graph_: the nodes, then the ADA-NNS hashes if enabled.
+  size_t OptGraphBytes() const;
+  void FreeOptGraph();
+#ifdef ADA_NNS
+  // Copies the hash region of the first copy of opt_memory_ to the others.
+  void ReplicateHashes();
+  // Hashes nodes [begin, end) of opt_graph_ into hashed_set_ with
+  // hash_function_.
+  void HashNodes(size_t begin, size_t end);
+  // Throws std::logic_error unless HasHashes().
+  void CheckHashes() const;
+#endif
+  SearchContext &GetThreadContext(const Parameters &parameters);
+  template <typename Scorer, typename Visited>
+  SearchResult SearchWithOptGraphImpl(const float *query, SearchContext &ctx,
+                                      Visited &flags, size_t K,
+                                      unsigned *indices, float *distances);
+  template <typename Scorer>
+  SearchResult SearchWithScorer(const float *query, SearchContext &ctx,
+                                size_t K, unsigned *indices,
+                                float *distances);
+
+  // Search loop instantiated for one scorer (see search_scorer.h), chosen
+  // from the dimension by OptimizeGraph().
+  typedef SearchResult (IndexSSG::*OptSearchFn)(const float *, SearchContext &,
+                                                size_t, unsigned *, float *);
+  static OptSearchFn SelectOptSearch(unsigned dim, Metric metric,
+                                     VectorEncoding encoding);
 
  private:
+  DistanceFastL2 dist_fast_;  // node distances of the optimized graph
   unsigned width;
   unsigned ep_; //not in use
   std::vector<unsigned> eps_;
   std::vector<std::mutex> locks;
-  char *opt_graph_;
+  char *opt_graph_ = nullptr;
+  // Set when opt_graph_ lies in an mmap'd file; otherwise it is the first
+  // copy of opt_memory_.
+  void *mapping_ = nullptr;
+  size_t mapping_size_ = 0;
+#ifdef MMAP_HUGETLB
+  MemoryPolicy memory_policy_ = MEMORY_HUGETLB;
+#else
+  MemoryPolicy memory_policy_ = MEMORY_DEFAULT;
+#endif
+  PlacedMemory opt_memory_;
+  OptSearchFn opt_search_ = nullptr;
+  bool use_pca_ = false;
+  PCARotation pca_;
+  VectorEncoding encoding_ = FP32;
+  ScalarQuantizer quantizer_;
+  ProductQuantizer pq_;
+  unsigned pq_subspaces_ = 0;
+  bool reorder_ = false;
+  std::vector<unsigned> new_to_old_;  // empty unless reordered
+  // Rows of data_ once Insert() has added some.
+  std::vector<float> owned_data_;
   size_t node_size;
   size_t data_len;
   size_t neighbor_len;
   KNNGraph nnd_graph;
+  // One lazily created context per OpenMP thread, used by the overloads
+  // that take a Parameters map.
+  std::vector<std::unique_ptr<SearchContext>> thread_contexts_;
+  unsigned sparse_visited_L_ = 0;
+  // Bumped by InitThreadContexts(); a SearchContext of another generation
+  // is resized before use.
+  unsigned generation_ = 0;
 #ifdef GET_DIST_COMP
   uint64_t total_dist_comp_ = 0; // # of distance compute during search
   uint64_t total_dist_comp_miss_ = 0; // # of distance compute, but not pushed in candidated pool
@@ -109,8 +381,8 @@ class IndexSSG : public Index {
               // _tau = 0.3 means only top 30% of neighbors 
               // having the smallest angular distance to the query are selected
   unsigned int hash_bitwidth_;
-  float* hash_function_;
-  unsigned int* hashed_set_;
+  float* hash_function_ = nullptr;
+  unsigned int* hashed_set_ = nullptr;
 #endif
 #ifdef PROFILE
   std::vector<double> profile_time;
@@ -0,0 +1,83 @@
+#ifndef EFANNA2E_MEMORY_POLICY_H
+#define EFANNA2E_MEMORY_POLICY_H
+
+#include <sched.h>
+#include <cstddef>
+#include <vector>
+
+namespace efanna2e {
+
+// Placement of the optimized graph (nodes and ADA-NNS hashes) in memory.
+// Every policy but MEMORY_DEFAULT also asks for transparent huge pages.
+enum MemoryPolicy {
+  MEMORY_DEFAULT = 0,     // malloc
+  MEMORY_THP = 1,         // 2 MB aligned mmap with madvise(MADV_HUGEPAGE)
+  MEMORY_HUGETLB = 2,     // hugetlbfs pages (MAP_HUGETLB), else MEMORY_THP
+  MEMORY_INTERLEAVE = 3,  // pages interleaved across the NUMA nodes
+  MEMORY_REPLICATE = 4,   // one copy bound to each NUMA node
+};
+
+// Online NUMA nodes in ascending order; {0} if the topology is unknown.
+const std::vector<int> &NumaNodes();
+// NUMA node of the CPU the calling thread runs on.
+int CurrentNumaNode();
+// Restricts the calling thread to the CPUs of node. Returns false if that
+// fails (the affinity is then unchanged).
+bool BindThreadToNumaNode(int node);
+
+// BindThreadToNumaNode() for the lifetime of the object: the calling
+// thread's previous affinity is restored on destruction.
+class ScopedNumaBinding {
+ public:
+  explicit ScopedNumaBinding(int node);
+  ~ScopedNumaBinding();
+  ScopedNumaBinding(const ScopedNumaBinding &) = delete;
+  ScopedNumaBinding &operator=(const ScopedNumaBinding &) = delete;
+
+ private:
+  cpu_set_t saved_;
+  bool bound_;
+};
+
+// Memory placed according to a MemoryPolicy. NUMA placement goes through
+// the mbind system call and is a hint: where it is unavailable the memory
+// is still usable, just not placed. Huge page requests fall back the same
+// way.
+class PlacedMemory {
+ public:
+  PlacedMemory() {}
+  ~PlacedMemory() { Free(); }
+  PlacedMemory(const PlacedMemory &) = delete;
+  PlacedMemory &operator=(const PlacedMemory &) = delete;
+
+  // Frees the current memory and allocates size bytes. Throws
+  // std::bad_alloc. With MEMORY_REPLICATE the result is the first node's
+  // copy; call Replicate() after writing to it.
+  char *Allocate(size_t size, MemoryPolicy policy);
+  void Free();
+
+  // Copies bytes [offset, offset + size) of the first copy to the others.
+  void Replicate(size_t offset, size_t size);
+  void Replicate() { Replicate(0, size_); }
+
+  char *data() const { return blocks_.empty() ? nullptr : blocks_[0].addr; }
+  size_t size() const { return size_; }
+  bool replicated() const { return blocks_.size() > 1; }
+  // The copy on the calling thread's NUMA node (the only one unless
+  // replicated).
+  char *local() const;
+
+ private:
+  struct Block {
+    char *addr;
+    size_t mapped;  // 0: malloc'd
+  };
+
+  std::vector<Block> blocks_;
+  std::vector<int> node_block_;  // NUMA node -> index in blocks_
+  size_t size_ = 0;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_MEMORY_POLICY_H
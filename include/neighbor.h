@@ -44,7 +44,7 @@ struct nhood {
   std::vector<unsigned> rnn_old;
   std::vector<unsigned> rnn_new;
 
-  nhood() {}
+  nhood() { pthread_mutex_init(&lock, NULL); }
   nhood(unsigned l, unsigned s, std::mt19937 &rng, unsigned N) {
     M = s;
     nn_new.resize(s * 2);
@@ -60,18 +60,20 @@ struct nhood {
               std::back_inserter(nn_new));
     nn_new.reserve(other.nn_new.capacity());
     pool.reserve(other.pool.capacity());
+    pthread_mutex_init(&lock, NULL);
   }
-  void insert(unsigned id, float dist) {
+  // Returns true if id entered the pool.
+  bool insert(unsigned id, float dist) {
     // LockGuard guard(lock);
     pthread_mutex_lock(&lock);
     if (dist > pool.front().distance) {
       pthread_mutex_unlock(&lock);
-      return;
+      return false;
     }
     for (unsigned i = 0; i < pool.size(); i++) {
       if (id == pool[i].id) {
         pthread_mutex_unlock(&lock);
-        return;
+        return false;
       }
     }
     if (pool.size() < pool.capacity()) {
@@ -83,6 +85,7 @@ struct nhood {
       std::push_heap(pool.begin(), pool.end());
     }
     pthread_mutex_unlock(&lock);
+    return true;
   }
 
   template <typename C>
@@ -123,39 +126,6 @@ struct SimpleNeighbors {
   std::vector<SimpleNeighbor> pool;
 };
 
-static inline int InsertIntoPool(Neighbor *addr, unsigned K, Neighbor nn) {
-  // find the location to insert
-  int left = 0, right = K - 1;
-  if (addr[left].distance > nn.distance) {
-    memmove((char *)&addr[left + 1], &addr[left], K * sizeof(Neighbor));
-    addr[left] = nn;
-    return left;
-  }
-  if (addr[right].distance < nn.distance) {
-    addr[K] = nn;
-    return K;
-  }
-  while (left < right - 1) {
-    int mid = (left + right) / 2;
-    if (addr[mid].distance > nn.distance)
-      right = mid;
-    else
-      left = mid;
-  }
-  // check equal ID
-
-  while (left > 0) {
-    if (addr[left].distance < nn.distance) break;
-    if (addr[left].id == nn.id) return K + 1;
-    left--;
-  }
-  if (addr[left].id == nn.id || addr[right].id == nn.id) return K + 1;
-  memmove((char *)&addr[right + 1], &addr[right],
-          (K - right) * sizeof(Neighbor));
-  addr[right] = nn;
-  return right;
-}
-
 #ifdef ADA_NNS
 struct HashNeighbor{
   unsigned id;
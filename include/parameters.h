@@ -45,10 +45,10 @@ class Parameters {
 
   template <typename ParamType>
   inline ParamType Get(const std::string &name,
-                       const ParamType &default_value) {
+                       const ParamType &default_value) const {
     try {
       return Get<ParamType>(name);
-    } catch (std::invalid_argument e) {
+    } catch (const std::invalid_argument &) {
       return default_value;
     }
   }
@@ -0,0 +1,37 @@
+#ifndef EFANNA2E_PCA_H
+#define EFANNA2E_PCA_H
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace efanna2e {
+
+// Orthonormal rotation onto the principal axes of a data set, ordered by
+// decreasing variance. Rotating both sides preserves L2 distances and inner
+// products, and front-loads the energy of a difference vector into its
+// leading coordinates, which is what early-abandoning distance loops want.
+class PCARotation {
+ public:
+  PCARotation() : dim_(0) {}
+
+  // Fits the axes on up to max_samples rows of data (n x dim, row-major).
+  void Train(const float *data, size_t n, unsigned dim, size_t max_samples);
+
+  bool trained() const { return dim_ != 0; }
+  unsigned dim() const { return dim_; }
+
+  // out = R * in. in and out must not overlap.
+  void Apply(const float *in, float *out) const;
+
+  void Save(std::ostream &out) const;
+  void Load(std::istream &in);
+
+ private:
+  unsigned dim_;
+  std::vector<float> rotation_;  // dim_ x dim_, row i is the i-th axis
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_PCA_H
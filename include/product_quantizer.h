@@ -0,0 +1,59 @@
+#ifndef EFANNA2E_PRODUCT_QUANTIZER_H
+#define EFANNA2E_PRODUCT_QUANTIZER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+namespace efanna2e {
+
+// Product quantizer: the dimensions are split into num_subspaces contiguous
+// groups of (nearly) equal size, and each group is coded with the index of
+// its nearest of 256 k-means centroids, one byte per group. A query scores
+// a code by asymmetric distance computation (ADC): the squared L2 distance
+// from each query group to all 256 centroids is tabulated once per query,
+// and a code's distance is the sum of num_subspaces table entries.
+class ProductQuantizer {
+ public:
+  static const unsigned kNumCentroids = 256;
+
+  ProductQuantizer() : dim_(0), num_subspaces_(0) {}
+
+  // Fits the codebooks with iterations rounds of k-means on the n rows of
+  // data (n x dim, row-major).
+  void Train(const float *data, size_t n, unsigned dim,
+             unsigned num_subspaces, unsigned iterations);
+
+  bool trained() const { return num_subspaces_ != 0; }
+  unsigned dim() const { return dim_; }
+  unsigned num_subspaces() const { return num_subspaces_; }
+  // Bytes per code, padded to a multiple of 4.
+  size_t code_size() const { return (num_subspaces_ + 3) & ~3u; }
+  // Floats in the table of ComputeTable().
+  size_t table_size() const { return (size_t)num_subspaces_ * kNumCentroids; }
+
+  void Encode(const float *x, uint8_t *code) const;
+  void Decode(const uint8_t *code, float *x) const;
+
+  // table[m * 256 + c] = |q_m - centroid_{m,c}|^2.
+  void ComputeTable(const float *query, float *table) const;
+
+  void Save(std::ostream &out) const;
+  void Load(std::istream &in);
+
+ private:
+  const float *centroid(unsigned m, unsigned c) const {
+    return &centroids_[(size_t)offsets_[m] * kNumCentroids +
+                       (size_t)c * (offsets_[m + 1] - offsets_[m])];
+  }
+
+  unsigned dim_;
+  unsigned num_subspaces_;
+  std::vector<unsigned> offsets_;  // first dimension of each group, and dim_
+  std::vector<float> centroids_;   // group m: 256 x its width, in order
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_PRODUCT_QUANTIZER_H
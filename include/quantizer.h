@@ -0,0 +1,60 @@
+#ifndef EFANNA2E_QUANTIZER_H
+#define EFANNA2E_QUANTIZER_H
+
+#include <cstddef>
+#include <iostream>
+#include <vector>
+
+namespace efanna2e {
+
+// Storage format of the vectors in the optimized graph.
+enum VectorEncoding { FP32 = 0, FP16 = 1, SQ8 = 2, U8 = 3, I8 = 4 };
+
+// Scalar codec of the optimized graph's vectors. FP16 stores IEEE half
+// floats; SQ8 stores one byte per dimension, x[j] ~ min[j] + scale[j] * c[j],
+// with the per-dimension range fitted to the data. U8 and I8 are byte codes
+// with the fixed range [0, 255] or [-128, 127] and step 1, which store
+// byte-valued data sets (SIFT, BIGANN) exactly. Codes are padded to a
+// multiple of 4 bytes so the neighbor list that follows stays aligned.
+class ScalarQuantizer {
+ public:
+  ScalarQuantizer() : encoding_(FP32), dim_(0) {}
+
+  void Init(VectorEncoding encoding, unsigned dim);
+
+  VectorEncoding encoding() const { return encoding_; }
+  unsigned dim() const { return dim_; }
+  size_t code_size() const;
+
+  // True for the one-byte-per-dimension encodings (SQ8, U8, I8).
+  bool byte_codes() const {
+    return encoding_ == SQ8 || encoding_ == U8 || encoding_ == I8;
+  }
+
+  // SQ8 only: sets the per-dimension range [min[j], max[j]]. Values outside
+  // it are clamped when encoding.
+  void SetRange(const float *min, const float *max);
+
+  void Encode(const float *x, char *code) const;
+  // Byte codes only: how many of the dim values of x Encode() clamps to the
+  // range; 0 for the other encodings.
+  size_t CountClamped(const float *x) const;
+  void Decode(const char *code, float *x) const;
+
+  // Byte codes only: <q, decode(c)> = offset + sum_j scaled[j] * c[j]. Writes the
+  // dim scaled query values and returns the offset.
+  float PrepareQuery(const float *query, float *scaled) const;
+
+  void Save(std::ostream &out) const;
+  void Load(std::istream &in);
+
+ private:
+  VectorEncoding encoding_;
+  unsigned dim_;
+  std::vector<float> min_;
+  std::vector<float> scale_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_QUANTIZER_H
@@ -0,0 +1,94 @@
+#ifndef EFANNA2E_SEARCH_CONTEXT_H
+#define EFANNA2E_SEARCH_CONTEXT_H
+
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "candidate_pool.h"
+#include "neighbor.h"
+#include "parameters.h"
+#include "visited_list.h"
+
+namespace efanna2e {
+
+// Search parameters parsed once from the string-keyed Parameters map.
+struct SearchParameters {
+  unsigned L_search;
+  // "early_abandon" (optional, 0 or 1): compute neighbor distances in blocks
+  // and stop once the partial sum exceeds the L-th candidate.
+  bool early_abandon;
+  // "rerank" (optional, 0 or 1): rescore the final L candidates on the
+  // original vectors, for FP16/SQ8 encoded graphs.
+  bool rerank;
+
+  SearchParameters() : L_search(0), early_abandon(false), rerank(false) {}
+  explicit SearchParameters(const Parameters &parameters)
+      : L_search(parameters.Get<unsigned>("L_search")),
+        early_abandon(parameters.Get<unsigned>("early_abandon", 0) != 0),
+        rerank(parameters.Get<unsigned>("rerank", 0) != 0) {}
+};
+
+// Per-query summary returned by the search entry points.
+struct SearchResult {
+  unsigned num_results;     // valid entries written to indices/distances
+  unsigned num_hops;        // candidates expanded
+  unsigned num_dist_comps;  // distances computed
+
+  SearchResult() : num_results(0), num_hops(0), num_dist_comps(0) {}
+};
+
+// Per-thread scratch state of the query hot path. Create one per worker with
+// IndexSSG::InitSearchContext() and reuse it: searching through a context
+// performs no heap allocation and takes no lock.
+struct SearchContext {
+  SearchParameters params;
+  // IndexSSG generation the buffers are sized for.
+  unsigned generation = 0;
+
+  CandidatePool retset;
+  std::vector<unsigned> init_ids;
+  std::mt19937 rng;
+
+  // Transformed query, dim floats each: unit-normalized (COSINE), rotated
+  // (IndexSSG::SetPCARotation()), then the scorer's scratch.
+  std::vector<float> query_buf;
+
+  // Unvisited neighbors of the node being expanded, scored in one batch;
+  // also the candidates of a rerank.
+  std::vector<unsigned> batch_ids;
+  std::vector<const float *> batch_vecs;
+  std::vector<float> batch_dists;
+  std::vector<Neighbor> rerank_pool;
+
+  // Exactly one of the two is used, chosen from L_search at init time.
+  bool use_sparse_visited = false;
+  std::unique_ptr<VisitedTable> visited;
+  SparseVisitedSet sparse_visited;
+
+#ifdef ADA_NNS
+  std::vector<unsigned> hashed_query;
+  std::vector<HashNeighbor> selected_pool;
+#endif
+};
+
+// Per-thread scratch state of the graph construction (IndexSSG::Link()),
+// reused from node to node. The visited set grows with the candidate pool
+// of one node rather than with the data set, so resetting it costs O(L).
+struct BuildContext {
+  SparseVisitedSet visited;
+  std::vector<Neighbor> pool;
+  std::vector<Neighbor> result;
+  std::vector<SimpleNeighbor> insert_pool;
+  std::vector<SimpleNeighbor> insert_result;
+
+  std::vector<unsigned> batch_ids;
+  std::vector<const float *> batch_vecs;
+  std::vector<float> batch_dists;
+
+  explicit BuildContext(size_t expected = 1024) : visited(expected) {}
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_SEARCH_CONTEXT_H
@@ -0,0 +1,181 @@
+#ifndef EFANNA2E_SEARCH_SCORER_H
+#define EFANNA2E_SEARCH_SCORER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "distance_kernels.h"
+#include "product_quantizer.h"
+#include "quantizer.h"
+
+namespace efanna2e {
+
+// Scoring policies of the optimized-graph search. A node of the optimized
+// graph is laid out as [|x|^2][x (encoded)][degree][neighbor ids], and a
+// node scores |x|^2 - 2<q,x>, which orders like the squared L2 distance.
+// A scorer is built per query; SetQuery() takes a scratch buffer (dim
+// floats, or the ADC table of PQ) that must outlive the query, and the vec
+// pointers passed in point just past the node's norm.
+//
+// FixedDimScorer fixes dim at compile time, so the offset of the neighbor
+// list is a constant and the kernels are unrolled for that dimension.
+template <unsigned kDim>
+struct FixedDimScorer {
+  // Nodes hold plain floats, so the float kernels (early abandoning) apply.
+  static const bool kFloatVectors = true;
+
+  FixedDimScorer(unsigned, const ScalarQuantizer &, const ProductQuantizer &)
+      : kernels(GetDistanceKernels(kDim)) {}
+
+  unsigned dim() const { return kDim; }
+  size_t data_len() const { return (kDim + 1) * sizeof(float); }
+
+  void SetQuery(const float *query, float *) { query_ = query; }
+  float Score(const float *vec) const {
+    return vec[-1] - 2 * kernels.inner_product(vec, query_, kDim);
+  }
+  void ScoreBatch(const float *const *vecs, unsigned n, float *out) const {
+    kernels.inner_product_batch(query_, vecs, n, kDim, out);
+    for (unsigned i = 0; i < n; i++) out[i] = vecs[i][-1] - 2 * out[i];
+  }
+
+  const DistanceKernels &kernels;
+
+ private:
+  const float *query_ = nullptr;
+};
+
+// Fallback for dimensions without a specialization.
+struct GenericScorer {
+  static const bool kFloatVectors = true;
+
+  GenericScorer(unsigned dim, const ScalarQuantizer &,
+                const ProductQuantizer &)
+      : kernels(GetDistanceKernels()), dim_(dim) {}
+
+  unsigned dim() const { return dim_; }
+  size_t data_len() const { return (dim_ + 1) * sizeof(float); }
+
+  void SetQuery(const float *query, float *) { query_ = query; }
+  float Score(const float *vec) const {
+    return vec[-1] - 2 * kernels.inner_product(vec, query_, dim_);
+  }
+  void ScoreBatch(const float *const *vecs, unsigned n, float *out) const {
+    kernels.inner_product_batch(query_, vecs, n, dim_, out);
+    for (unsigned i = 0; i < n; i++) out[i] = vecs[i][-1] - 2 * out[i];
+  }
+
+  const DistanceKernels &kernels;
+
+ private:
+  unsigned dim_;
+  const float *query_ = nullptr;
+};
+
+// Half float nodes (VectorEncoding FP16).
+struct Fp16Scorer {
+  static const bool kFloatVectors = false;
+
+  Fp16Scorer(unsigned dim, const ScalarQuantizer &quantizer,
+             const ProductQuantizer &)
+      : kernels(GetDistanceKernels(dim)),
+        dim_(dim),
+        data_len_(sizeof(float) + quantizer.code_size()) {}
+
+  unsigned dim() const { return dim_; }
+  size_t data_len() const { return data_len_; }
+
+  void SetQuery(const float *query, float *) { query_ = query; }
+  float Score(const float *vec) const {
+    return vec[-1] - 2 * kernels.inner_product_fp16(
+                             query_, (const uint16_t *)vec, dim_);
+  }
+  void ScoreBatch(const float *const *vecs, unsigned n, float *out) const {
+    for (unsigned i = 0; i < n; i++) out[i] = Score(vecs[i]);
+  }
+
+  const DistanceKernels &kernels;
+
+ private:
+  unsigned dim_;
+  size_t data_len_;
+  const float *query_ = nullptr;
+};
+
+// Byte-coded nodes (VectorEncoding SQ8, U8 and I8). The query is scaled once
+// by the per-dimension step, so a node costs one byte-by-float inner product.
+struct Sq8Scorer {
+  static const bool kFloatVectors = false;
+
+  Sq8Scorer(unsigned dim, const ScalarQuantizer &quantizer,
+            const ProductQuantizer &)
+      : kernels(GetDistanceKernels(dim)),
+        dim_(dim),
+        data_len_(sizeof(float) + quantizer.code_size()),
+        quantizer_(quantizer) {}
+
+  unsigned dim() const { return dim_; }
+  size_t data_len() const { return data_len_; }
+
+  void SetQuery(const float *query, float *scratch) {
+    offset_ = quantizer_.PrepareQuery(query, scratch);
+    scaled_ = scratch;
+  }
+  float Score(const float *vec) const {
+    float ip = offset_ +
+               kernels.inner_product_sq8(scaled_, (const uint8_t *)vec, dim_);
+    return vec[-1] - 2 * ip;
+  }
+  void ScoreBatch(const float *const *vecs, unsigned n, float *out) const {
+    for (unsigned i = 0; i < n; i++) out[i] = Score(vecs[i]);
+  }
+
+  const DistanceKernels &kernels;
+
+ private:
+  unsigned dim_;
+  size_t data_len_;
+  const ScalarQuantizer &quantizer_;
+  const float *scaled_ = nullptr;
+  float offset_ = 0;
+};
+
+// Product-quantized nodes (Metric PQ). Scores are the ADC squared L2
+// distance itself; the norm slot of the node is unused.
+struct PQScorer {
+  static const bool kFloatVectors = false;
+
+  PQScorer(unsigned dim, const ScalarQuantizer &,
+           const ProductQuantizer &quantizer)
+      : kernels(GetDistanceKernels()),
+        dim_(dim),
+        data_len_(sizeof(float) + quantizer.code_size()),
+        quantizer_(quantizer) {}
+
+  unsigned dim() const { return dim_; }
+  size_t data_len() const { return data_len_; }
+
+  void SetQuery(const float *query, float *scratch) {
+    quantizer_.ComputeTable(query, scratch);
+    table_ = scratch;
+  }
+  float Score(const float *vec) const {
+    return kernels.pq_distance(table_, (const uint8_t *)vec,
+                               quantizer_.num_subspaces());
+  }
+  void ScoreBatch(const float *const *vecs, unsigned n, float *out) const {
+    for (unsigned i = 0; i < n; i++) out[i] = Score(vecs[i]);
+  }
+
+  const DistanceKernels &kernels;
+
+ private:
+  unsigned dim_;
+  size_t data_len_;
+  const ProductQuantizer &quantizer_;
+  const float *table_ = nullptr;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_SEARCH_SCORER_H
@@ -1,16 +1,37 @@
 #ifndef EFANNA2E_UTIL_H
 #define EFANNA2E_UTIL_H
 
+#include <cstddef>
+#include <cstdint>
 #include <random>
 
 namespace efanna2e {
 
 void GenRandom(std::mt19937& rng, unsigned* addr, unsigned size, unsigned N);
 
+// The loaders below memory-map the file (see vecs_file.h for the formats,
+// chosen by extension) and throw std::runtime_error if it is missing or
+// malformed. Byte-valued rows are converted to float. Float arrays are
+// 32-byte aligned and released with free().
 float* load_data(const char* filename, unsigned& num, unsigned& dim);
 
+// Rows [begin, begin + count) of a vector file (count is clipped to the
+// file), padded to data_align_dim(dim) in the same pass: load_data() and
+// data_align() without the second copy. num and dim receive the rows read
+// and the padded dimension.
+float* load_data_aligned(const char* filename, unsigned& num, unsigned& dim,
+                         size_t begin = 0, size_t count = SIZE_MAX);
+
+// Reads only the row count and dimension of a vector file.
+void load_data_info(const char* filename, unsigned& num, unsigned& dim);
+
 unsigned int* load_data_ivecs(const char* filename, unsigned& num, unsigned& dim);
 
+// Dimension of the rows after data_align().
+unsigned data_align_dim(unsigned dim);
+
+// Pads the rows of data_ori (from load_data(), which is freed) to
+// data_align_dim(dim).
 float* data_align(float* data_ori, unsigned point_num, unsigned& dim);
 
 }  // namespace efanna2e
@@ -0,0 +1,59 @@
+#ifndef EFANNA2E_VECS_FILE_H
+#define EFANNA2E_VECS_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace efanna2e {
+
+// Element type of a vector file.
+enum ElementType { FLOAT32 = 0, INT32 = 1, UINT8 = 2, INT8 = 3 };
+
+// Read-only memory-mapped vector file, in a format chosen by extension:
+//   .fvecs .ivecs .bvecs  every row is a 4-byte dimension followed by that
+//                         many float / int32 / uint8 values;
+//   .fbin .u8bin .i8bin   a 4-byte row count and dimension, then the rows of
+//                         float / uint8 / int8 values (big-ann-benchmarks).
+// Other names are read as .fvecs. Throws std::runtime_error if the file
+// cannot be mapped or is malformed.
+class VecsFile {
+ public:
+  explicit VecsFile(const char *filename);
+  ~VecsFile();
+  VecsFile(const VecsFile &) = delete;
+  VecsFile &operator=(const VecsFile &) = delete;
+
+  size_t num() const { return num_; }
+  unsigned dim() const { return dim_; }
+  ElementType element_type() const { return type_; }
+  size_t element_size() const { return element_size_; }
+
+  // Copies the values of rows [begin, begin + count) as stored to out, row
+  // r at out + r * stride elements (stride >= dim()), zero-filling the rest
+  // of each row. The rows are copied in parallel; in the vecs formats every
+  // row header must equal dim().
+  void ReadRows(size_t begin, size_t count, void *out, size_t stride) const;
+  // Same, converting the values to float.
+  void ReadFloatRows(size_t begin, size_t count, float *out,
+                     size_t stride) const;
+
+ private:
+  // Calls copy(r, values of row begin + r) for each row, in parallel.
+  template <typename CopyRow>
+  void ForEachRow(size_t begin, size_t count, CopyRow copy) const;
+
+  std::string filename_;
+  char *base_;
+  size_t size_;
+  size_t num_;
+  unsigned dim_;
+  ElementType type_;
+  size_t element_size_;
+  size_t data_offset_;  // bytes before the first row
+  size_t row_header_;   // bytes before the values of a row
+  size_t row_bytes_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_VECS_FILE_H
@@ -0,0 +1,111 @@
+#ifndef EFANNA2E_VISITED_LIST_H
+#define EFANNA2E_VISITED_LIST_H
+
+#include <x86intrin.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace efanna2e {
+
+// Dense visited table. Each slot keeps the epoch in which the node was last
+// visited, so Reset() is a single increment and a lookup only touches the
+// cache line holding the node's own stamp.
+class VisitedTable {
+ public:
+  explicit VisitedTable(size_t n) : stamps_(n, 0), epoch_(1) {}
+
+  inline void Reset() {
+    if (++epoch_ == 0) {  // stamps wrapped around, clear them once
+      std::fill(stamps_.begin(), stamps_.end(), 0);
+      epoch_ = 1;
+    }
+  }
+
+  inline bool Get(unsigned id) const { return stamps_[id] == epoch_; }
+
+  inline void Set(unsigned id) { stamps_[id] = epoch_; }
+
+  inline void Prefetch(unsigned id) const {
+    _mm_prefetch((const char *)(stamps_.data() + id), _MM_HINT_T0);
+  }
+
+  inline size_t size() const { return stamps_.size(); }
+
+ private:
+  std::vector<uint16_t> stamps_;
+  uint16_t epoch_;
+};
+
+// Open-addressing hash set for searches that visit only a few thousand
+// nodes (very small L on a large dataset). Reset() clears a table whose size
+// follows the number of visited nodes instead of the dataset size.
+class SparseVisitedSet {
+ public:
+  explicit SparseVisitedSet(size_t expected = 1024) : size_(0) {
+    unsigned bits = 4;
+    while (((size_t)1 << bits) < 2 * expected) bits++;
+    Rehash(bits);
+  }
+
+  inline void Reset() {
+    if (size_ == 0) return;
+    std::fill(slots_.begin(), slots_.end(), kEmpty);
+    size_ = 0;
+  }
+
+  inline bool Get(unsigned id) const {
+    size_t pos = Hash(id);
+    while (slots_[pos] != kEmpty) {
+      if (slots_[pos] == id) return true;
+      pos = (pos + 1) & mask_;
+    }
+    return false;
+  }
+
+  inline void Set(unsigned id) {
+    size_t pos = Hash(id);
+    while (slots_[pos] != kEmpty) {
+      if (slots_[pos] == id) return;
+      pos = (pos + 1) & mask_;
+    }
+    slots_[pos] = id;
+    // keep the load factor under 1/2 so probe sequences stay short
+    if (++size_ * 2 > slots_.size()) Rehash(bits_ + 1);
+  }
+
+  inline void Prefetch(unsigned id) const {
+    _mm_prefetch((const char *)(slots_.data() + Hash(id)), _MM_HINT_T0);
+  }
+
+  inline size_t size() const { return size_; }
+
+ private:
+  enum : unsigned { kEmpty = 0xffffffffU };
+
+  inline size_t Hash(unsigned id) const {
+    return (size_t)((id * 0x9e3779b1U) >> (32 - bits_)) & mask_;
+  }
+
+  void Rehash(unsigned bits) {
+    std::vector<unsigned> old;
+    old.swap(slots_);
+    bits_ = bits;
+    slots_.assign((size_t)1 << bits_, kEmpty);
+    mask_ = slots_.size() - 1;
+    size_ = 0;
+    for (unsigned id : old) {
+      if (id != kEmpty) Set(id);
+    }
+  }
+
+  std::vector<unsigned> slots_;
+  size_t mask_;
+  size_t size_;
+  unsigned bits_;
+};
+
+}  // namespace efanna2e
+
+#endif  // EFANNA2E_VISITED_LIST_H
@@ -0,0 +1,232 @@
+#include "compact_graph.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace efanna2e {
+
+size_t CompactGraph::num_edges() const {
+  size_t n = 0;
+  for (unsigned d : degrees_) n += d;
+  return n;
+}
+
+unsigned CompactGraph::max_degree() const {
+  unsigned m = 0;
+  for (unsigned d : degrees_) m = std::max(m, d);
+  return m;
+}
+
+void CompactGraph::Reset(size_t n, unsigned capacity) {
+  offsets_.resize(n + 1);
+  for (size_t i = 0; i <= n; i++) offsets_[i] = i * (uint64_t)capacity;
+  degrees_.assign(n, 0);
+  ids_.assign(n * (size_t)capacity, 0);
+}
+
+void CompactGraph::SetRow(size_t i, const unsigned *ids, unsigned n) {
+  if (n > capacity(i)) throw std::length_error("CompactGraph: row overflow");
+  if (n > 0) {
+    std::memcpy(ids_.data() + offsets_[i], ids, n * sizeof(unsigned));
+  }
+  degrees_[i] = n;
+}
+
+bool CompactGraph::Append(size_t i, unsigned id) {
+  if (degrees_[i] == capacity(i)) return false;
+  ids_[offsets_[i] + degrees_[i]++] = id;
+  return true;
+}
+
+void CompactGraph::AddEdges(
+    const std::vector<std::pair<unsigned, unsigned>> &edges) {
+  const size_t n = size();
+  std::vector<std::vector<unsigned>> extra(n);
+  for (const auto &e : edges) {
+    Row row = (*this)[e.first];
+    std::vector<unsigned> &added = extra[e.first];
+    if (std::find(row.begin(), row.end(), e.second) != row.end() ||
+        std::find(added.begin(), added.end(), e.second) != added.end()) {
+      continue;
+    }
+    added.push_back(e.second);
+  }
+  std::vector<uint64_t> offsets(n + 1, 0);
+  for (size_t i = 0; i < n; i++) {
+    unsigned need = degrees_[i] + (unsigned)extra[i].size();
+    offsets[i + 1] = offsets[i] + std::max(need, capacity(i));
+  }
+  std::vector<unsigned> ids(offsets[n]);
+  for (size_t i = 0; i < n; i++) {
+    std::memcpy(ids.data() + offsets[i], ids_.data() + offsets_[i],
+                degrees_[i] * sizeof(unsigned));
+    if (!extra[i].empty()) {
+      std::memcpy(ids.data() + offsets[i] + degrees_[i], extra[i].data(),
+                  extra[i].size() * sizeof(unsigned));
+    }
+    degrees_[i] += (unsigned)extra[i].size();
+  }
+  offsets_.swap(offsets);
+  ids_.swap(ids);
+}
+
+void CompactGraph::Reserve(unsigned capacity) {
+  const size_t n = size();
+  std::vector<uint64_t> offsets(n + 1, 0);
+  bool grow = false;
+  for (size_t i = 0; i < n; i++) {
+    grow = grow || this->capacity(i) < capacity;
+    offsets[i + 1] = offsets[i] + std::max(this->capacity(i), capacity);
+  }
+  if (!grow) return;
+  std::vector<unsigned> ids(offsets[n]);
+  const int64_t rows = (int64_t)n;
+#pragma omp parallel for schedule(static, 4096)
+  for (int64_t i = 0; i < rows; i++) {
+    std::memcpy(ids.data() + offsets[i], ids_.data() + offsets_[i],
+                degrees_[i] * sizeof(unsigned));
+  }
+  offsets_.swap(offsets);
+  ids_.swap(ids);
+}
+
+void CompactGraph::AddNodes(size_t n, unsigned capacity) {
+  if (offsets_.empty()) offsets_.push_back(0);
+  for (size_t i = 0; i < n; i++) {
+    offsets_.push_back(offsets_.back() + capacity);
+  }
+  degrees_.resize(degrees_.size() + n, 0);
+  ids_.resize(offsets_.back(), 0);
+}
+
+void CompactGraph::Compact() {
+  const size_t n = size();
+  std::vector<uint64_t> offsets(n + 1, 0);
+  for (size_t i = 0; i < n; i++) offsets[i + 1] = offsets[i] + degrees_[i];
+  if (offsets[n] == ids_.size()) return;
+  std::vector<unsigned> ids(offsets[n]);
+  const int64_t rows = (int64_t)n;
+#pragma omp parallel for schedule(static, 4096)
+  for (int64_t i = 0; i < rows; i++) {
+    std::memcpy(ids.data() + offsets[i], ids_.data() + offsets_[i],
+                degrees_[i] * sizeof(unsigned));
+  }
+  offsets_.swap(offsets);
+  ids_.swap(ids);
+}
+
+void CompactGraph::ReleaseRows(size_t begin, size_t end) {
+  std::fill(degrees_.begin() + begin, degrees_.begin() + end, 0);
+  const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  uintptr_t first = (uintptr_t)(ids_.data() + offsets_[begin]);
+  uintptr_t last = (uintptr_t)(ids_.data() + offsets_[end]);
+  first = (first + page - 1) & ~(page - 1);
+  last &= ~(page - 1);
+  if (first < last) madvise((void *)first, last - first, MADV_DONTNEED);
+}
+
+void CompactGraph::Assign(std::vector<uint64_t> &&offsets,
+                          std::vector<unsigned> &&ids) {
+  if (offsets.empty() || offsets[0] != 0 || offsets.back() != ids.size()) {
+    throw std::runtime_error("CompactGraph: corrupt row offsets");
+  }
+  const size_t n = offsets.size() - 1;
+  std::vector<unsigned> degrees(n);
+  for (size_t i = 0; i < n; i++) {
+    if (offsets[i + 1] < offsets[i]) {
+      throw std::runtime_error("CompactGraph: corrupt row offsets");
+    }
+    degrees[i] = (unsigned)(offsets[i + 1] - offsets[i]);
+  }
+  CheckIds(ids, n);
+  offsets_.swap(offsets);
+  degrees_.swap(degrees);
+  ids_.swap(ids);
+}
+
+void CompactGraph::LoadRows(const char *filename, size_t offset,
+                            size_t max_rows) {
+  const std::string name(filename);
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + name);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot stat " + name);
+  }
+  const size_t file_size = (size_t)st.st_size;
+  if (file_size <= offset) {
+    close(fd);
+    clear();
+    return;
+  }
+  void *map = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) throw std::runtime_error("cannot map " + name);
+  const char *base = (const char *)map;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, file_size, MADV_SEQUENTIAL);
+#endif
+
+  // Walk the row headers for the layout, then copy the rows in parallel.
+  std::vector<uint64_t> offsets(1, 0);
+  std::vector<size_t> starts;
+  size_t pos = offset;
+  while (pos + sizeof(unsigned) <= file_size && starts.size() < max_rows) {
+    unsigned k;
+    std::memcpy(&k, base + pos, sizeof(unsigned));
+    pos += sizeof(unsigned);
+    if (k > (file_size - pos) / sizeof(unsigned)) {
+      munmap(map, file_size);
+      throw std::runtime_error(name + " is truncated");
+    }
+    starts.push_back(pos);
+    offsets.push_back(offsets.back() + k);
+    pos += k * sizeof(unsigned);
+  }
+  const size_t n = starts.size();
+  std::vector<unsigned> degrees(n);
+  std::vector<unsigned> ids(offsets[n]);
+  const int64_t rows = (int64_t)n;
+#pragma omp parallel for schedule(static, 4096)
+  for (int64_t i = 0; i < rows; i++) {
+    degrees[i] = (unsigned)(offsets[i + 1] - offsets[i]);
+    std::memcpy(ids.data() + offsets[i], base + starts[i],
+                degrees[i] * sizeof(unsigned));
+  }
+  munmap(map, file_size);
+  CheckIds(ids, n);
+  offsets_.swap(offsets);
+  degrees_.swap(degrees);
+  ids_.swap(ids);
+}
+
+void CompactGraph::CheckIds(const std::vector<unsigned> &ids, size_t n) {
+  bool out_of_range = false;
+  const int64_t num_ids = (int64_t)ids.size();
+#pragma omp parallel for reduction(||: out_of_range)
+  for (int64_t j = 0; j < num_ids; j++) {
+    out_of_range = out_of_range || ids[j] >= n;
+  }
+  if (out_of_range) throw std::runtime_error("CompactGraph: id out of range");
+}
+
+void CompactGraph::clear() {
+  std::vector<uint64_t>().swap(offsets_);
+  std::vector<unsigned>().swap(degrees_);
+  std::vector<unsigned>().swap(ids_);
+}
+
+void CompactGraph::swap(CompactGraph &other) {
+  offsets_.swap(other.offsets_);
+  degrees_.swap(other.degrees_);
+  ids_.swap(other.ids_);
+}
+
+}  // namespace efanna2e
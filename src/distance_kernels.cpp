@@ -0,0 +1,833 @@
+#include "distance_kernels.h"
+
+#include <x86intrin.h>
+#include <cstdlib>
+#include <cstring>
+
+namespace efanna2e {
+
+float HalfToFloat(uint16_t h) {
+  uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+  uint32_t exp = (h >> 10) & 0x1f, mant = h & 0x3ff;
+  uint32_t bits;
+  if (exp == 0x1f) {
+    bits = sign | 0x7f800000 | (mant << 13);
+  } else if (exp != 0) {
+    bits = sign | ((exp + 112) << 23) | (mant << 13);
+  } else if (mant == 0) {
+    bits = sign;
+  } else {
+    // Subnormal: normalize the mantissa.
+    exp = 113;
+    while (!(mant & 0x400)) {
+      mant <<= 1;
+      exp--;
+    }
+    bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+  }
+  float f;
+  std::memcpy(&f, &bits, sizeof(f));
+  return f;
+}
+
+uint16_t FloatToHalf(float f) {
+  uint32_t x;
+  std::memcpy(&x, &f, sizeof(x));
+  uint32_t sign = (x >> 16) & 0x8000;
+  uint32_t abs = x & 0x7fffffff;
+  if (abs >= 0x7f800000) {  // inf, nan
+    return (uint16_t)(sign | 0x7c00 | (abs > 0x7f800000 ? 0x200 : 0));
+  }
+  if (abs >= 0x477ff000) return (uint16_t)(sign | 0x7c00);  // overflows
+  if (abs < 0x38800000) {  // subnormal half
+    if (abs < 0x33000000) return (uint16_t)sign;
+    uint32_t shift = 126 - (abs >> 23);
+    uint32_t mant = (abs & 0x7fffff) | 0x800000;
+    uint32_t h = mant >> shift;
+    uint32_t rem = mant & ((1u << shift) - 1), half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (h & 1))) h++;
+    return (uint16_t)(sign | h);
+  }
+  // Rebias the exponent; a rounding carry propagates into it.
+  uint32_t h = (abs >> 13) - (112 << 10);
+  uint32_t rem = abs & 0x1fff;
+  if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++;
+  return (uint16_t)(sign | h);
+}
+
+// Generic kernels
+
+template <unsigned kDim>
+static float L2SqrGeneric(const float *a, const float *b,
+                          unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  float result = 0;
+  for (unsigned i = 0; i < size; i++) {
+    float diff = a[i] - b[i];
+    result += diff * diff;
+  }
+  return result;
+}
+
+template <unsigned kDim>
+static float InnerProductGeneric(const float *a, const float *b,
+                                 unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  float result = 0;
+  for (unsigned i = 0; i < size; i++) result += a[i] * b[i];
+  return result;
+}
+
+template <unsigned kDim>
+static float NormGeneric(const float *a, unsigned size_arg) {
+  return InnerProductGeneric<kDim>(a, a, size_arg);
+}
+
+// One query against n candidates, four candidates per pass so every query
+// element loaded is used four times.
+template <bool kL2, unsigned kDim>
+static void BatchGeneric(const float *q, const float *const *xs, unsigned n,
+                         unsigned size_arg, float *out) {
+  const unsigned size = kDim ? kDim : size_arg;
+  unsigned c = 0;
+  for (; c + 4 <= n; c += 4) {
+    const float *x0 = xs[c], *x1 = xs[c + 1], *x2 = xs[c + 2], *x3 = xs[c + 3];
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    for (unsigned i = 0; i < size; i++) {
+      float v = q[i];
+      if (kL2) {
+        float d0 = v - x0[i], d1 = v - x1[i], d2 = v - x2[i], d3 = v - x3[i];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+      } else {
+        s0 += v * x0[i];
+        s1 += v * x1[i];
+        s2 += v * x2[i];
+        s3 += v * x3[i];
+      }
+    }
+    out[c] = s0;
+    out[c + 1] = s1;
+    out[c + 2] = s2;
+    out[c + 3] = s3;
+  }
+  for (; c < n; c++) {
+    out[c] = kL2 ? L2SqrGeneric<kDim>(q, xs[c], size)
+                 : InnerProductGeneric<kDim>(q, xs[c], size);
+  }
+}
+
+// Early-abandoning L2: the partial sum is compared with bound after every
+// kAbandonBlock dimensions and returned as soon as it exceeds it.
+static const unsigned kAbandonBlock = 32;
+
+template <unsigned kDim>
+static float L2SqrBoundedGeneric(const float *a, const float *b,
+                                 unsigned size_arg, float bound) {
+  const unsigned size = kDim ? kDim : size_arg;
+  float result = 0;
+  unsigned i = 0;
+  for (; i + kAbandonBlock <= size; i += kAbandonBlock) {
+    for (unsigned j = i; j < i + kAbandonBlock; j++) {
+      float diff = a[j] - b[j];
+      result += diff * diff;
+    }
+    if (result > bound) return result;
+  }
+  return result + L2SqrGeneric<0>(a + i, b + i, size - i);
+}
+
+static unsigned HammingGeneric(const unsigned *a, const unsigned *b,
+                               unsigned words) {
+  unsigned result = 0;
+  for (unsigned i = 0; i < words; i++) result += __builtin_popcount(a[i] ^ b[i]);
+  return result;
+}
+
+// Product quantization: sum of one table row of 256 entries per subspace.
+static float PQDistanceGeneric(const float *table, const uint8_t *code,
+                               unsigned num_subspaces) {
+  float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+  unsigned m = 0;
+  for (; m + 4 <= num_subspaces; m += 4) {
+    s0 += table[(m + 0) * 256 + code[m + 0]];
+    s1 += table[(m + 1) * 256 + code[m + 1]];
+    s2 += table[(m + 2) * 256 + code[m + 2]];
+    s3 += table[(m + 3) * 256 + code[m + 3]];
+  }
+  for (; m < num_subspaces; m++) s0 += table[m * 256 + code[m]];
+  return (s0 + s1) + (s2 + s3);
+}
+
+template <unsigned kDim>
+static float InnerProductSq8Generic(const float *q, const uint8_t *code,
+                                    unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  float result = 0;
+  for (unsigned i = 0; i < size; i++) result += q[i] * code[i];
+  return result;
+}
+
+template <unsigned kDim>
+static float InnerProductFp16Generic(const float *q, const uint16_t *code,
+                                     unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  float result = 0;
+  for (unsigned i = 0; i < size; i++) result += q[i] * HalfToFloat(code[i]);
+  return result;
+}
+
+// SSE2, always available on x86-64
+
+#ifdef __SSE2__
+static inline float HorizontalSum128(__m128 v) {
+  float unpack[4];
+  _mm_storeu_ps(unpack, v);
+  return unpack[0] + unpack[1] + unpack[2] + unpack[3];
+}
+
+template <unsigned kDim>
+static float L2SqrSse2(const float *a, const float *b, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= size; i += 8) {
+    __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i));
+    __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4));
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(d0, d0));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(d1, d1));
+  }
+  float result = HorizontalSum128(_mm_add_ps(sum0, sum1));
+  for (; i < size; i++) {
+    float diff = a[i] - b[i];
+    result += diff * diff;
+  }
+  return result;
+}
+
+template <unsigned kDim>
+static float InnerProductSse2(const float *a, const float *b,
+                              unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + 8 <= size; i += 8) {
+    sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+    sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(a + i + 4),
+                                       _mm_loadu_ps(b + i + 4)));
+  }
+  float result = HorizontalSum128(_mm_add_ps(sum0, sum1));
+  for (; i < size; i++) result += a[i] * b[i];
+  return result;
+}
+
+template <unsigned kDim>
+static float NormSse2(const float *a, unsigned size_arg) {
+  return InnerProductSse2<kDim>(a, a, size_arg);
+}
+
+template <bool kL2>
+static inline __m128 Accumulate128(__m128 sum, __m128 v, const float *x) {
+  __m128 y = _mm_loadu_ps(x);
+  if (kL2) {
+    __m128 d = _mm_sub_ps(v, y);
+    return _mm_add_ps(sum, _mm_mul_ps(d, d));
+  }
+  return _mm_add_ps(sum, _mm_mul_ps(v, y));
+}
+
+template <bool kL2, unsigned kDim>
+static void BatchSse2(const float *q, const float *const *xs, unsigned n,
+                      unsigned size_arg, float *out) {
+  const unsigned size = kDim ? kDim : size_arg;
+  unsigned c = 0;
+  for (; c + 4 <= n; c += 4) {
+    const float *x0 = xs[c], *x1 = xs[c + 1], *x2 = xs[c + 2], *x3 = xs[c + 3];
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    __m128 s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+    unsigned i = 0;
+    for (; i + 4 <= size; i += 4) {
+      __m128 v = _mm_loadu_ps(q + i);
+      s0 = Accumulate128<kL2>(s0, v, x0 + i);
+      s1 = Accumulate128<kL2>(s1, v, x1 + i);
+      s2 = Accumulate128<kL2>(s2, v, x2 + i);
+      s3 = Accumulate128<kL2>(s3, v, x3 + i);
+    }
+    // Transpose so one vertical add yields all four sums.
+    _MM_TRANSPOSE4_PS(s0, s1, s2, s3);
+    __m128 sum = _mm_add_ps(_mm_add_ps(s0, s1), _mm_add_ps(s2, s3));
+    if (i < size) {
+      float tail[4];
+      for (unsigned k = 0; k < 4; k++) {
+        const float *x = xs[c + k];
+        tail[k] = 0;
+        for (unsigned j = i; j < size; j++) {
+          float d = kL2 ? q[j] - x[j] : q[j] * x[j];
+          tail[k] += kL2 ? d * d : d;
+        }
+      }
+      sum = _mm_add_ps(sum, _mm_loadu_ps(tail));
+    }
+    _mm_storeu_ps(out + c, sum);
+  }
+  for (; c < n; c++) {
+    out[c] = kL2 ? L2SqrSse2<kDim>(q, xs[c], size)
+                 : InnerProductSse2<kDim>(q, xs[c], size);
+  }
+}
+
+template <unsigned kDim>
+static float L2SqrBoundedSse2(const float *a, const float *b,
+                              unsigned size_arg, float bound) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m128 sum = _mm_setzero_ps();
+  unsigned i = 0;
+  for (; i + kAbandonBlock <= size; i += kAbandonBlock) {
+    for (unsigned j = i; j < i + kAbandonBlock; j += 4) {
+      __m128 d = _mm_sub_ps(_mm_loadu_ps(a + j), _mm_loadu_ps(b + j));
+      sum = _mm_add_ps(sum, _mm_mul_ps(d, d));
+    }
+    float result = HorizontalSum128(sum);
+    if (result > bound) return result;
+  }
+  return HorizontalSum128(sum) + L2SqrSse2<0>(a + i, b + i, size - i);
+}
+#endif
+
+// AVX2 + FMA
+
+__attribute__((target("avx2,fma"))) static inline float HorizontalSum256(
+    __m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v),
+                          _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma"))) static float L2SqrAvx2(
+    const float *a, const float *b, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    __m256 d1 =
+        _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+  }
+  if (i + 8 <= size) {
+    __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+    i += 8;
+  }
+  float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) {
+    float diff = a[i] - b[i];
+    result += diff * diff;
+  }
+  return result;
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma"))) static float InnerProductAvx2(
+    const float *a, const float *b, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                           sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),
+                           _mm256_loadu_ps(b + i + 8), sum1);
+  }
+  if (i + 8 <= size) {
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                           sum0);
+    i += 8;
+  }
+  float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) result += a[i] * b[i];
+  return result;
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma"))) static float NormAvx2(
+    const float *a, unsigned size_arg) {
+  return InnerProductAvx2<kDim>(a, a, size_arg);
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma"))) static float L2SqrBoundedAvx2(
+    const float *a, const float *b, unsigned size_arg, float bound) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + kAbandonBlock <= size; i += kAbandonBlock) {
+    for (unsigned j = i; j < i + kAbandonBlock; j += 16) {
+      __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + j), _mm256_loadu_ps(b + j));
+      __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + j + 8),
+                                _mm256_loadu_ps(b + j + 8));
+      sum0 = _mm256_fmadd_ps(d0, d0, sum0);
+      sum1 = _mm256_fmadd_ps(d1, d1, sum1);
+    }
+    float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+    if (result > bound) return result;
+  }
+  return HorizontalSum256(_mm256_add_ps(sum0, sum1)) +
+         L2SqrAvx2<0>(a + i, b + i, size - i);
+}
+
+template <bool kL2>
+__attribute__((target("avx2,fma"))) static inline __m256 Accumulate256(
+    __m256 sum, __m256 v, const float *x) {
+  __m256 y = _mm256_loadu_ps(x);
+  if (kL2) {
+    __m256 d = _mm256_sub_ps(v, y);
+    return _mm256_fmadd_ps(d, d, sum);
+  }
+  return _mm256_fmadd_ps(v, y, sum);
+}
+
+// Horizontal sums of four accumulators at once, lane k of the result is the
+// sum of sk.
+__attribute__((target("avx2,fma"))) static inline __m128 HorizontalSum4x256(
+    __m256 s0, __m256 s1, __m256 s2, __m256 s3) {
+  __m256 h = _mm256_hadd_ps(_mm256_hadd_ps(s0, s1), _mm256_hadd_ps(s2, s3));
+  return _mm_add_ps(_mm256_castps256_ps128(h), _mm256_extractf128_ps(h, 1));
+}
+
+template <bool kL2, unsigned kDim>
+__attribute__((target("avx2,fma"))) static void BatchAvx2(
+    const float *q, const float *const *xs, unsigned n, unsigned size_arg,
+    float *out) {
+  const unsigned size = kDim ? kDim : size_arg;
+  unsigned c = 0;
+  for (; c + 4 <= n; c += 4) {
+    const float *x0 = xs[c], *x1 = xs[c + 1], *x2 = xs[c + 2], *x3 = xs[c + 3];
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+    unsigned i = 0;
+    for (; i + 8 <= size; i += 8) {
+      __m256 v = _mm256_loadu_ps(q + i);
+      s0 = Accumulate256<kL2>(s0, v, x0 + i);
+      s1 = Accumulate256<kL2>(s1, v, x1 + i);
+      s2 = Accumulate256<kL2>(s2, v, x2 + i);
+      s3 = Accumulate256<kL2>(s3, v, x3 + i);
+    }
+    __m128 sum = HorizontalSum4x256(s0, s1, s2, s3);
+    if (i < size) {
+      float tail[4];
+      for (unsigned k = 0; k < 4; k++) {
+        const float *x = xs[c + k];
+        tail[k] = 0;
+        for (unsigned j = i; j < size; j++) {
+          float d = kL2 ? q[j] - x[j] : q[j] * x[j];
+          tail[k] += kL2 ? d * d : d;
+        }
+      }
+      sum = _mm_add_ps(sum, _mm_loadu_ps(tail));
+    }
+    _mm_storeu_ps(out + c, sum);
+  }
+  for (; c < n; c++) {
+    out[c] = kL2 ? L2SqrAvx2<kDim>(q, xs[c], size)
+                 : InnerProductAvx2<kDim>(q, xs[c], size);
+  }
+}
+
+// Eight table lookups per gather.
+__attribute__((target("avx2,fma"))) static float PQDistanceAvx2(
+    const float *table, const uint8_t *code, unsigned num_subspaces) {
+  const __m256i rows =
+      _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+  __m256 sum = _mm256_setzero_ps();
+  unsigned m = 0;
+  for (; m + 8 <= num_subspaces; m += 8) {
+    __m256i idx = _mm256_add_epi32(
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(code + m))),
+        rows);
+    sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + m * 256, idx, 4));
+  }
+  float result = HorizontalSum256(sum);
+  for (; m < num_subspaces; m++) result += table[m * 256 + code[m]];
+  return result;
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma"))) static float InnerProductSq8Avx2(
+    const float *q, const uint8_t *code, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)(code + i));
+    __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c));
+    __m256 x1 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(c, 8)));
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), x1, sum1);
+  }
+  if (i + 8 <= size) {
+    __m128i c = _mm_loadl_epi64((const __m128i *)(code + i));
+    __m256 x0 = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(c));
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, sum0);
+    i += 8;
+  }
+  float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) result += q[i] * code[i];
+  return result;
+}
+
+template <unsigned kDim>
+__attribute__((target("avx2,fma,f16c"))) static float InnerProductFp16Avx2(
+    const float *q, const uint16_t *code, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m256 sum0 = _mm256_setzero_ps(), sum1 = _mm256_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(code + i)));
+    __m256 x1 =
+        _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(code + i + 8)));
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, sum0);
+    sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i + 8), x1, sum1);
+  }
+  if (i + 8 <= size) {
+    __m256 x0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(code + i)));
+    sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(q + i), x0, sum0);
+    i += 8;
+  }
+  float result = HorizontalSum256(_mm256_add_ps(sum0, sum1));
+  for (; i < size; i++) result += q[i] * _cvtsh_ss(code[i]);
+  return result;
+}
+
+// AVX-512, tails handled with masked loads
+
+// GCC 12 implements the 512 to 256 bit casts with an extract from an
+// undefined vector and warns about it inside its own headers.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+__attribute__((target("avx512f"))) static inline float HorizontalSum512(
+    __m512 v) {
+  __m256 lo = _mm512_castps512_ps256(v);
+  __m256 hi = _mm512_castps512_ps256(_mm512_shuffle_f32x4(v, v, 0xee));
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(lo),
+                          _mm256_extractf128_ps(lo, 1));
+  sum = _mm_add_ps(sum, _mm_add_ps(_mm256_castps256_ps128(hi),
+                                   _mm256_extractf128_ps(hi, 1)));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+  return _mm_cvtss_f32(sum);
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float L2SqrAvx512(
+    const float *a, const float *b, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16),
+                              _mm512_loadu_ps(b + i + 16));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+    sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+  }
+  for (; i + 16 <= size; i += 16) {
+    __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+  }
+  if (i < size) {
+    __mmask16 mask = (__mmask16)((1U << (size - i)) - 1);
+    __m512 d0 = _mm512_sub_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                              _mm512_maskz_loadu_ps(mask, b + i));
+    sum1 = _mm512_fmadd_ps(d0, d0, sum1);
+  }
+  return HorizontalSum512(_mm512_add_ps(sum0, sum1));
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float InnerProductAvx512(
+    const float *a, const float *b, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 32 <= size; i += 32) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i),
+                           sum0);
+    sum1 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i + 16),
+                           _mm512_loadu_ps(b + i + 16), sum1);
+  }
+  for (; i + 16 <= size; i += 16) {
+    sum0 = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i),
+                           sum0);
+  }
+  if (i < size) {
+    __mmask16 mask = (__mmask16)((1U << (size - i)) - 1);
+    sum1 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, a + i),
+                           _mm512_maskz_loadu_ps(mask, b + i), sum1);
+  }
+  return HorizontalSum512(_mm512_add_ps(sum0, sum1));
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float NormAvx512(
+    const float *a, unsigned size_arg) {
+  return InnerProductAvx512<kDim>(a, a, size_arg);
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float L2SqrBoundedAvx512(
+    const float *a, const float *b, unsigned size_arg, float bound) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m512 sum0 = _mm512_setzero_ps(), sum1 = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + kAbandonBlock <= size; i += kAbandonBlock) {
+    for (unsigned j = i; j < i + kAbandonBlock; j += 32) {
+      __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + j), _mm512_loadu_ps(b + j));
+      __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + j + 16),
+                                _mm512_loadu_ps(b + j + 16));
+      sum0 = _mm512_fmadd_ps(d0, d0, sum0);
+      sum1 = _mm512_fmadd_ps(d1, d1, sum1);
+    }
+    float result = HorizontalSum512(_mm512_add_ps(sum0, sum1));
+    if (result > bound) return result;
+  }
+  return HorizontalSum512(_mm512_add_ps(sum0, sum1)) +
+         L2SqrAvx512<0>(a + i, b + i, size - i);
+}
+
+template <bool kL2>
+__attribute__((target("avx512f"))) static inline __m512 Accumulate512(
+    __m512 sum, __m512 v, __m512 y) {
+  if (kL2) {
+    __m512 d = _mm512_sub_ps(v, y);
+    return _mm512_fmadd_ps(d, d, sum);
+  }
+  return _mm512_fmadd_ps(v, y, sum);
+}
+
+__attribute__((target("avx512f"))) static inline __m256 Fold512(__m512 v) {
+  return _mm256_add_ps(_mm512_castps512_ps256(v),
+                       _mm512_castps512_ps256(_mm512_shuffle_f32x4(v, v, 0xee)));
+}
+
+template <bool kL2, unsigned kDim>
+__attribute__((target("avx512f,avx2,fma"))) static void BatchAvx512(
+    const float *q, const float *const *xs, unsigned n, unsigned size_arg,
+    float *out) {
+  const unsigned size = kDim ? kDim : size_arg;
+  unsigned c = 0;
+  for (; c + 4 <= n; c += 4) {
+    const float *x0 = xs[c], *x1 = xs[c + 1], *x2 = xs[c + 2], *x3 = xs[c + 3];
+    __m512 s0 = _mm512_setzero_ps(), s1 = _mm512_setzero_ps();
+    __m512 s2 = _mm512_setzero_ps(), s3 = _mm512_setzero_ps();
+    unsigned i = 0;
+    for (; i + 16 <= size; i += 16) {
+      __m512 v = _mm512_loadu_ps(q + i);
+      s0 = Accumulate512<kL2>(s0, v, _mm512_loadu_ps(x0 + i));
+      s1 = Accumulate512<kL2>(s1, v, _mm512_loadu_ps(x1 + i));
+      s2 = Accumulate512<kL2>(s2, v, _mm512_loadu_ps(x2 + i));
+      s3 = Accumulate512<kL2>(s3, v, _mm512_loadu_ps(x3 + i));
+    }
+    if (i < size) {
+      __mmask16 mask = (__mmask16)((1U << (size - i)) - 1);
+      __m512 v = _mm512_maskz_loadu_ps(mask, q + i);
+      s0 = Accumulate512<kL2>(s0, v, _mm512_maskz_loadu_ps(mask, x0 + i));
+      s1 = Accumulate512<kL2>(s1, v, _mm512_maskz_loadu_ps(mask, x1 + i));
+      s2 = Accumulate512<kL2>(s2, v, _mm512_maskz_loadu_ps(mask, x2 + i));
+      s3 = Accumulate512<kL2>(s3, v, _mm512_maskz_loadu_ps(mask, x3 + i));
+    }
+    _mm_storeu_ps(out + c, HorizontalSum4x256(Fold512(s0), Fold512(s1),
+                                              Fold512(s2), Fold512(s3)));
+  }
+  for (; c < n; c++) {
+    out[c] = kL2 ? L2SqrAvx512<kDim>(q, xs[c], size)
+                 : InnerProductAvx512<kDim>(q, xs[c], size);
+  }
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float InnerProductSq8Avx512(
+    const float *q, const uint8_t *code, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m512 sum = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m512 x = _mm512_cvtepi32_ps(
+        _mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i *)(code + i))));
+    sum = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), x, sum);
+  }
+  if (i < size) {
+    __mmask16 mask = (__mmask16)((1U << (size - i)) - 1);
+    __m128i c = _mm_setzero_si128();
+    std::memcpy(&c, code + i, size - i);
+    __m512 x = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(c));
+    sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q + i), x, sum);
+  }
+  return HorizontalSum512(sum);
+}
+
+template <unsigned kDim>
+__attribute__((target("avx512f"))) static float InnerProductFp16Avx512(
+    const float *q, const uint16_t *code, unsigned size_arg) {
+  const unsigned size = kDim ? kDim : size_arg;
+  __m512 sum = _mm512_setzero_ps();
+  unsigned i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m512 x = _mm512_cvtph_ps(
+        _mm256_loadu_si256((const __m256i *)(code + i)));
+    sum = _mm512_fmadd_ps(_mm512_loadu_ps(q + i), x, sum);
+  }
+  if (i < size) {
+    __mmask16 mask = (__mmask16)((1U << (size - i)) - 1);
+    __m256i c = _mm256_setzero_si256();
+    std::memcpy(&c, code + i, (size - i) * sizeof(uint16_t));
+    __m512 x = _mm512_cvtph_ps(c);
+    sum = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, q + i), x, sum);
+  }
+  return HorizontalSum512(sum);
+}
+
+#pragma GCC diagnostic pop
+
+// Hamming distance
+
+__attribute__((target("popcnt"))) static unsigned HammingPopcnt(
+    const unsigned *a, const unsigned *b, unsigned words) {
+  unsigned long long result = 0;
+  unsigned i = 0;
+  for (; i + 2 <= words; i += 2) {
+    unsigned long long x, y;
+    std::memcpy(&x, a + i, sizeof(x));
+    std::memcpy(&y, b + i, sizeof(y));
+    result += _mm_popcnt_u64(x ^ y);
+  }
+  if (i < words) result += _mm_popcnt_u32(a[i] ^ b[i]);
+  return (unsigned)result;
+}
+
+__attribute__((target("popcnt,avx512f,avx512vpopcntdq"))) static unsigned
+HammingAvx512(const unsigned *a, const unsigned *b, unsigned words) {
+  __m512i sum = _mm512_setzero_si512();
+  unsigned i = 0;
+  for (; i + 16 <= words; i += 16) {
+    __m512i x = _mm512_xor_si512(_mm512_loadu_si512(a + i),
+                                 _mm512_loadu_si512(b + i));
+    sum = _mm512_add_epi64(sum, _mm512_popcnt_epi64(x));
+  }
+  unsigned long long lanes[8];
+  _mm512_storeu_si512(lanes, sum);
+  unsigned long long result = 0;
+  for (unsigned j = 0; j < 8; j++) result += lanes[j];
+  for (; i < words; i++) result += _mm_popcnt_u32(a[i] ^ b[i]);
+  return (unsigned)result;
+}
+
+enum IsaLevel { kGeneric = 0, kSse2 = 1, kAvx2 = 2, kAvx512 = 3 };
+
+static IsaLevel IsaCap() {
+  const char *env = std::getenv("SSG_ISA");
+  if (env == nullptr) return kAvx512;
+  if (std::strcmp(env, "generic") == 0) return kGeneric;
+  if (std::strcmp(env, "sse2") == 0) return kSse2;
+  if (std::strcmp(env, "avx2") == 0) return kAvx2;
+  return kAvx512;
+}
+
+// kDim = 0 binds kernels for any length; otherwise the length is fixed at
+// compile time, the loops unroll completely and the size argument is ignored.
+template <unsigned kDim>
+static DistanceKernels SelectKernels() {
+  __builtin_cpu_init();
+  IsaLevel cap = IsaCap();
+  DistanceKernels k;
+  k.isa = "generic";
+  k.l2 = L2SqrGeneric<kDim>;
+  k.inner_product = InnerProductGeneric<kDim>;
+  k.norm = NormGeneric<kDim>;
+  k.l2_bounded = L2SqrBoundedGeneric<kDim>;
+  k.l2_batch = BatchGeneric<true, kDim>;
+  k.inner_product_batch = BatchGeneric<false, kDim>;
+  k.hamming = HammingGeneric;
+  k.inner_product_sq8 = InnerProductSq8Generic<kDim>;
+  k.inner_product_fp16 = InnerProductFp16Generic<kDim>;
+  k.pq_distance = PQDistanceGeneric;
+#ifdef __SSE2__
+  if (cap >= kSse2) {
+    k.isa = "sse2";
+    k.l2 = L2SqrSse2<kDim>;
+    k.inner_product = InnerProductSse2<kDim>;
+    k.norm = NormSse2<kDim>;
+    k.l2_bounded = L2SqrBoundedSse2<kDim>;
+    k.l2_batch = BatchSse2<true, kDim>;
+    k.inner_product_batch = BatchSse2<false, kDim>;
+  }
+#endif
+  if (cap >= kSse2 && __builtin_cpu_supports("popcnt")) {
+    k.hamming = HammingPopcnt;
+  }
+  if (cap >= kAvx2 && __builtin_cpu_supports("avx2") &&
+      __builtin_cpu_supports("fma")) {
+    k.isa = "avx2";
+    k.l2 = L2SqrAvx2<kDim>;
+    k.inner_product = InnerProductAvx2<kDim>;
+    k.norm = NormAvx2<kDim>;
+    k.l2_bounded = L2SqrBoundedAvx2<kDim>;
+    k.l2_batch = BatchAvx2<true, kDim>;
+    k.inner_product_batch = BatchAvx2<false, kDim>;
+    k.inner_product_sq8 = InnerProductSq8Avx2<kDim>;
+    k.pq_distance = PQDistanceAvx2;
+    if (__builtin_cpu_supports("f16c")) {
+      k.inner_product_fp16 = InnerProductFp16Avx2<kDim>;
+    }
+  }
+  if (cap >= kAvx512 && __builtin_cpu_supports("avx512f")) {
+    k.isa = "avx512";
+    k.l2 = L2SqrAvx512<kDim>;
+    k.inner_product = InnerProductAvx512<kDim>;
+    k.norm = NormAvx512<kDim>;
+    k.l2_bounded = L2SqrBoundedAvx512<kDim>;
+    k.l2_batch = BatchAvx512<true, kDim>;
+    k.inner_product_batch = BatchAvx512<false, kDim>;
+    k.inner_product_sq8 = InnerProductSq8Avx512<kDim>;
+    k.inner_product_fp16 = InnerProductFp16Avx512<kDim>;
+    if (__builtin_cpu_supports("avx512vpopcntdq") &&
+        __builtin_cpu_supports("popcnt")) {
+      k.hamming = HammingAvx512;
+    }
+  }
+  return k;
+}
+
+const DistanceKernels &GetDistanceKernels() {
+  static const DistanceKernels kernels = SelectKernels<0>();
+  return kernels;
+}
+
+template <unsigned kDim>
+static const DistanceKernels &FixedDimKernels() {
+  static const DistanceKernels kernels = SelectKernels<kDim>();
+  return kernels;
+}
+
+const DistanceKernels &GetDistanceKernels(unsigned dim) {
+  switch (dim) {
+    case 96: return FixedDimKernels<96>();
+    case 100: return FixedDimKernels<100>();
+    case 104: return FixedDimKernels<104>();
+    case 128: return FixedDimKernels<128>();
+    case 200: return FixedDimKernels<200>();
+    case 256: return FixedDimKernels<256>();
+    case 960: return FixedDimKernels<960>();
+    default: return GetDistanceKernels();
+  }
+}
+
+}  // namespace efanna2e
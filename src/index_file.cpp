@@ -0,0 +1,218 @@
+#include "index_file.h"
+
+#include <cstring>
+#include <stdexcept>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+
+namespace efanna2e {
+
+static const char kIndexMagic[8] = {'S', 'S', 'G', 'I', 'N', 'D', 'E', 'X'};
+static const uint32_t kIndexVersion = 1;
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_sections;
+  uint32_t table_crc;  // of the num_sections table entries
+  uint32_t reserved;
+};
+
+// Slicing-by-8 tables of the reflected Castagnoli polynomial.
+struct Crc32cTables {
+  uint32_t t[8][256];
+  Crc32cTables() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+      t[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+      for (int s = 1; s < 8; s++) {
+        t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+      }
+    }
+  }
+};
+
+static uint32_t Crc32cGeneric(const uint8_t *p, size_t n, uint32_t crc) {
+  static const Crc32cTables tables;
+  const uint32_t(*t)[256] = tables.t;
+  while (n >= 8) {
+    uint32_t lo, hi;
+    std::memcpy(&lo, p, 4);
+    std::memcpy(&hi, p + 4, 4);
+    lo ^= crc;
+    crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^
+          t[4][lo >> 24] ^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+          t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    p += 8;
+    n -= 8;
+  }
+  while (n--) crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xFF];
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static uint32_t Crc32cSse42(
+    const uint8_t *p, size_t n, uint32_t crc) {
+  uint64_t c = crc;
+  while (n >= 8) {
+    uint64_t v;
+    std::memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    n -= 8;
+  }
+  while (n--) c = _mm_crc32_u8((uint32_t)c, *p++);
+  return (uint32_t)c;
+}
+#endif
+
+uint32_t Crc32c(const void *data, size_t size, uint32_t crc) {
+  const uint8_t *p = (const uint8_t *)data;
+#if defined(__x86_64__)
+  static const bool sse42 = __builtin_cpu_supports("sse4.2");
+  if (sse42) return ~Crc32cSse42(p, size, ~crc);
+#endif
+  return ~Crc32cGeneric(p, size, ~crc);
+}
+
+IndexFileWriter::IndexFileWriter(const char *filename)
+    : filename_(filename),
+      out_(filename, std::ios::binary | std::ios::out),
+      pos_(kSectionAlignment),
+      open_section_(false) {
+  if (!out_.is_open()) throw std::runtime_error("cannot create " + filename_);
+  // The header and table are written by Finish().
+  std::vector<char> zeros(kSectionAlignment, 0);
+  out_.write(zeros.data(), zeros.size());
+}
+
+void IndexFileWriter::Begin(uint32_t id, bool contiguous) {
+  if (open_section_ || entries_.size() == kMaxSections) {
+    throw std::logic_error("IndexFileWriter: cannot begin a section");
+  }
+  if (!contiguous) {
+    uint64_t aligned = (pos_ + kSectionAlignment - 1) & ~(kSectionAlignment - 1);
+    std::vector<char> pad(aligned - pos_, 0);
+    out_.write(pad.data(), pad.size());
+    pos_ = aligned;
+  }
+  SectionEntry entry = {id, 0, pos_, 0};
+  entries_.push_back(entry);
+  open_section_ = true;
+}
+
+void IndexFileWriter::Write(const void *data, size_t size) {
+  SectionEntry &entry = entries_.back();
+  out_.write((const char *)data, size);
+  entry.crc = Crc32c(data, size, entry.crc);
+  entry.size += size;
+  pos_ += size;
+}
+
+void IndexFileWriter::End() { open_section_ = false; }
+
+void IndexFileWriter::Finish() {
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+  header.version = kIndexVersion;
+  header.num_sections = (uint32_t)entries_.size();
+  header.table_crc =
+      Crc32c(entries_.data(), entries_.size() * sizeof(SectionEntry));
+  out_.seekp(0);
+  out_.write((const char *)&header, sizeof(header));
+  out_.write((const char *)entries_.data(),
+             entries_.size() * sizeof(SectionEntry));
+  out_.close();
+  if (!out_) throw std::runtime_error("cannot write " + filename_);
+}
+
+IndexFileReader::IndexFileReader(const char *filename)
+    : filename_(filename), in_(filename, std::ios::binary) {
+  if (!in_.is_open()) throw std::runtime_error("cannot open " + filename_);
+  in_.seekg(0, std::ios::end);
+  const uint64_t file_size = (uint64_t)in_.tellg();
+  in_.seekg(0, std::ios::beg);
+  FileHeader header;
+  in_.read((char *)&header, sizeof(header));
+  if (!in_ || std::memcmp(header.magic, kIndexMagic, sizeof(header.magic))) {
+    throw std::runtime_error(filename_ + " is not an SSG index file");
+  }
+  if (header.version != kIndexVersion) {
+    throw std::runtime_error(filename_ + ": unsupported index file version " +
+                             std::to_string(header.version));
+  }
+  if (header.num_sections > IndexFileWriter::kMaxSections) {
+    throw std::runtime_error(filename_ + ": corrupt section table");
+  }
+  entries_.resize(header.num_sections);
+  in_.read((char *)entries_.data(), entries_.size() * sizeof(SectionEntry));
+  if (!in_ || Crc32c(entries_.data(), entries_.size() * sizeof(SectionEntry)) !=
+                  header.table_crc) {
+    throw std::runtime_error(filename_ + ": corrupt section table");
+  }
+  for (const SectionEntry &entry : entries_) {
+    if (entry.offset > file_size || entry.size > file_size - entry.offset) {
+      throw std::runtime_error(filename_ + " is truncated");
+    }
+  }
+}
+
+bool IndexFileReader::Recognize(const char *filename) {
+  std::ifstream in(filename, std::ios::binary);
+  char magic[sizeof(kIndexMagic)];
+  in.read(magic, sizeof(magic));
+  return in && std::memcmp(magic, kIndexMagic, sizeof(magic)) == 0;
+}
+
+const SectionEntry *IndexFileReader::Find(uint32_t id) const {
+  for (const SectionEntry &entry : entries_) {
+    if (entry.id == id) return &entry;
+  }
+  return nullptr;
+}
+
+const SectionEntry &IndexFileReader::Get(uint32_t id) const {
+  const SectionEntry *entry = Find(id);
+  if (entry == nullptr) {
+    throw std::runtime_error(filename_ + ": missing section " +
+                             std::to_string(id));
+  }
+  return *entry;
+}
+
+uint64_t IndexFileReader::offset(uint32_t id) const { return Get(id).offset; }
+
+uint64_t IndexFileReader::size(uint32_t id) const { return Get(id).size; }
+
+void IndexFileReader::Read(uint32_t id, void *out, size_t size) {
+  const SectionEntry &entry = Get(id);
+  if (entry.size != size) {
+    throw std::runtime_error(filename_ + ": unexpected size of section " +
+                             std::to_string(id));
+  }
+  in_.seekg(entry.offset);
+  in_.read((char *)out, size);
+  if (!in_) throw std::runtime_error("cannot read " + filename_);
+  Verify(id, out);
+}
+
+std::string IndexFileReader::Read(uint32_t id) {
+  std::string bytes(size(id), '\0');
+  Read(id, &bytes[0], bytes.size());
+  return bytes;
+}
+
+void IndexFileReader::Verify(uint32_t id, const void *data) const {
+  const SectionEntry &entry = Get(id);
+  if (Crc32c(data, entry.size) != entry.crc) {
+    throw std::runtime_error(filename_ + ": checksum mismatch in section " +
+                             std::to_string(id));
+  }
+}
+
+}  // namespace efanna2e
@@ -4,13 +4,18 @@
 #include <bitset>
 #include <chrono>
 #include <cmath>
-#include <queue>
+#include <limits>
 #include <boost/dynamic_bitset.hpp>
 
 #include "exceptions.h"
+#include "index_file.h"
 #include "parameters.h"
+#include "search_scorer.h"
+#include "vecs_file.h"
 
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 constexpr double kPi = 3.14159265358979323846264;
 
@@ -18,145 +23,613 @@ namespace efanna2e {
 
 #define _CONTROL_NUM 100
 
+// Upper bound on omp_get_thread_num() for the per-thread search contexts.
+static const unsigned kMaxSearchThreads = 1024;
+// Queries handed to a thread at a time by SearchBatch.
+static const unsigned kBatchChunk = 16;
+// Rows sampled to fit the PCA rotation of SetPCARotation().
+static const size_t kPCASamples = 20000;
+// Rows sampled and k-means rounds to fit the codebooks of Metric PQ.
+static const size_t kPQSamples = 32768;
+static const unsigned kPQIterations = 15;
+// Rows encoded into the optimized graph at a time; also those read at a
+// time by OptimizeGraphFromFile().
+static const size_t kStreamRows = 4096;
+// Smallest breadth-first level MarkReachable() expands in parallel.
+static const int64_t kParallelFrontier = 256;
+// Nodes linked at a time by Insert(); a batch does not see its own nodes.
+static const size_t kInsertBatch = 1024;
+
 IndexSSG::IndexSSG(const size_t dimension, const size_t n, Metric m,
                    Index *initializer)
-    : Index(dimension, n, m), initializer_{initializer} {}
+    : Index(dimension, n, m), initializer_{initializer} {
+  InitThreadContexts();
+}
 
-IndexSSG::~IndexSSG() {}
+IndexSSG::~IndexSSG() { FreeOptGraph(); }
 
-void IndexSSG::Save(const char *filename) {
-  std::ofstream out(filename, std::ios::binary | std::ios::out);
-  assert(final_graph_.size() == nd_);
+size_t IndexSSG::OptGraphBytes() const {
+  size_t bytes = node_size * nd_;
+#ifdef ADA_NNS
+  uint64_t hash_len = (hash_bitwidth_ >> 3);
+  uint64_t hash_function_size = dimension_ * hash_bitwidth_ * sizeof(float);
+  bytes += hash_len * nd_ + hash_function_size;
+#endif
+  return bytes;
+}
 
-  out.write((char *)&width, sizeof(unsigned));
-  unsigned n_ep=eps_.size();
-  out.write((char *)&n_ep, sizeof(unsigned));
-  out.write((char *)eps_.data(), n_ep*sizeof(unsigned));
-  for (unsigned i = 0; i < nd_; i++) {
-    unsigned GK = (unsigned)final_graph_[i].size();
-    out.write((char *)&GK, sizeof(unsigned));
-    out.write((char *)final_graph_[i].data(), GK * sizeof(unsigned));
+void IndexSSG::FreeOptGraph() {
+  if (mapping_ != nullptr) {
+    munmap(mapping_, mapping_size_);
+  } else {
+    opt_memory_.Free();
   }
-  out.close();
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  opt_graph_ = nullptr;
+#ifdef ADA_NNS
+  hash_function_ = nullptr;
+  hashed_set_ = nullptr;
+#endif
+}
+
+// SECTION_META of the index files (see index_file.h). A graph file holds
+// the CSR adjacency and entry points; an optimized file holds the node
+// array exactly as laid out in memory, with the ADA-NNS hash codes and
+// functions written contiguously after it when hash_bitwidth is nonzero.
+enum IndexFileKind : uint32_t { kGraphFile = 1, kOptimizedFile = 2 };
+
+struct IndexMeta {
+  uint32_t kind;
+  uint32_t metric;
+  uint32_t encoding;
+  uint32_t dimension;
+  uint32_t width;
+  uint32_t hash_bitwidth;  // 0: no hash sections
+  uint64_t nd;
+  uint64_t node_size;
+  uint64_t data_len;
+};
+
+template <typename Saveable>
+static std::string Serialize(const Saveable &value) {
+  std::ostringstream out(std::ios::binary);
+  value.Save(out);
+  return out.str();
+}
+
+template <typename Loadable>
+static void Deserialize(const std::string &bytes, Loadable &value) {
+  std::istringstream in(bytes, std::ios::binary);
+  value.Load(in);
+}
+
+void IndexSSG::SaveOptimized(const char *filename) const {
+  if (opt_graph_ == nullptr) {
+    throw std::logic_error("IndexSSG: SaveOptimized needs an optimized graph");
+  }
+  IndexMeta meta;
+  std::memset(&meta, 0, sizeof(meta));
+  meta.kind = kOptimizedFile;
+  meta.metric = metric_;
+  meta.encoding = quantizer_.encoding();
+  meta.dimension = (uint32_t)dimension_;
+  meta.width = width;
+#ifdef ADA_NNS
+  if (hash_function_ != nullptr && hashed_set_ != nullptr) {
+    meta.hash_bitwidth = hash_bitwidth_;
+  }
+#endif
+  meta.nd = nd_;
+  meta.node_size = node_size;
+  meta.data_len = data_len;
+
+  IndexFileWriter out(filename);
+  out.Add(SECTION_META, &meta, sizeof(meta));
+  out.Add(SECTION_ENTRY_POINTS, eps_.data(), eps_.size() * sizeof(unsigned));
+  if (!new_to_old_.empty()) {
+    out.Add(SECTION_REORDER, new_to_old_.data(),
+            new_to_old_.size() * sizeof(unsigned));
+  }
+  if (pca_.trained()) out.Add(SECTION_PCA, Serialize(pca_));
+  out.Add(SECTION_QUANTIZER, Serialize(quantizer_));
+  if (metric_ == PQ) out.Add(SECTION_PQ, Serialize(pq_));
+  const size_t nodes_bytes = node_size * nd_;
+  out.Add(SECTION_NODES, opt_graph_, nodes_bytes);
+  if (meta.hash_bitwidth) {
+    const size_t hash_bytes = OptGraphBytes() - nodes_bytes;
+    const size_t codes_bytes = (size_t)(meta.hash_bitwidth >> 3) * nd_;
+    out.Begin(SECTION_HASH_CODES, true);
+    out.Write(opt_graph_ + nodes_bytes, codes_bytes);
+    out.End();
+    out.Begin(SECTION_HASH_FUNCTION, true);
+    out.Write(opt_graph_ + nodes_bytes + codes_bytes, hash_bytes - codes_bytes);
+    out.End();
+  }
+  out.Finish();
+}
+
+void IndexSSG::LoadOptimized(const char *filename, const float *data,
+                             bool populate, bool huge_pages) {
+  IndexFileReader in(filename);
+  IndexMeta meta;
+  in.Read(SECTION_META, &meta, sizeof(meta));
+  if (meta.kind != kOptimizedFile) {
+    throw std::runtime_error("IndexSSG: not an optimized index file");
+  }
+  if (meta.dimension != dimension_ || meta.metric != (uint32_t)metric_) {
+    throw std::runtime_error(
+        "IndexSSG: optimized index dimension or metric mismatch");
+  }
+  nd_ = meta.nd;
+  width = meta.width;
+  node_size = meta.node_size;
+  data_len = meta.data_len;
+  neighbor_len = node_size - data_len;
+  eps_.resize(in.size(SECTION_ENTRY_POINTS) / sizeof(unsigned));
+  in.Read(SECTION_ENTRY_POINTS, eps_.data(), eps_.size() * sizeof(unsigned));
+  CheckEntryPoints();
+  reorder_ = in.Has(SECTION_REORDER);
+  new_to_old_.resize(reorder_ ? nd_ : 0);
+  if (reorder_) {
+    in.Read(SECTION_REORDER, new_to_old_.data(),
+            new_to_old_.size() * sizeof(unsigned));
+  }
+  pca_ = PCARotation();
+  use_pca_ = in.Has(SECTION_PCA);
+  if (use_pca_) Deserialize(in.Read(SECTION_PCA), pca_);
+  Deserialize(in.Read(SECTION_QUANTIZER), quantizer_);
+  encoding_ = quantizer_.encoding();
+  if (metric_ == PQ) Deserialize(in.Read(SECTION_PQ), pq_);
+  const size_t nodes_bytes = node_size * nd_;
+  if (in.size(SECTION_NODES) != nodes_bytes) {
+    throw std::runtime_error("IndexSSG: optimized index node size mismatch");
+  }
+  const size_t nodes_offset = in.offset(SECTION_NODES);
+
+  FreeOptGraph();
+  CompactGraph().swap(final_graph_);
+  data_ = data;
+  opt_search_ = SelectOptSearch((unsigned)dimension_, metric_, encoding_);
+  size_t bytes = nodes_bytes;
+#ifdef ADA_NNS
+  // The ADA-NNS hashes live right after the nodes, so they must come from
+  // the file (matching SetHashBitwidth()) for the node array to be mapped.
+  if (meta.hash_bitwidth != 0 && meta.hash_bitwidth != hash_bitwidth_) {
+    throw std::runtime_error("IndexSSG: optimized index hash bitwidth mismatch");
+  }
+  bool mapped = meta.hash_bitwidth != 0;
+  if (mapped) {
+    bytes = OptGraphBytes();
+    size_t codes_offset = in.offset(SECTION_HASH_CODES);
+    if (codes_offset != nodes_offset + nodes_bytes ||
+        in.offset(SECTION_HASH_FUNCTION) !=
+            codes_offset + in.size(SECTION_HASH_CODES) ||
+        nodes_bytes + in.size(SECTION_HASH_CODES) +
+                in.size(SECTION_HASH_FUNCTION) != bytes) {
+      throw std::runtime_error("IndexSSG: misplaced hash sections");
+    }
+  }
+#else
+  bool mapped = true;
+#endif
+  mapped = mapped && memory_policy_ == MEMORY_DEFAULT;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("IndexSSG: cannot open optimized index");
+  // Private writable mapping: pages stay shared in the page cache until
+  // written, which only the ADA-NNS hash setup does.
+  size_t map_size = nodes_offset + bytes;
+  void *base = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    throw std::runtime_error("IndexSSG: cannot map optimized index");
+  }
+#ifdef MADV_HUGEPAGE
+  if (huge_pages) madvise(base, map_size, MADV_HUGEPAGE);
+#endif
+  const char *file_nodes = (const char *)base + nodes_offset;
+  // Checking the node array reads all of it, so a lazily mapped one is only
+  // checked when prefaulted anyway.
+  if (populate || !mapped) {
+    try {
+      in.Verify(SECTION_NODES, file_nodes);
+#ifdef ADA_NNS
+      if (meta.hash_bitwidth != 0) {
+        in.Verify(SECTION_HASH_CODES, file_nodes + nodes_bytes);
+        in.Verify(SECTION_HASH_FUNCTION,
+                  file_nodes + nodes_bytes + in.size(SECTION_HASH_CODES));
+      }
+#endif
+    } catch (...) {
+      munmap(base, map_size);
+      throw;
+    }
+  }
+  if (mapped) {
+    mapping_ = base;
+    mapping_size_ = map_size;
+    opt_graph_ = (char *)base + nodes_offset;
+  } else {
+    // Placed memory, or no hash data in the file: copy the nodes into an
+    // allocation with room for the hashes.
+    opt_graph_ = opt_memory_.Allocate(OptGraphBytes(), memory_policy_);
+    std::memcpy(opt_graph_, file_nodes, bytes);
+    munmap(base, map_size);
+    opt_memory_.Replicate(0, bytes);
+  }
+#ifdef ADA_NNS
+  if (meta.hash_bitwidth != 0) {
+    uint64_t hash_len = (hash_bitwidth_ >> 3);
+    hashed_set_ = (unsigned int *)(opt_graph_ + node_size * nd_);
+    hash_function_ = (float *)(opt_graph_ + node_size * nd_ + hash_len * nd_);
+  }
+#endif
+  has_built = true;
+  InitThreadContexts();
+}
+
+void IndexSSG::Save(const char *filename) {
+  if (final_graph_.size() != nd_) {
+    throw std::logic_error("IndexSSG: Save needs the graph of every node");
+  }
+  IndexMeta meta;
+  std::memset(&meta, 0, sizeof(meta));
+  meta.kind = kGraphFile;
+  meta.metric = metric_;
+  meta.dimension = (uint32_t)dimension_;
+  meta.width = width;
+  meta.nd = nd_;
+
+  std::vector<uint64_t> offsets(nd_ + 1, 0);
+  for (size_t i = 0; i < nd_; i++) {
+    offsets[i + 1] = offsets[i] + final_graph_[i].size();
+  }
+  IndexFileWriter out(filename);
+  out.Add(SECTION_META, &meta, sizeof(meta));
+  out.Add(SECTION_ENTRY_POINTS, eps_.data(), eps_.size() * sizeof(unsigned));
+  out.Add(SECTION_GRAPH_OFFSETS, offsets.data(),
+          offsets.size() * sizeof(uint64_t));
+  out.Begin(SECTION_GRAPH_NEIGHBORS);
+  for (size_t i = 0; i < nd_; i++) {
+    out.Write(final_graph_[i].data(), final_graph_[i].size() * sizeof(unsigned));
+  }
+  out.End();
+  out.Finish();
 }
 
 void IndexSSG::Load(const char *filename) {
+  if (!IndexFileReader::Recognize(filename)) {
+    LoadUnsectioned(filename);
+    return;
+  }
+  IndexFileReader in(filename);
+  IndexMeta meta;
+  in.Read(SECTION_META, &meta, sizeof(meta));
+  if (meta.kind != kGraphFile) {
+    throw std::runtime_error("IndexSSG: not a graph file (see LoadOptimized)");
+  }
+  if (meta.nd != nd_) {
+    throw std::runtime_error("IndexSSG: graph file node count mismatch");
+  }
+  width = meta.width;
+  eps_.resize(in.size(SECTION_ENTRY_POINTS) / sizeof(unsigned));
+  in.Read(SECTION_ENTRY_POINTS, eps_.data(), eps_.size() * sizeof(unsigned));
+  CheckEntryPoints();
+  // Both sections go straight into the CSR arrays of final_graph_.
+  std::vector<uint64_t> offsets(nd_ + 1);
+  in.Read(SECTION_GRAPH_OFFSETS, offsets.data(),
+          offsets.size() * sizeof(uint64_t));
+  std::vector<unsigned> neighbors(
+      in.size(SECTION_GRAPH_NEIGHBORS) / sizeof(unsigned));
+  in.Read(SECTION_GRAPH_NEIGHBORS, neighbors.data(),
+          neighbors.size() * sizeof(unsigned));
+  final_graph_.Assign(std::move(offsets), std::move(neighbors));
+  std::cerr << "Average Degree = "
+            << final_graph_.num_edges() / std::max<size_t>(nd_, 1) << std::endl;
+  InitThreadContexts();
+}
+
+void IndexSSG::LoadUnsectioned(const char *filename) {
   std::ifstream in(filename, std::ios::binary);
+  if (!in.is_open()) {
+    throw std::runtime_error("IndexSSG: cannot open " + std::string(filename));
+  }
   in.read((char *)&width, sizeof(unsigned));
   unsigned n_ep=0;
   in.read((char *)&n_ep, sizeof(unsigned));
   eps_.resize(n_ep);
   in.read((char *)eps_.data(), n_ep*sizeof(unsigned));
+  if (!in) throw std::runtime_error("IndexSSG: truncated graph file");
+  in.close();
   // width=100;
-  unsigned cc = 0;
-  while (!in.eof()) {
-    unsigned k;
-    in.read((char *)&k, sizeof(unsigned));
-    if (in.eof()) break;
-    cc += k;
-    std::vector<unsigned> tmp(k);
-    in.read((char *)tmp.data(), k * sizeof(unsigned));
-    final_graph_.push_back(tmp);
-  }
-  cc /= nd_;
+  final_graph_.LoadRows(filename, (2 + (size_t)n_ep) * sizeof(unsigned));
+  if (final_graph_.size() != nd_) {
+    throw std::runtime_error("IndexSSG: graph file node count mismatch");
+  }
+  CheckEntryPoints();
+  size_t cc = final_graph_.num_edges() / nd_;
   std::cerr << "Average Degree = " << cc << std::endl;
+  InitThreadContexts();
 }
 
 void IndexSSG::Load_nn_graph(const char *filename) {
-  std::ifstream in(filename, std::ios::binary);
-  unsigned k;
-  in.read((char *)&k, sizeof(unsigned));
-  in.seekg(0, std::ios::end);
-  std::ios::pos_type ss = in.tellg();
-  size_t fsize = (size_t)ss;
-  size_t num = (unsigned)(fsize / (k + 1) / 4);
-  in.seekg(0, std::ios::beg);
-
-  final_graph_.resize(num);
-  final_graph_.reserve(num);
-  unsigned kk = (k + 3) / 4 * 4;
-  for (size_t i = 0; i < num; i++) {
-    in.seekg(4, std::ios::cur);
-    final_graph_[i].resize(k);
-    final_graph_[i].reserve(kk);
-    in.read((char *)final_graph_[i].data(), k * sizeof(unsigned));
+  final_graph_.LoadRows(filename, 0);
+  if (final_graph_.size() != nd_) {
+    throw std::runtime_error("IndexSSG: kNN graph node count mismatch");
   }
-  in.close();
+}
+
+void IndexSSG::CheckEntryPoints() const {
+  for (unsigned ep : eps_) {
+    if (ep >= nd_) throw std::runtime_error("IndexSSG: entry point out of range");
+  }
+}
+
+void IndexSSG::SaveKnnGraph(const char *filename) const {
+  std::ofstream out(filename, std::ios::binary | std::ios::out);
+  for (size_t i = 0; i < final_graph_.size(); i++) {
+    CompactGraph::Row row = final_graph_[i];
+    unsigned k = row.size();
+    out.write((const char *)&k, sizeof(unsigned));
+    out.write((const char *)row.data(), k * sizeof(unsigned));
+  }
+  out.close();
+  if (!out) {
+    throw std::runtime_error("IndexSSG: cannot write " + std::string(filename));
+  }
+}
+
+void IndexSSG::InitKnnGraph(unsigned L, unsigned S) {
+  // Every pool starts with S random neighbors, every nn_new list with 2 * S.
+  KNNGraph().swap(nnd_graph);
+  nnd_graph.reserve(nd_);
+  std::mt19937 rng(rand());
+  for (unsigned i = 0; i < nd_; i++) {
+    nnd_graph.push_back(nhood(L, S, rng, (unsigned)nd_));
+  }
+  unsigned seed = rand();
+#pragma omp parallel
+  {
+    std::mt19937 thread_rng(seed + omp_get_thread_num());
+    std::vector<unsigned> ids(S + 1);
+    std::vector<const float *> vecs(S + 1);
+    std::vector<float> dists(S + 1);
+#pragma omp for schedule(dynamic, 100)
+    for (unsigned i = 0; i < nd_; i++) {
+      GenRandom(thread_rng, ids.data(), S + 1, (unsigned)nd_);
+      unsigned n = 0;
+      for (unsigned j = 0; j <= S && n < S; j++) {
+        if (ids[j] == i) continue;
+        ids[n] = ids[j];
+        vecs[n++] = data_ + dimension_ * (size_t)ids[j];
+      }
+      distance_->compare_rows_batch(data_ + dimension_ * (size_t)i, i,
+                                    vecs.data(), ids.data(), n,
+                                    (unsigned)dimension_, dists.data());
+      std::vector<Neighbor> &pool = nnd_graph[i].pool;
+      for (unsigned j = 0; j < n; j++) {
+        pool.push_back(Neighbor(ids[j], dists[j], true));
+      }
+      std::make_heap(pool.begin(), pool.end());
+    }
+  }
+}
+
+size_t IndexSSG::KnnJoin() {
+  size_t updates = 0;
+#pragma omp parallel reduction(+ : updates)
+  {
+    std::vector<unsigned> ids;
+    std::vector<const float *> vecs;
+    std::vector<float> dists;
+#pragma omp for schedule(dynamic, 100)
+    for (unsigned n = 0; n < nd_; n++) {
+      const nhood &nhd = nnd_graph[n];
+      // The pairs of the local join that involve new neighbor i, scored
+      // as one batch.
+      for (unsigned i : nhd.nn_new) {
+        ids.clear();
+        vecs.clear();
+        for (unsigned j : nhd.nn_new) {
+          if (i < j) ids.push_back(j);
+        }
+        for (unsigned j : nhd.nn_old) {
+          if (i != j) ids.push_back(j);
+        }
+        for (unsigned j : ids) vecs.push_back(data_ + dimension_ * (size_t)j);
+        dists.resize(ids.size());
+        distance_->compare_rows_batch(data_ + dimension_ * (size_t)i, i,
+                                      vecs.data(), ids.data(),
+                                      (unsigned)ids.size(),
+                                      (unsigned)dimension_, dists.data());
+        for (size_t m = 0; m < ids.size(); m++) {
+          updates += nnd_graph[i].insert(ids[m], dists[m]);
+          updates += nnd_graph[ids[m]].insert(i, dists[m]);
+        }
+      }
+    }
+  }
+  return updates;
+}
+
+void IndexSSG::KnnUpdate(unsigned L, unsigned S, unsigned R) {
+  // Samples up to S new neighbors per node (and the old ones before them)
+  // plus up to R reverse neighbors of each kind for the next join.
+  std::vector<float> radius(nd_);
+#pragma omp parallel for
+  for (unsigned n = 0; n < nd_; ++n) {
+    nhood &nhd = nnd_graph[n];
+    std::vector<unsigned>().swap(nhd.nn_new);
+    std::vector<unsigned>().swap(nhd.nn_old);
+    std::sort(nhd.pool.begin(), nhd.pool.end());
+    if (nhd.pool.size() > L) nhd.pool.resize(L);
+    radius[n] = nhd.pool.back().distance;
+    unsigned maxl = std::min(nhd.M + S, (unsigned)nhd.pool.size());
+    unsigned c = 0;
+    unsigned l = 0;
+    while (l < maxl && c < S) {
+      if (nhd.pool[l].flag) ++c;
+      ++l;
+    }
+    nhd.M = l;
+  }
+  unsigned seed = rand();
+#pragma omp parallel
+  {
+    std::mt19937 thread_rng(seed + omp_get_thread_num());
+#pragma omp for
+    for (unsigned n = 0; n < nd_; ++n) {
+      nhood &nhd = nnd_graph[n];
+      for (unsigned l = 0; l < nhd.M; ++l) {
+        Neighbor &nn = nhd.pool[l];
+        nhood &other = nnd_graph[nn.id];
+        std::vector<unsigned> &own = nn.flag ? nhd.nn_new : nhd.nn_old;
+        own.push_back(nn.id);
+        if (nn.distance > radius[nn.id]) {
+          std::vector<unsigned> &rnn =
+              nn.flag ? other.rnn_new : other.rnn_old;
+          pthread_mutex_lock(&other.lock);
+          if (rnn.size() < R) {
+            rnn.push_back(n);
+          } else {
+            rnn[thread_rng() % R] = n;
+          }
+          pthread_mutex_unlock(&other.lock);
+        }
+        nn.flag = false;
+      }
+      std::make_heap(nhd.pool.begin(), nhd.pool.end());
+    }
+  }
+#pragma omp parallel for
+  for (unsigned n = 0; n < nd_; ++n) {
+    nhood &nhd = nnd_graph[n];
+    nhd.nn_new.insert(nhd.nn_new.end(), nhd.rnn_new.begin(), nhd.rnn_new.end());
+    nhd.nn_old.insert(nhd.nn_old.end(), nhd.rnn_old.begin(), nhd.rnn_old.end());
+    if (nhd.nn_old.size() > R * 2) nhd.nn_old.resize(R * 2);
+    std::vector<unsigned>().swap(nhd.rnn_new);
+    std::vector<unsigned>().swap(nhd.rnn_old);
+  }
+}
+
+void IndexSSG::BuildKnnGraph(const Parameters &parameters) {
+  if (nd_ < 4) throw std::invalid_argument("IndexSSG: too few points");
+  const unsigned max_k = (unsigned)nd_ - 1;
+  const unsigned K = std::min(parameters.Get<unsigned>("nnd_K", 200), max_k);
+  const unsigned L = std::max(parameters.Get<unsigned>("nnd_L", 200), K);
+  // GenRandom() draws 2 * S distinct ids.
+  const unsigned S = std::min(parameters.Get<unsigned>("nnd_S", 10),
+                              ((unsigned)nd_ - 1) / 2);
+  const unsigned R = parameters.Get<unsigned>("nnd_R", 100);
+  const unsigned iter = parameters.Get<unsigned>("nnd_iter", 10);
+  const float delta = parameters.Get<float>("nnd_delta", 0.002f);
+
+  InitKnnGraph(L, S);
+  for (unsigned it = 0; it < iter; it++) {
+    size_t updates = KnnJoin();
+    KnnUpdate(L, S, R);
+    std::cerr << "NN-Descent iteration " << it + 1 << ": " << updates
+              << " updates" << std::endl;
+    if (updates < delta * K * nd_) break;
+  }
+
+  final_graph_.Reset(nd_, K);
+#pragma omp parallel
+  {
+    std::vector<unsigned> ids(K);
+#pragma omp for schedule(static, 4096)
+    for (unsigned n = 0; n < nd_; n++) {
+      std::vector<Neighbor> &pool = nnd_graph[n].pool;
+      std::sort(pool.begin(), pool.end());
+      unsigned k = std::min(K, (unsigned)pool.size());
+      for (unsigned j = 0; j < k; j++) ids[j] = pool[j].id;
+      final_graph_.SetRow(n, ids.data(), k);
+      std::vector<Neighbor>().swap(pool);
+    }
+  }
+  KNNGraph().swap(nnd_graph);
 }
 
 void IndexSSG::get_neighbors(const unsigned q, const Parameters &parameter,
-                             std::vector<Neighbor> &pool) {
-  boost::dynamic_bitset<> flags{nd_, 0};
+                             BuildContext &ctx) {
+  SparseVisitedSet &flags = ctx.visited;
+  std::vector<unsigned> &ids = ctx.batch_ids;
+  std::vector<const float *> &vecs = ctx.batch_vecs;
   unsigned L = parameter.Get<unsigned>("L");
-  flags[q] = true;
-  for (unsigned i = 0; i < final_graph_[q].size(); i++) {
+  flags.Reset();
+  flags.Set(q);
+  ids.clear();
+  vecs.clear();
+  for (unsigned i = 0; i < final_graph_[q].size() && ids.size() < L; i++) {
     unsigned nid = final_graph_[q][i];
     for (unsigned nn = 0; nn < final_graph_[nid].size(); nn++) {
       unsigned nnid = final_graph_[nid][nn];
-      if (flags[nnid]) continue;
-      flags[nnid] = true;
-      float dist = distance_->compare(data_ + dimension_ * q,
-                                      data_ + dimension_ * nnid, dimension_);
-      pool.push_back(Neighbor(nnid, dist, true));
-      if (pool.size() >= L) break;
+      if (flags.Get(nnid)) continue;
+      flags.Set(nnid);
+      ids.push_back(nnid);
+      vecs.push_back(data_ + dimension_ * (size_t)nnid);
+      if (ids.size() >= L) break;
     }
-    if (pool.size() >= L) break;
+  }
+  ctx.batch_dists.resize(ids.size());
+  distance_->compare_rows_batch(data_ + dimension_ * (size_t)q, q,
+                                vecs.data(), ids.data(), (unsigned)ids.size(),
+                                (unsigned)dimension_, ctx.batch_dists.data());
+  ctx.pool.clear();
+  for (unsigned i = 0; i < ids.size(); i++) {
+    ctx.pool.push_back(Neighbor(ids[i], ctx.batch_dists[i], true));
   }
 }
 
 void IndexSSG::get_neighbors(const float *query, const Parameters &parameter,
-                             std::vector<Neighbor> &retset,
+                             CandidatePool &retset,
                              std::vector<Neighbor> &fullset) {
   unsigned L = parameter.Get<unsigned>("L");
 
-  retset.resize(L + 1);
+  retset.Init(L);
   std::vector<unsigned> init_ids(L);
   // initializer_->Search(query, nullptr, L, parameter, init_ids.data());
   std::mt19937 rng(rand());
   GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
 
   boost::dynamic_bitset<> flags{nd_, 0};
-  L = 0;
   for (unsigned i = 0; i < init_ids.size(); i++) {
     unsigned id = init_ids[i];
     if (id >= nd_) continue;
     // std::cout<<id<<std::endl;
-    float dist = distance_->compare(data_ + dimension_ * (size_t)id, query,
-                                    (unsigned)dimension_);
-    retset[i] = Neighbor(id, dist, true);
+    float dist =
+        distance_->compare_rows(data_ + dimension_ * (size_t)id, id, query,
+                                Distance::kNoRow, (unsigned)dimension_);
+    retset.PushUnsorted(id, dist);
     flags[id] = 1;
-    L++;
   }
 
-  std::sort(retset.begin(), retset.begin() + L);
-  int k = 0;
-  while (k < (int)L) {
-    int nk = L;
-
-    if (retset[k].flag) {
-      retset[k].flag = false;
-      unsigned n = retset[k].id;
-
-      for (unsigned m = 0; m < final_graph_[n].size(); ++m) {
-        unsigned id = final_graph_[n][m];
-        if (flags[id]) continue;
-        flags[id] = 1;
-
-        float dist = distance_->compare(query, data_ + dimension_ * (size_t)id,
-                                        (unsigned)dimension_);
-        Neighbor nn(id, dist, true);
-        fullset.push_back(nn);
-        if (dist >= retset[L - 1].distance) continue;
-        int r = InsertIntoPool(retset.data(), L, nn);
-
-        if (L + 1 < retset.size()) ++L;
-        if (r < nk) nk = r;
-      }
+  retset.Sort();
+  std::vector<unsigned> batch_ids;
+  std::vector<const float *> batch_vecs;
+  std::vector<float> batch_dists;
+  unsigned n;
+  while (retset.PopUnexpanded(n)) {
+    batch_ids.clear();
+    batch_vecs.clear();
+    for (unsigned m = 0; m < final_graph_[n].size(); ++m) {
+      unsigned id = final_graph_[n][m];
+      if (flags[id]) continue;
+      flags[id] = 1;
+      batch_ids.push_back(id);
+      batch_vecs.push_back(data_ + dimension_ * (size_t)id);
+    }
+    batch_dists.resize(batch_ids.size());
+    distance_->compare_rows_batch(query, Distance::kNoRow, batch_vecs.data(),
+                                  batch_ids.data(), (unsigned)batch_ids.size(),
+                                  (unsigned)dimension_, batch_dists.data());
+    for (unsigned m = 0; m < batch_ids.size(); ++m) {
+      Neighbor nn(batch_ids[m], batch_dists[m], true);
+      fullset.push_back(nn);
+      retset.Insert(batch_ids[m], batch_dists[m]);
     }
-    if (nk <= k)
-      k = nk;
-    else
-      ++k;
   }
 }
 
@@ -171,34 +644,47 @@ void IndexSSG::init_graph(const Parameters &parameters) {
   for (unsigned j = 0; j < dimension_; j++) {
     center[j] /= nd_;
   }
-  std::vector<Neighbor> tmp, pool;
+  CandidatePool tmp;
+  std::vector<Neighbor> pool;
   // ep_ = rand() % nd_;  // random initialize navigating point
   get_neighbors(center, parameters, tmp, pool);
-  ep_ = tmp[0].id;  // For Compatibility
+  ep_ = tmp.id(0);  // For Compatibility
 }
 
-void IndexSSG::sync_prune(unsigned q, std::vector<Neighbor> &pool,
+void IndexSSG::sync_prune(unsigned q, BuildContext &ctx,
                           const Parameters &parameters, float threshold,
-                          SimpleNeighbor *cut_graph_) {
+                          SimpleNeighbor *des_pool) {
   unsigned range = parameters.Get<unsigned>("R");
   width = range;
   unsigned start = 0;
 
-  boost::dynamic_bitset<> flags{nd_, 0};
+  std::vector<Neighbor> &pool = ctx.pool;
+  SparseVisitedSet &flags = ctx.visited;
+  std::vector<unsigned> &ids = ctx.batch_ids;
+  std::vector<const float *> &vecs = ctx.batch_vecs;
+  flags.Reset();
   for (unsigned i = 0; i < pool.size(); ++i) {
-    flags[pool[i].id] = 1;
+    flags.Set(pool[i].id);
   }
+  ids.clear();
+  vecs.clear();
   for (unsigned nn = 0; nn < final_graph_[q].size(); nn++) {
     unsigned id = final_graph_[q][nn];
-    if (flags[id]) continue;
-    float dist = distance_->compare(data_ + dimension_ * (size_t)q,
-                                    data_ + dimension_ * (size_t)id,
-                                    (unsigned)dimension_);
-    pool.push_back(Neighbor(id, dist, true));
+    if (flags.Get(id)) continue;
+    ids.push_back(id);
+    vecs.push_back(data_ + dimension_ * (size_t)id);
+  }
+  ctx.batch_dists.resize(ids.size());
+  distance_->compare_rows_batch(data_ + dimension_ * (size_t)q, q,
+                                vecs.data(), ids.data(), (unsigned)ids.size(),
+                                (unsigned)dimension_, ctx.batch_dists.data());
+  for (unsigned i = 0; i < ids.size(); i++) {
+    pool.push_back(Neighbor(ids[i], ctx.batch_dists[i], true));
   }
 
   std::sort(pool.begin(), pool.end());
-  std::vector<Neighbor> result;
+  std::vector<Neighbor> &result = ctx.result;
+  result.clear();
   if (pool[start].id == q) start++;
   result.push_back(pool[start]);
 
@@ -210,9 +696,9 @@ void IndexSSG::sync_prune(unsigned q, std::vector<Neighbor> &pool,
         occlude = true;
         break;
       }
-      float djk = distance_->compare(data_ + dimension_ * (size_t)result[t].id,
-                                     data_ + dimension_ * (size_t)p.id,
-                                     (unsigned)dimension_);
+      float djk = distance_->compare_rows(
+          data_ + dimension_ * (size_t)result[t].id, result[t].id,
+          data_ + dimension_ * (size_t)p.id, p.id, (unsigned)dimension_);
       float cos_ij = (p.distance + result[t].distance - djk) / 2 /
                      sqrt(p.distance * result[t].distance);
       if (cos_ij > threshold) {
@@ -223,7 +709,6 @@ void IndexSSG::sync_prune(unsigned q, std::vector<Neighbor> &pool,
     if (!occlude) result.push_back(p);
   }
 
-  SimpleNeighbor *des_pool = cut_graph_ + (size_t)q * (size_t)range;
   for (size_t t = 0; t < result.size(); t++) {
     des_pool[t].id = result[t].id;
     des_pool[t].distance = result[t].distance;
@@ -233,76 +718,184 @@ void IndexSSG::sync_prune(unsigned q, std::vector<Neighbor> &pool,
   }
 }
 
-void IndexSSG::InterInsert(unsigned n, unsigned range, float threshold,
-                           std::vector<std::mutex> &locks,
-                           SimpleNeighbor *cut_graph_) {
-  SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
-  for (size_t i = 0; i < range; i++) {
-    if (src_pool[i].distance == -1) break;
-
-    SimpleNeighbor sn(n, src_pool[i].distance);
-    size_t des = src_pool[i].id;
-    SimpleNeighbor *des_pool = cut_graph_ + des * (size_t)range;
+// Reverse edge of the cut graph: src links to dst at distance.
+struct ReverseEdge {
+  unsigned dst;
+  unsigned src;
+  float distance;
+};
+
+// Stable parallel LSD radix sort of edges by dst, where every dst < n,
+// 8 bits per pass.
+static void SortByDestination(std::vector<ReverseEdge> &edges, size_t n) {
+  std::vector<ReverseEdge> buffer(edges.size());
+  const int max_threads = omp_get_max_threads();
+  std::vector<size_t> counts((size_t)max_threads * 256);
+  for (unsigned shift = 0; shift < 32 && ((n - 1) >> shift) != 0;
+       shift += 8) {
+#pragma omp parallel num_threads(max_threads)
+    {
+      const int t = omp_get_thread_num();
+      const int nt = omp_get_num_threads();
+      const size_t begin = edges.size() * t / nt;
+      const size_t end = edges.size() * (t + 1) / nt;
+      size_t *count = &counts[(size_t)t * 256];
+      std::fill(count, count + 256, 0);
+      for (size_t i = begin; i < end; i++) {
+        count[(edges[i].dst >> shift) & 255]++;
+      }
+#pragma omp barrier
+#pragma omp single
+      {
+        // Digit-major, thread-minor starting positions.
+        size_t pos = 0;
+        for (unsigned digit = 0; digit < 256; digit++) {
+          for (int u = 0; u < nt; u++) {
+            size_t c = counts[(size_t)u * 256 + digit];
+            counts[(size_t)u * 256 + digit] = pos;
+            pos += c;
+          }
+        }
+      }
+      for (size_t i = begin; i < end; i++) {
+        buffer[count[(edges[i].dst >> shift) & 255]++] = edges[i];
+      }
+    }
+    edges.swap(buffer);
+  }
+}
 
-    std::vector<SimpleNeighbor> temp_pool;
-    int dup = 0;
+// Moves the per-thread buffers into edges, sorted by dst < n, and returns
+// where the group of each destination starts, followed by edges.size().
+static std::vector<size_t> GroupByDestination(
+    std::vector<std::vector<ReverseEdge>> &buffers, size_t n,
+    std::vector<ReverseEdge> &edges) {
+  const int num_buffers = (int)buffers.size();
+  std::vector<size_t> starts(num_buffers + 1, 0);
+  for (int t = 0; t < num_buffers; t++) {
+    starts[t + 1] = starts[t] + buffers[t].size();
+  }
+  edges.resize(starts[num_buffers]);
+#pragma omp parallel for
+  for (int t = 0; t < num_buffers; t++) {
+    std::copy(buffers[t].begin(), buffers[t].end(), edges.begin() + starts[t]);
+    std::vector<ReverseEdge>().swap(buffers[t]);
+  }
+  std::vector<size_t> groups;
+  if (!edges.empty()) {
+    SortByDestination(edges, n);
+    const int max_threads = omp_get_max_threads();
+    std::vector<std::vector<size_t>> thread_groups(max_threads);
+#pragma omp parallel num_threads(max_threads)
     {
-      LockGuard guard(locks[des]);
-      for (size_t j = 0; j < range; j++) {
-        if (des_pool[j].distance == -1) break;
-        if (n == des_pool[j].id) {
-          dup = 1;
-          break;
+      const int t = omp_get_thread_num();
+      const int nt = omp_get_num_threads();
+      const size_t begin = edges.size() * t / nt;
+      const size_t end = edges.size() * (t + 1) / nt;
+      for (size_t i = begin; i < end; i++) {
+        if (i == 0 || edges[i].dst != edges[i - 1].dst) {
+          thread_groups[t].push_back(i);
         }
-        temp_pool.push_back(des_pool[j]);
       }
     }
-    if (dup) continue;
+    for (const std::vector<size_t> &g : thread_groups) {
+      groups.insert(groups.end(), g.begin(), g.end());
+    }
+  }
+  groups.push_back(edges.size());
+  return groups;
+}
+
+void IndexSSG::PruneByAngle(const std::vector<SimpleNeighbor> &pool,
+                            unsigned range, float threshold,
+                            std::vector<SimpleNeighbor> &result) const {
+  result.clear();
+  if (pool.empty()) return;
+  unsigned start = 0;
+  result.push_back(pool[start]);
+  while (result.size() < range && (++start) < pool.size()) {
+    auto &p = pool[start];
+    bool occlude = false;
+    for (unsigned t = 0; t < result.size(); t++) {
+      if (p.id == result[t].id) {
+        occlude = true;
+        break;
+      }
+      float djk = distance_->compare_rows(
+          data_ + dimension_ * (size_t)result[t].id, result[t].id,
+          data_ + dimension_ * (size_t)p.id, p.id, (unsigned)dimension_);
+      float cos_ij = (p.distance + result[t].distance - djk) / 2 /
+                     sqrt(p.distance * result[t].distance);
+      if (cos_ij > threshold) {
+        occlude = true;
+        break;
+      }
+    }
+    if (!occlude) result.push_back(p);
+  }
+}
 
-    temp_pool.push_back(sn);
-    if (temp_pool.size() > range) {
-      std::vector<SimpleNeighbor> result;
-      unsigned start = 0;
-      std::sort(temp_pool.begin(), temp_pool.end());
-      result.push_back(temp_pool[start]);
-      while (result.size() < range && (++start) < temp_pool.size()) {
-        auto &p = temp_pool[start];
-        bool occlude = false;
-        for (unsigned t = 0; t < result.size(); t++) {
-          if (p.id == result[t].id) {
-            occlude = true;
-            break;
-          }
-          float djk = distance_->compare(
-              data_ + dimension_ * (size_t)result[t].id,
-              data_ + dimension_ * (size_t)p.id, (unsigned)dimension_);
-          float cos_ij = (p.distance + result[t].distance - djk) / 2 /
-                         sqrt(p.distance * result[t].distance);
-          if (cos_ij > threshold) {
-            occlude = true;
+void IndexSSG::InterInsert(unsigned range, float threshold,
+                           SimpleNeighbor *cut_graph_) {
+  // Every thread collects the reverse edges of its nodes that are not
+  // already in the destination's pool; the pools are only read here.
+  const int max_threads = omp_get_max_threads();
+  std::vector<std::vector<ReverseEdge>> buffers(max_threads);
+#pragma omp parallel num_threads(max_threads)
+  {
+    std::vector<ReverseEdge> &buffer = buffers[omp_get_thread_num()];
+#pragma omp for schedule(dynamic, 100)
+    for (unsigned n = 0; n < nd_; ++n) {
+      SimpleNeighbor *src_pool = cut_graph_ + (size_t)n * (size_t)range;
+      for (size_t i = 0; i < range; i++) {
+        if (src_pool[i].distance == -1) break;
+        unsigned des = src_pool[i].id;
+        SimpleNeighbor *des_pool = cut_graph_ + des * (size_t)range;
+        bool dup = false;
+        for (size_t j = 0; j < range; j++) {
+          if (des_pool[j].distance == -1) break;
+          if (n == des_pool[j].id) {
+            dup = true;
             break;
           }
         }
-        if (!occlude) result.push_back(p);
+        if (!dup) buffer.push_back({des, n, src_pool[i].distance});
       }
-      {
-        LockGuard guard(locks[des]);
-        for (unsigned t = 0; t < result.size(); t++) {
-          des_pool[t] = result[t];
-        }
-        if (result.size() < range) {
-          des_pool[result.size()].distance = -1;
-        }
+    }
+  }
+  // One group of edges per destination, each merged into its pool by a
+  // single thread.
+  std::vector<ReverseEdge> edges;
+  std::vector<size_t> groups = GroupByDestination(buffers, nd_, edges);
+
+#pragma omp parallel
+  {
+    BuildContext ctx;
+    const int64_t num_groups = (int64_t)groups.size() - 1;
+#pragma omp for schedule(dynamic, 100)
+    for (int64_t g = 0; g < num_groups; g++) {
+      const size_t des = edges[groups[g]].dst;
+      SimpleNeighbor *des_pool = cut_graph_ + des * (size_t)range;
+      std::vector<SimpleNeighbor> &temp_pool = ctx.insert_pool;
+      temp_pool.clear();
+      for (size_t j = 0; j < range; j++) {
+        if (des_pool[j].distance == -1) break;
+        temp_pool.push_back(des_pool[j]);
       }
-    } else {
-      LockGuard guard(locks[des]);
-      for (unsigned t = 0; t < range; t++) {
-        if (des_pool[t].distance == -1) {
-          des_pool[t] = sn;
-          if (t + 1 < range) des_pool[t + 1].distance = -1;
-          break;
-        }
+      for (size_t e = groups[g]; e < groups[g + 1]; e++) {
+        temp_pool.push_back(SimpleNeighbor(edges[e].src, edges[e].distance));
       }
+      if (temp_pool.size() <= range) {
+        std::copy(temp_pool.begin(), temp_pool.end(), des_pool);
+        if (temp_pool.size() < range) des_pool[temp_pool.size()].distance = -1;
+        continue;
+      }
+
+      std::vector<SimpleNeighbor> &result = ctx.insert_result;
+      std::sort(temp_pool.begin(), temp_pool.end());
+      PruneByAngle(temp_pool, range, threshold, result);
+      std::copy(result.begin(), result.end(), des_pool);
+      if (result.size() < range) des_pool[result.size()].distance = -1;
     }
   }
 }
@@ -316,7 +909,6 @@ void IndexSSG::Link(const Parameters &parameters, SimpleNeighbor *cut_graph_) {
   std::mutex progress_lock;
   */
   unsigned range = parameters.Get<unsigned>("R");
-  std::vector<std::mutex> locks(nd_);
 
   float angle = parameters.Get<float>("A");
   float threshold = std::cos(angle / 180 * kPi);
@@ -324,13 +916,12 @@ void IndexSSG::Link(const Parameters &parameters, SimpleNeighbor *cut_graph_) {
 #pragma omp parallel
   {
     // unsigned cnt = 0;
-    std::vector<Neighbor> pool, tmp;
+    BuildContext ctx(2 * (size_t)parameters.Get<unsigned>("L"));
 #pragma omp for schedule(dynamic, 100)
     for (unsigned n = 0; n < nd_; ++n) {
-      pool.clear();
-      tmp.clear();
-      get_neighbors(n, parameters, pool);
-      sync_prune(n, pool, parameters, threshold, cut_graph_);
+      get_neighbors(n, parameters, ctx);
+      sync_prune(n, ctx, parameters, threshold,
+                 cut_graph_ + (size_t)n * (size_t)range);
       /*
       cnt++;
       if (cnt % step_size == 0) {
@@ -339,24 +930,31 @@ void IndexSSG::Link(const Parameters &parameters, SimpleNeighbor *cut_graph_) {
       }
       */
     }
-
-#pragma omp for schedule(dynamic, 100)
-    for (unsigned n = 0; n < nd_; ++n) {
-      InterInsert(n, range, threshold, locks, cut_graph_);
-    }
   }
+
+  InterInsert(range, threshold, cut_graph_);
 }
 
 void IndexSSG::Build(size_t n, const float *data,
                      const Parameters &parameters) {
-  std::string nn_graph_path = parameters.Get<std::string>("nn_graph_path");
+  std::string nn_graph_path =
+      parameters.Get<std::string>("nn_graph_path", std::string());
   unsigned range = parameters.Get<unsigned>("R");
-  Load_nn_graph(nn_graph_path.c_str());
   data_ = data;
+  UpdateRowNorms();
+  if (!nn_graph_path.empty()) {
+    Load_nn_graph(nn_graph_path.c_str());
+  } else {
+    BuildKnnGraph(parameters);
+    std::string save_path =
+        parameters.Get<std::string>("nn_graph_save_path", std::string());
+    if (!save_path.empty()) SaveKnnGraph(save_path.c_str());
+  }
   init_graph(parameters);
   SimpleNeighbor *cut_graph_ = new SimpleNeighbor[nd_ * (size_t)range];
   Link(parameters, cut_graph_);
-  final_graph_.resize(nd_);
+  final_graph_.Reset(nd_, range);
+  std::vector<unsigned> ids(range);
 
   for (size_t i = 0; i < nd_; i++) {
     SimpleNeighbor *pool = cut_graph_ + i * (size_t)range;
@@ -368,13 +966,15 @@ void IndexSSG::Build(size_t n, const float *data,
       pool_size = j;
     }
     ++pool_size;
-    final_graph_[i].resize(pool_size);
     for (unsigned j = 0; j < pool_size; j++) {
-      final_graph_[i][j] = pool[j].id;
+      ids[j] = pool[j].id;
     }
+    final_graph_.SetRow(i, ids.data(), pool_size);
   }
+  delete[] cut_graph_;
 
-  DFS_expand(parameters);
+  RepairConnectivity(parameters);
+  final_graph_.Compact();
 
   unsigned max, min, avg;
   max = 0;
@@ -390,91 +990,503 @@ void IndexSSG::Build(size_t n, const float *data,
   printf("Degree Statistics: Max = %d, Min = %d, Avg = %d\n",
          max, min, avg);
 
-  /* Buggy!
-  strong_connect(parameters);
+  has_built = true;
+}
 
-  max = 0;
-  min = nd_;
-  avg = 0;
+float IndexSSG::UpdateRowNorms(size_t num_old) {
+  if (metric_ == COSINE) {
+    std::vector<float> inverse_norms(nd_);
+#pragma omp parallel for
+    for (size_t i = 0; i < nd_; i++) {
+      float norm =
+          dist_fast_.norm(data_ + i * dimension_, (unsigned)dimension_);
+      inverse_norms[i] = norm > 0 ? 1 / std::sqrt(norm) : 0;
+    }
+    static_cast<DistanceCosine *>(distance_)->SetRows(std::move(inverse_norms));
+    return 0;
+  }
+  if (metric_ != INNER_PRODUCT) return 0;
+  std::vector<float> extra(nd_);
+  float max_squared_norm = 0;
+  float old_max_squared_norm = 0;
+#pragma omp parallel for reduction(max : max_squared_norm, old_max_squared_norm)
   for (size_t i = 0; i < nd_; i++) {
-    auto size = final_graph_[i].size();
-    max = max < size ? size : max;
-    min = min > size ? size : min;
-    avg += size;
+    extra[i] = dist_fast_.norm(data_ + i * dimension_, (unsigned)dimension_);
+    max_squared_norm = std::max(max_squared_norm, extra[i]);
+    if (i < num_old) {
+      old_max_squared_norm = std::max(old_max_squared_norm, extra[i]);
+    }
   }
-  avg /= 1.0 * nd_;
-  printf("Degree Statistics(After TreeGrow): Max = %d, Min = %d, Avg = %d\n",
-         max, min, avg);
-  */
+#pragma omp parallel for
+  for (size_t i = 0; i < nd_; i++) {
+    extra[i] = std::sqrt(std::max(max_squared_norm - extra[i], 0.0f));
+  }
+  static_cast<DistanceMaxInnerProduct *>(distance_)
+      ->SetRows(max_squared_norm, std::move(extra));
+  return old_max_squared_norm;
+}
 
-  has_built = true;
+size_t IndexSSG::CountClamped(size_t begin) const {
+  if (metric_ == PQ || !quantizer_.byte_codes()) return 0;
+  size_t clamped = 0;
+  const int64_t end = (int64_t)nd_;
+#pragma omp parallel reduction(+ : clamped)
+  {
+    std::vector<float> buf(2 * dimension_);
+#pragma omp for schedule(static)
+    for (int64_t i = (int64_t)begin; i < end; i++) {
+      clamped += quantizer_.CountClamped(TransformedRow(
+          data_ + i * dimension_, buf.data(), buf.data() + dimension_));
+    }
+  }
+  return clamped;
+}
+
+void IndexSSG::Insert(const float *vecs, size_t n,
+                      const Parameters &parameters) {
+  if ((final_graph_.empty() && opt_graph_ == nullptr) || data_ == nullptr) {
+    throw std::logic_error("IndexSSG: Insert() needs a graph and its data");
+  }
+  if (n == 0) return;
+  unsigned range = parameters.Get<unsigned>("R");
+  unsigned L = parameters.Get<unsigned>("L");
+  const size_t old_nd = nd_;
+  if (data_ != owned_data_.data()) {
+    owned_data_.assign(data_, data_ + old_nd * dimension_);
+  }
+  owned_data_.insert(owned_data_.end(), vecs, vecs + n * dimension_);
+  data_ = owned_data_.data();
+  if (final_graph_.empty()) RestoreGraph();
+
+  final_graph_.Reserve(range);
+  final_graph_.AddNodes(n, range);
+  nd_ += n;
+  float old_max_squared_norm = UpdateRowNorms(old_nd);
+  if (metric_ == INNER_PRODUCT) {
+    float max_squared_norm =
+        static_cast<DistanceMaxInnerProduct *>(distance_)->max_squared_norm();
+    if (max_squared_norm > old_max_squared_norm) {
+      std::cerr << "IndexSSG: inserted rows raise the largest squared norm "
+                << "from " << old_max_squared_norm << " to "
+                << max_squared_norm
+                << "; existing edges were chosen for the old one"
+                << std::endl;
+    }
+  }
+  if (opt_graph_ != nullptr) {
+    size_t clamped = CountClamped(old_nd);
+    if (clamped > 0) {
+      std::cerr << "IndexSSG: " << clamped << " values of the inserted rows "
+                << "lie outside the trained code range and are clamped"
+                << std::endl;
+    }
+  }
+  const unsigned old_width = width;
+  for (size_t begin = old_nd; begin < nd_; begin += kInsertBatch) {
+    InsertBatch(begin, std::min(nd_, begin + kInsertBatch), parameters);
+  }
+  width = std::max(old_width, range);
+  LinkUnreachable(L);
+  final_graph_.Compact();
+  if (opt_graph_ != nullptr) RelayoutOptGraph(old_nd);
+  InitThreadContexts();
+}
+
+void IndexSSG::InsertBatch(size_t begin, size_t end,
+                           const Parameters &parameters) {
+  unsigned range = parameters.Get<unsigned>("R");
+  unsigned L = parameters.Get<unsigned>("L");
+  float angle = parameters.Get<float>("A");
+  float threshold = std::cos(angle / 180 * kPi);
+  const int64_t n = (int64_t)(end - begin);
+  std::vector<SimpleNeighbor> cut_graph((size_t)n * range);
+
+  // Candidates are the nodes met by a search from eps_, pruned as in
+  // Link(). The graph is only read meanwhile.
+  const int max_threads = omp_get_max_threads();
+  std::vector<std::vector<ReverseEdge>> buffers(max_threads);
+#pragma omp parallel num_threads(max_threads)
+  {
+    BuildContext ctx(2 * (size_t)L);
+    CandidatePool retset;
+    std::vector<ReverseEdge> &buffer = buffers[omp_get_thread_num()];
+#pragma omp for schedule(dynamic, 16)
+    for (int64_t i = 0; i < n; i++) {
+      const unsigned q = (unsigned)(begin + i);
+      SimpleNeighbor *des_pool = cut_graph.data() + (size_t)i * range;
+      SearchFromEntryPoints(q, L, retset, ctx);
+      sync_prune(q, ctx, parameters, threshold, des_pool);
+      for (unsigned j = 0; j < range && des_pool[j].distance != -1; j++) {
+        buffer.push_back({des_pool[j].id, q, des_pool[j].distance});
+      }
+    }
+  }
+#pragma omp parallel
+  {
+    std::vector<unsigned> ids;
+#pragma omp for schedule(static)
+    for (int64_t i = 0; i < n; i++) {
+      const SimpleNeighbor *pool = cut_graph.data() + (size_t)i * range;
+      ids.clear();
+      for (unsigned j = 0; j < range && pool[j].distance != -1; j++) {
+        ids.push_back(pool[j].id);
+      }
+      final_graph_.SetRow(begin + i, ids.data(), (unsigned)ids.size());
+    }
+  }
+
+  // Reverse edges, one destination per thread at a time as in
+  // InterInsert(): appended while the row has fewer than range neighbors,
+  // otherwise pruned together with them.
+  std::vector<ReverseEdge> edges;
+  std::vector<size_t> groups = GroupByDestination(buffers, nd_, edges);
+#pragma omp parallel
+  {
+    BuildContext ctx;
+    std::vector<unsigned> &ids = ctx.batch_ids;
+    std::vector<const float *> &vecs = ctx.batch_vecs;
+    const int64_t num_groups = (int64_t)groups.size() - 1;
+#pragma omp for schedule(dynamic, 100)
+    for (int64_t g = 0; g < num_groups; g++) {
+      const unsigned des = edges[groups[g]].dst;
+      CompactGraph::Row row = final_graph_[des];
+      std::vector<SimpleNeighbor> &temp_pool = ctx.insert_pool;
+      temp_pool.clear();
+      for (size_t e = groups[g]; e < groups[g + 1]; e++) {
+        if (std::find(row.begin(), row.end(), edges[e].src) != row.end()) {
+          continue;
+        }
+        temp_pool.push_back(SimpleNeighbor(edges[e].src, edges[e].distance));
+      }
+      if (row.size() + temp_pool.size() <= range) {
+        for (const SimpleNeighbor &p : temp_pool) final_graph_.Append(des, p.id);
+        continue;
+      }
+
+      ids.assign(row.begin(), row.end());
+      vecs.clear();
+      for (unsigned id : ids) vecs.push_back(data_ + dimension_ * (size_t)id);
+      ctx.batch_dists.resize(ids.size());
+      distance_->compare_rows_batch(data_ + dimension_ * (size_t)des, des,
+                                    vecs.data(), ids.data(),
+                                    (unsigned)ids.size(), (unsigned)dimension_,
+                                    ctx.batch_dists.data());
+      for (unsigned i = 0; i < ids.size(); i++) {
+        temp_pool.push_back(SimpleNeighbor(ids[i], ctx.batch_dists[i]));
+      }
+      std::vector<SimpleNeighbor> &result = ctx.insert_result;
+      std::sort(temp_pool.begin(), temp_pool.end());
+      PruneByAngle(temp_pool, range, threshold, result);
+      ids.clear();
+      for (const SimpleNeighbor &p : result) ids.push_back(p.id);
+      final_graph_.SetRow(des, ids.data(), (unsigned)ids.size());
+    }
+  }
 }
 
 void IndexSSG::Search(const float *query, const float *x, size_t K,
                       const Parameters &parameters, unsigned *indices) {
-  const unsigned L = parameters.Get<unsigned>("L_search");
+  Search(query, x, K, parameters, indices, nullptr);
+}
+
+SearchResult IndexSSG::Search(const float *query, const float *x, size_t K,
+                              const Parameters &parameters, unsigned *indices,
+                              float *distances) {
+  SearchResult result;
+  SearchContext &ctx = GetThreadContext(parameters);
+  const unsigned L = ctx.params.L_search;
   data_ = x;
-  std::vector<Neighbor> retset(L + 1);
-  std::vector<unsigned> init_ids(L);
-  boost::dynamic_bitset<> flags{nd_, 0};
-  std::mt19937 rng(rand());
-  GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
+  CandidatePool &retset = ctx.retset;
+  std::vector<unsigned> &init_ids = ctx.init_ids;
+  if (!ctx.visited) ctx.visited.reset(new VisitedTable(nd_));
+  VisitedTable &flags = *ctx.visited;
+  flags.Reset();
+  GenRandom(ctx.rng, init_ids.data(), L, (unsigned)nd_);
   assert(eps_.size() < L);
   for(unsigned i=0; i<eps_.size(); i++){
     init_ids[i] = eps_[i];
   }
 
+  retset.Clear();
   for (unsigned i = 0; i < L; i++) {
     unsigned id = init_ids[i];
-    float dist = distance_->compare(data_ + dimension_ * id, query,
-                                    (unsigned)dimension_);
-    retset[i] = Neighbor(id, dist, true);
-    flags[id] = true;
-  }
-
-  std::sort(retset.begin(), retset.begin() + L);
-  int k = 0;
-  while (k < (int)L) {
-    int nk = L;
-
-    if (retset[k].flag) {
-      retset[k].flag = false;
-      unsigned n = retset[k].id;
-
-      for (unsigned m = 0; m < final_graph_[n].size(); ++m) {
-        unsigned id = final_graph_[n][m];
-        if (flags[id]) continue;
-        flags[id] = 1;
-        float dist = distance_->compare(query, data_ + dimension_ * id,
-                                        (unsigned)dimension_);
-        if (dist >= retset[L - 1].distance) continue;
-        Neighbor nn(id, dist, true);
-        int r = InsertIntoPool(retset.data(), L, nn);
-
-        if (r < nk) nk = r;
-      }
+    if (flags.Get(id)) continue;
+    const float *x = data_ + dimension_ * id;
+    float dist;
+    QueryDistances(query, &x, 1, &dist);
+    retset.PushUnsorted(id, dist);
+    flags.Set(id);
+  }
+  result.num_dist_comps = retset.size();
+
+  retset.Sort();
+  unsigned n;
+  while (retset.PopUnexpanded(n)) {
+    result.num_hops++;
+    CompactGraph::Row neighbors = final_graph_[n];
+    if (ctx.batch_ids.size() < neighbors.size()) {
+      ctx.batch_ids.resize(neighbors.size());
+      ctx.batch_vecs.resize(neighbors.size());
+      ctx.batch_dists.resize(neighbors.size());
+    }
+    unsigned num_batch = 0;
+    for (unsigned m = 0; m < neighbors.size(); ++m) {
+      unsigned id = neighbors[m];
+      if (flags.Get(id)) continue;
+      flags.Set(id);
+      ctx.batch_ids[num_batch] = id;
+      ctx.batch_vecs[num_batch] = data_ + dimension_ * id;
+      num_batch++;
+    }
+    QueryDistances(query, ctx.batch_vecs.data(), num_batch,
+                   ctx.batch_dists.data());
+    result.num_dist_comps += num_batch;
+    for (unsigned m = 0; m < num_batch; m++) {
+      retset.Insert(ctx.batch_ids[m], ctx.batch_dists[m]);
+    }
+  }
+  result.num_results = std::min((unsigned)K, retset.size());
+  for (size_t i = 0; i < result.num_results; i++) {
+    indices[i] = retset.id(i);
+  }
+  if (distances) {
+    for (size_t i = 0; i < result.num_results; i++) {
+      distances[i] = ReportedDistance(retset.distance(i));
     }
-    if (nk <= k)
-      k = nk;
-    else
-      ++k;
   }
-  for (size_t i = 0; i < K; i++) {
-    indices[i] = retset[i].id;
+  return result;
+}
+
+void IndexSSG::QueryDistances(const float *query, const float *const *xs,
+                              unsigned n, float *out) const {
+  if (metric_ == INNER_PRODUCT) {
+    // Not the extended L2 of distance_: queries are extended with 0.
+    dist_fast_.compare_batch(query, xs, n, (unsigned)dimension_, out);
+    for (unsigned i = 0; i < n; i++) out[i] = -out[i];
+    return;
   }
+  distance_->compare_batch(query, xs, n, (unsigned)dimension_, out);
 }
 
-void IndexSSG::SearchWithOptGraph(const float *query, boost::dynamic_bitset<>& flags, size_t K,
-                                  const Parameters &parameters,
-                                  unsigned *indices) {
-  unsigned L = parameters.Get<unsigned>("L_search");
-  DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
+float IndexSSG::ReportedDistance(float dist) const {
+  switch (metric_) {
+    case INNER_PRODUCT: return -dist;
+    case COSINE: return 1 - dist / 2;
+    default: return dist;
+  }
+}
 
-  std::vector<Neighbor> retset(L + 1);
-  std::vector<unsigned> init_ids(L);
-  std::mt19937 rng(rand());
-  GenRandom(rng, init_ids.data(), L, (unsigned)nd_);
+unsigned IndexSSG::RerankResults(const float *query, SearchContext &ctx,
+                                 size_t K, unsigned *indices,
+                                 float *distances) const {
+  const CandidatePool &retset = ctx.retset;
+  const unsigned n = retset.size();
+  for (unsigned i = 0; i < n; i++) {
+    ctx.batch_vecs[i] = data_ + dimension_ * OriginalId(retset.id(i));
+  }
+  QueryDistances(query, ctx.batch_vecs.data(), n, ctx.batch_dists.data());
+  std::vector<Neighbor> &pool = ctx.rerank_pool;
+  for (unsigned i = 0; i < n; i++) {
+    pool[i] = Neighbor(OriginalId(retset.id(i)), ctx.batch_dists[i], false);
+  }
+  const unsigned num = std::min((unsigned)K, n);
+  std::partial_sort(pool.begin(), pool.begin() + num, pool.begin() + n);
+  for (unsigned i = 0; i < num; i++) {
+    indices[i] = pool[i].id;
+    if (distances) distances[i] = ReportedDistance(pool[i].distance);
+  }
+  return num;
+}
+
+const float *IndexSSG::TransformedRow(const float *row, float *unit,
+                                      float *rotated) const {
+  if (metric_ == COSINE) {
+    // Unit rows, so |x|^2 - 2<q,x> ranks by cosine for a unit query.
+    float norm = std::sqrt(dist_fast_.norm(row, dimension_));
+    for (unsigned j = 0; j < dimension_; j++) {
+      unit[j] = norm > 0 ? row[j] / norm : 0;
+    }
+    row = unit;
+  }
+  if (pca_.trained()) {
+    pca_.Apply(row, rotated);
+    row = rotated;
+  }
+  return row;
+}
+
+void IndexSSG::InitSearchContext(SearchContext &ctx,
+                                 const Parameters &parameters) const {
+  ctx.params = SearchParameters(parameters);
+  ctx.rng.seed(rand());
+  ResizeSearchContext(ctx);
+}
+
+void IndexSSG::ResizeSearchContext(SearchContext &ctx) const {
+  const unsigned L = ctx.params.L_search;
   assert(eps_.size() < L);
+  ctx.retset.Init(L);
+  ctx.init_ids.resize(L);
+  const unsigned batch = std::max(width, L);
+  ctx.batch_ids.resize(batch);
+  ctx.batch_vecs.resize(batch);
+  ctx.batch_dists.resize(batch);
+  ctx.rerank_pool.resize(L);
+  ctx.query_buf.resize(2 * dimension_ +
+                       std::max((size_t)dimension_, pq_.table_size()));
+  ctx.use_sparse_visited = L <= sparse_visited_L_;
+  if (ctx.use_sparse_visited) {
+    ctx.visited.reset();
+  } else if (!ctx.visited || ctx.visited->size() != nd_) {
+    ctx.visited.reset(new VisitedTable(nd_));
+  }
+#ifdef ADA_NNS
+  ctx.hashed_query.resize(hash_bitwidth_ >> 5);
+  ctx.selected_pool.resize(width + 1);
+#endif
+  ctx.generation = generation_;
+}
+
+SearchContext &IndexSSG::GetThreadContext(const Parameters &parameters) {
+  unsigned tid = omp_get_thread_num();
+  if (tid >= thread_contexts_.size()) {
+    throw std::out_of_range("IndexSSG: thread id out of range");
+  }
+  std::unique_ptr<SearchContext> &ctx = thread_contexts_[tid];
+  if (!ctx) ctx.reset(new SearchContext());
+  // The flags are cheap to parse; only a new L resizes the buffers.
+  SearchParameters params(parameters);
+  if (ctx->params.L_search != params.L_search) {
+    InitSearchContext(*ctx, parameters);
+  }
+  ctx->params = params;
+  return *ctx;
+}
+
+SearchResult IndexSSG::SearchWithOptGraph(const float *query, size_t K,
+                                          const Parameters &parameters,
+                                          unsigned *indices,
+                                          float *distances) {
+  return SearchWithOptGraph(query, GetThreadContext(parameters), K, indices,
+                            distances);
+}
+
+SearchResult IndexSSG::SearchWithOptGraph(const float *query,
+                                          SearchContext &ctx, size_t K,
+                                          unsigned *indices,
+                                          float *distances) {
+#ifdef ADA_NNS
+  CheckHashes();
+#endif
+  if (ctx.generation != generation_) ResizeSearchContext(ctx);
+  return (this->*opt_search_)(query, ctx, K, indices, distances);
+}
+
+template <typename Scorer>
+SearchResult IndexSSG::SearchWithScorer(const float *query,
+                                        SearchContext &ctx, size_t K,
+                                        unsigned *indices, float *distances) {
+  if (ctx.use_sparse_visited) {
+    return SearchWithOptGraphImpl<Scorer>(query, ctx, ctx.sparse_visited, K,
+                                          indices, distances);
+  }
+  return SearchWithOptGraphImpl<Scorer>(query, ctx, *ctx.visited, K, indices,
+                                        distances);
+}
+
+IndexSSG::OptSearchFn IndexSSG::SelectOptSearch(unsigned dim, Metric metric,
+                                                VectorEncoding encoding) {
+  if (metric == PQ) return &IndexSSG::SearchWithScorer<PQScorer>;
+  if (encoding == FP16) return &IndexSSG::SearchWithScorer<Fp16Scorer>;
+  if (encoding != FP32) return &IndexSSG::SearchWithScorer<Sq8Scorer>;
+  switch (dim) {
+    case 96: return &IndexSSG::SearchWithScorer<FixedDimScorer<96>>;
+    case 100: return &IndexSSG::SearchWithScorer<FixedDimScorer<100>>;
+    case 104: return &IndexSSG::SearchWithScorer<FixedDimScorer<104>>;
+    case 128: return &IndexSSG::SearchWithScorer<FixedDimScorer<128>>;
+    case 200: return &IndexSSG::SearchWithScorer<FixedDimScorer<200>>;
+    case 256: return &IndexSSG::SearchWithScorer<FixedDimScorer<256>>;
+    case 960: return &IndexSSG::SearchWithScorer<FixedDimScorer<960>>;
+    default: return &IndexSSG::SearchWithScorer<GenericScorer>;
+  }
+}
+
+void IndexSSG::SearchBatch(const float *queries, size_t nq, size_t K,
+                           const Parameters &parameters, unsigned *ids,
+                           float *dists, SearchResult *results) {
+#ifdef ADA_NNS
+  // Not from inside the parallel region, where it could not propagate.
+  CheckHashes();
+#endif
+#pragma omp parallel
+  {
+    // Keep each thread on one node so it reads that node's copy, for this
+    // call only: the pool threads get their affinity back afterwards.
+    std::unique_ptr<ScopedNumaBinding> binding;
+    if (opt_memory_.replicated()) {
+      const std::vector<int> &nodes = NumaNodes();
+      binding.reset(new ScopedNumaBinding(
+          nodes[(size_t)omp_get_thread_num() * nodes.size() /
+                omp_get_num_threads()]));
+    }
+    SearchContext &ctx = GetThreadContext(parameters);
+#pragma omp for schedule(dynamic, kBatchChunk)
+    for (size_t i = 0; i < nq; i++) {
+      SearchResult result =
+          SearchWithOptGraph(queries + i * dimension_, ctx, K, ids + i * K,
+                             dists ? dists + i * K : nullptr);
+      if (results) results[i] = result;
+    }
+  }
+}
+
+template <typename Scorer, typename Visited>
+SearchResult IndexSSG::SearchWithOptGraphImpl(const float *query,
+                                              SearchContext &ctx,
+                                              Visited &flags, size_t K,
+                                              unsigned *indices,
+                                              float *distances) {
+  SearchResult result;
+  const unsigned L = ctx.params.L_search;
+  const float *raw_query = query;
+  // The copy of the nodes on this thread's NUMA node.
+  const char *opt_graph =
+      opt_memory_.replicated() ? opt_memory_.local() : opt_graph_;
+  Scorer scorer((unsigned)dimension_, quantizer_, pq_);
+  const unsigned dim = scorer.dim();
+  const size_t neighbor_offset = scorer.data_len();
+  const DistanceKernels &kernels = scorer.kernels;
+  if (metric_ == COSINE) {
+    float *normalized = ctx.query_buf.data();
+    float norm = std::sqrt(kernels.norm(query, dim));
+    for (unsigned i = 0; i < dim; i++) {
+      normalized[i] = norm > 0 ? query[i] / norm : 0;
+    }
+    query = normalized;
+  }
+  if (pca_.trained()) {
+    float *rotated = ctx.query_buf.data() + dim;
+    pca_.Apply(query, rotated);
+    query = rotated;
+  }
+  scorer.SetQuery(query, ctx.query_buf.data() + 2 * dim);
+  // Early abandoning bounds the true squared L2 distance, so it works with
+  // |q-x|^2 - |q|^2, which orders like the pool's |x|^2 - 2<q,x>. That does
+  // not hold for INNER_PRODUCT, where the stored norms are 0, nor for
+  // encoded vectors.
+  const bool early_abandon = Scorer::kFloatVectors &&
+                             ctx.params.early_abandon &&
+                             metric_ != INNER_PRODUCT;
+  // PQ always finishes on the full-precision rows.
+  const bool rerank =
+      (ctx.params.rerank || metric_ == PQ) && data_ != nullptr;
+  const float norm_q = (early_abandon || (distances && !rerank))
+                           ? kernels.norm(query, dim)
+                           : 0;
+
+  CandidatePool &retset = ctx.retset;
+  std::vector<unsigned> &init_ids = ctx.init_ids;
+  GenRandom(ctx.rng, init_ids.data(), L, (unsigned)nd_);
   for(unsigned i=0; i<eps_.size(); i++){
     init_ids[i] = eps_[i];
   }
@@ -482,9 +1494,8 @@ void IndexSSG::SearchWithOptGraph(const float *query, boost::dynamic_bitset<>& f
   unsigned int tid = omp_get_thread_num();
   auto visited_list_init_start = std::chrono::high_resolution_clock::now();
 #endif
-//  [ARC-SJ] Initialize visited list, allocation moved to main module
-//  boost::dynamic_bitset<> flags{nd_, 0};
-  flags.reset();
+  // Epoch-stamped reset, independent of nd_
+  flags.Reset();
 #ifdef PROFILE
   auto visited_list_init_end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> visited_list_init_diff = visited_list_init_end - visited_list_init_start;
@@ -493,38 +1504,31 @@ void IndexSSG::SearchWithOptGraph(const float *query, boost::dynamic_bitset<>& f
   for (unsigned i = 0; i < init_ids.size(); i++) {
     unsigned id = init_ids[i];
     if (id >= nd_) continue;
-    _mm_prefetch(opt_graph_ + node_size * id, _MM_HINT_T0);
+    _mm_prefetch(opt_graph + node_size * id, _MM_HINT_T0);
   }
-  L = 0;
+  retset.Clear();
   for (unsigned i = 0; i < init_ids.size(); i++) {
     unsigned id = init_ids[i];
-    if (id >= nd_) continue;
-    float *x = (float *)(opt_graph_ + node_size * id);
-    float norm_x = *x;
-    x++;
-    float dist = dist_fast->compare(x, query, norm_x, (unsigned)dimension_);
-    retset[i] = Neighbor(id, dist, true);
-    flags[id] = true;
-    L++;
+    if (id >= nd_ || flags.Get(id)) continue;
+    const float *x = (const float *)(opt_graph + node_size * id) + 1;
+    float dist = early_abandon ? kernels.l2(x, query, dim) - norm_q
+                               : scorer.Score(x);
+    retset.PushUnsorted(id, dist);
+    flags.Set(id);
   }
-  // std::cout<<L<<std::endl;
+  result.num_dist_comps = retset.size();
 
-  std::sort(retset.begin(), retset.begin() + L);
+  retset.Sort();
 #ifdef ADA_NNS
 #ifdef PROFILE
   auto query_hash_start = std::chrono::high_resolution_clock::now();
 #endif
-  std::vector<HashNeighbor> selected_pool(100);
+  std::vector<HashNeighbor> &selected_pool = ctx.selected_pool;
   unsigned int hash_size = hash_bitwidth_ >> 5;
-  unsigned int* hashed_query = new unsigned int[hash_size];
+  unsigned int* hashed_query = ctx.hashed_query.data();
+  const unsigned int* hashed_set =
+      (const unsigned int*)(opt_graph + node_size * nd_);
   QueryHash(query, hashed_query, hash_size); 
-#ifdef __AVX__
-  unsigned int hash_avx_size = hash_size >> 3;
-  __m256i hashed_query_avx[hash_avx_size];
-  for (unsigned int m = 0; m < hash_avx_size; m++) {
-    hashed_query_avx[m] = _mm256_loadu_si256((__m256i*)&hashed_query[m << 3]);
-  }
-#endif
 #ifdef PROFILE
   auto query_hash_end = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> query_hash_diff = query_hash_end - query_hash_start;
@@ -532,321 +1536,586 @@ void IndexSSG::SearchWithOptGraph(const float *query, boost::dynamic_bitset<>& f
 #endif
 #endif
 
-  int k = 0;
-  while (k < (int)L) {
-    int nk = L;
-
-    if (retset[k].flag) {
-      retset[k].flag = false;
-      unsigned n = retset[k].id;
-      _mm_prefetch(opt_graph_ + node_size * n + data_len, _MM_HINT_T0);
-      unsigned *neighbors = (unsigned *)(opt_graph_ + node_size * n + data_len);
-      unsigned MaxM = *neighbors;
-      neighbors++;
+  unsigned *batch_ids = ctx.batch_ids.data();
+  const float **batch_vecs = ctx.batch_vecs.data();
+  float *batch_dists = ctx.batch_dists.data();
+  unsigned n;
+  while (retset.PopUnexpanded(n)) {
+    result.num_hops++;
+    unsigned num_batch = 0;
+    _mm_prefetch(opt_graph + node_size * n + neighbor_offset, _MM_HINT_T0);
+    const unsigned *neighbors =
+        (const unsigned *)(opt_graph + node_size * n + neighbor_offset);
+    unsigned MaxM = *neighbors;
+    neighbors++;
 #ifdef ADA_NNS
 #ifdef PROFILE
-      auto cand_select_start = std::chrono::high_resolution_clock::now();
+    auto cand_select_start = std::chrono::high_resolution_clock::now();
 #endif
-      unsigned int selected_pool_size = CandidateSelection(hashed_query_avx, selected_pool, flags, neighbors, MaxM, hash_size);
+    unsigned int selected_pool_size = CandidateSelection(hashed_query, hashed_set, selected_pool, flags, neighbors, MaxM, hash_size);
 #ifdef PROFILE
-      auto cand_select_end = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double> cand_select_diff = cand_select_end - cand_select_start;
-      profile_time[tid * 4 + 2] += cand_select_diff.count() * 1000000;
+    auto cand_select_end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> cand_select_diff = cand_select_end - cand_select_start;
+    profile_time[tid * 4 + 2] += cand_select_diff.count() * 1000000;
 #endif
 #endif
 #ifdef PROFILE
-      auto dist_start = std::chrono::high_resolution_clock::now();
+    auto dist_start = std::chrono::high_resolution_clock::now();
 #endif
 #ifdef ADA_NNS
-      for (unsigned m = 0; m < selected_pool_size; ++m)
-        _mm_prefetch(opt_graph_ + node_size * selected_pool[m].id, _MM_HINT_T0);
-      for (unsigned int m = 0; m < selected_pool_size; m++) {
-        unsigned int id = selected_pool[m].id;
+    for (unsigned m = 0; m < selected_pool_size; ++m)
+      _mm_prefetch(opt_graph + node_size * selected_pool[m].id, _MM_HINT_T0);
+    for (unsigned int m = 0; m < selected_pool_size; m++) {
+      unsigned int id = selected_pool[m].id;
 #else
-      for (unsigned m = 0; m < MaxM; ++m)
-        _mm_prefetch(opt_graph_ + node_size * neighbors[m], _MM_HINT_T0);
-      for (unsigned m = 0; m < MaxM; ++m) {
-        unsigned id = neighbors[m];
+    for (unsigned m = 0; m < MaxM; ++m)
+      _mm_prefetch(opt_graph + node_size * neighbors[m], _MM_HINT_T0);
+    for (unsigned m = 0; m < MaxM; ++m) {
+      unsigned id = neighbors[m];
 #endif
 #ifdef GET_VISITED
-        total_neighbors++;
+      total_neighbors++;
 #endif
-        if (flags[id]) {
+      if (flags.Get(id)) {
 #ifdef GET_VISITED
-          visited_neighbors++;
+        visited_neighbors++;
 #endif
-          continue;
-        }
-        flags[id] = 1;
-        float *data = (float *)(opt_graph_ + node_size * id);
-        float norm = *data;
-        data++;
-        float dist =
-            dist_fast->compare(query, data, norm, (unsigned)dimension_);
+        continue;
+      }
+      flags.Set(id);
+      batch_ids[num_batch] = id;
+      batch_vecs[num_batch] = (const float *)(opt_graph + node_size * id) + 1;
+      num_batch++;
+    }
+    if (!early_abandon) {
+      scorer.ScoreBatch(batch_vecs, num_batch, batch_dists);
+    }
+    result.num_dist_comps += num_batch;
+    for (unsigned m = 0; m < num_batch; m++) {
+      unsigned id = batch_ids[m];
+      float dist = batch_dists[m];
+      if (early_abandon) {
+        dist = kernels.l2_bounded(query, batch_vecs[m], dim,
+                                  retset.Bound() + norm_q) - norm_q;
+      }
 #ifdef GET_DIST_COMP
-        total_dist_comp_++;
-        if (dist >= retset[L - 1].distance){
-          total_dist_comp_miss_++;
-          continue;
-        }
+      total_dist_comp_++;
+      if (dist >= retset.Bound()){
+        total_dist_comp_miss_++;
+        continue;
+      }
 #else
-        if (dist >= retset[L - 1].distance){
-          continue;
-        }
-#endif
-        Neighbor nn(id, dist, true);
-        int r = InsertIntoPool(retset.data(), L, nn);
-
-        // if(L+1 < retset.size()) ++L;
-        if (r < nk) nk = r;
+      if (dist >= retset.Bound()){
+        continue;
       }
-#ifdef PROFILE
-      auto dist_end = std::chrono::high_resolution_clock::now();
-      std::chrono::duration<double> dist_diff = dist_end - dist_start;
-      profile_time[tid * 4 + 3] += dist_diff.count() * 1000000;
 #endif
+      retset.Insert(id, dist);
     }
-    if (nk <= k)
-      k = nk;
-    else
-      ++k;
+#ifdef PROFILE
+    auto dist_end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double> dist_diff = dist_end - dist_start;
+    profile_time[tid * 4 + 3] += dist_diff.count() * 1000000;
+#endif
+  }
+  if (rerank) {
+    result.num_dist_comps += retset.size();
+    result.num_results =
+        RerankResults(raw_query, ctx, K, indices, distances);
+    return result;
+  }
+  result.num_results = std::min((unsigned)K, retset.size());
+  for (size_t i = 0; i < result.num_results; i++) {
+    indices[i] = OriginalId(retset.id(i));
   }
-  for (size_t i = 0; i < K; i++) {
-    indices[i] = retset[i].id;
+  if (distances) {
+    // The pool holds |x|^2 - 2<q,x>: add |q|^2 back for the squared L2.
+    // With |x|^2 stored as 0 (INNER_PRODUCT) or 1 (COSINE, unit q) it gives
+    // the inner product or the cosine similarity. PQ holds the ADC distance.
+    for (size_t i = 0; i < result.num_results; i++) {
+      float dist = retset.distance(i);
+      switch (metric_) {
+        case INNER_PRODUCT: distances[i] = -dist / 2; break;
+        case COSINE: distances[i] = (1 - dist) / 2; break;
+        case PQ: distances[i] = dist; break;
+        default: distances[i] = std::max(dist + norm_q, 0.0f); break;
+      }
+    }
   }
+  return result;
 }
 
 void IndexSSG::OptimizeGraph(const float *data) {  // use after build or load
-
   data_ = data;
-  data_len = (dimension_ + 1) * sizeof(float);
-  neighbor_len = (width + 1) * sizeof(unsigned);
-  node_size = data_len + neighbor_len;
-#ifdef ADA_NNS
-  uint64_t hash_len = (hash_bitwidth_ >> 3);
-  uint64_t hash_function_size = dimension_ * hash_bitwidth_ * sizeof(float);
-#ifdef MMAP_HUGETLB
-  opt_graph_ = (char *) mmap(NULL, node_size * nd_ + hash_len * nd_ + hash_function_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
-#else
-  opt_graph_ = (char *)malloc(node_size * nd_ + hash_len * nd_ + hash_function_size);
-#endif
-#else
-#ifdef MMAP_HUGETLB
-  opt_graph_ = (char *) mmap(NULL, node_size * nd_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_POPULATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
-#else
-  opt_graph_ = (char *)malloc(node_size * nd_);
-#endif
-#endif
-  DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
-  for (unsigned i = 0; i < nd_; i++) {
-    char *cur_node_offset = opt_graph_ + i * node_size;
-    float cur_norm = dist_fast->norm(data_ + i * dimension_, dimension_);
-    std::memcpy(cur_node_offset, &cur_norm, sizeof(float));
-    std::memcpy(cur_node_offset + sizeof(float), data_ + i * dimension_,
-                data_len - sizeof(float));
-
-    cur_node_offset += data_len;
-    unsigned k = final_graph_[i].size();
-    std::memcpy(cur_node_offset, &k, sizeof(unsigned));
-    std::memcpy(cur_node_offset + sizeof(unsigned), final_graph_[i].data(),
-                k * sizeof(unsigned));
-    std::vector<unsigned>().swap(final_graph_[i]);
+  std::vector<float> samples;
+  if (use_pca_ || metric_ == PQ) {
+    std::vector<unsigned> ids = SampleRows();
+    samples.resize(ids.size() * dimension_);
+    for (size_t s = 0; s < ids.size(); s++) {
+      std::memcpy(&samples[s * dimension_], data_ + ids[s] * dimension_,
+                  dimension_ * sizeof(float));
+    }
+  }
+  std::vector<unsigned> old_to_new = PrepareOptGraph(samples);
+  if (metric_ != PQ && encoding_ == SQ8) {
+    std::vector<float> min(dimension_, std::numeric_limits<float>::max());
+    std::vector<float> max(dimension_, std::numeric_limits<float>::lowest());
+    UpdateRange(data_, nd_, min, max);
+    quantizer_.SetRange(min.data(), max.data());
+  }
+  for (size_t begin = 0; begin < nd_; begin += kStreamRows) {
+    FillNodes(data_ + begin * dimension_, begin,
+              std::min(kStreamRows, nd_ - begin), old_to_new);
   }
   CompactGraph().swap(final_graph_);
+  opt_memory_.Replicate(0, node_size * nd_);
+  InitThreadContexts();
 }
 
-void IndexSSG::DFS(boost::dynamic_bitset<> &flag,
-                   std::vector<std::pair<unsigned, unsigned>> &edges,
-                   unsigned root, unsigned &cnt) {
-  unsigned tmp = root;
-  std::stack<unsigned> s;
-  s.push(root);
-  if (!flag[root]) cnt++;
-  flag[root] = true;
-  while (!s.empty()) {
-    unsigned next = nd_ + 1;
-    for (unsigned i = 0; i < final_graph_[tmp].size(); i++) {
-      if (flag[final_graph_[tmp][i]] == false) {
-        next = final_graph_[tmp][i];
-        break;
+void IndexSSG::OptimizeGraphFromFile(const char *filename) {
+  VecsFile file(filename);
+  if (file.dim() > dimension_ || file.num() != nd_) {
+    throw std::runtime_error("IndexSSG: " + std::string(filename) +
+                             " does not match the index size");
+  }
+  // Rows are zero-padded to dimension_, as data_align() does.
+  auto read_rows = [&](size_t begin, size_t n, float *out) {
+    file.ReadFloatRows(begin, n, out, dimension_);
+  };
+
+  data_ = nullptr;
+  std::vector<unsigned> old_to_new;
+  {
+    std::vector<float> samples;
+    if (use_pca_ || metric_ == PQ) {
+      std::vector<unsigned> ids = SampleRows();
+      samples.resize(ids.size() * dimension_);
+      for (size_t s = 0; s < ids.size(); s++) {
+        read_rows(ids[s], 1, &samples[s * dimension_]);
       }
     }
-    // std::cout << next <<":"<<cnt <<":"<<tmp <<":"<<s.size()<< '\n';
-    if (next == (nd_ + 1)) {
-      unsigned head = s.top();
-      s.pop();
-      if (s.empty()) break;
-      tmp = s.top();
-      unsigned tail = tmp;
-      if (check_edge(head, tail)) {
-        edges.push_back(std::make_pair(head, tail));
-      }
-      continue;
+    old_to_new = PrepareOptGraph(samples);
+  }
+  std::vector<float> chunk(kStreamRows * dimension_);
+  if (metric_ != PQ && encoding_ == SQ8) {
+    std::vector<float> min(dimension_, std::numeric_limits<float>::max());
+    std::vector<float> max(dimension_, std::numeric_limits<float>::lowest());
+    for (size_t begin = 0; begin < nd_; begin += kStreamRows) {
+      size_t n = std::min(kStreamRows, nd_ - begin);
+      read_rows(begin, n, chunk.data());
+      UpdateRange(chunk.data(), n, min, max);
     }
-    tmp = next;
-    flag[tmp] = true;
-    s.push(tmp);
-    cnt++;
+    quantizer_.SetRange(min.data(), max.data());
+  }
+  for (size_t begin = 0; begin < nd_; begin += kStreamRows) {
+    size_t n = std::min(kStreamRows, nd_ - begin);
+    read_rows(begin, n, chunk.data());
+    FillNodes(chunk.data(), begin, n, old_to_new);
   }
+  CompactGraph().swap(final_graph_);
+  opt_memory_.Replicate(0, node_size * nd_);
+  InitThreadContexts();
 }
 
-void IndexSSG::findroot(boost::dynamic_bitset<> &flag, unsigned &root,
-                        const Parameters &parameter) {
-  unsigned id = nd_;
-  for (unsigned i = 0; i < nd_; i++) {
-    if (flag[i] == false) {
-      id = i;
-      break;
-    }
+void IndexSSG::RestoreGraph() {
+  std::vector<uint64_t> offsets(nd_ + 1, 0);
+  for (unsigned pos = 0; pos < nd_; pos++) {
+    const char *node = opt_graph_ + pos * node_size + data_len;
+    offsets[OriginalId(pos) + 1] = *(const unsigned *)node;
+  }
+  for (size_t i = 0; i < nd_; i++) offsets[i + 1] += offsets[i];
+  std::vector<unsigned> ids(offsets[nd_]);
+  const int64_t rows = (int64_t)nd_;
+#pragma omp parallel for schedule(static, 4096)
+  for (int64_t pos = 0; pos < rows; pos++) {
+    const char *node = opt_graph_ + pos * node_size + data_len;
+    const unsigned k = *(const unsigned *)node;
+    const unsigned *neighbors = (const unsigned *)(node + sizeof(unsigned));
+    unsigned *out = ids.data() + offsets[OriginalId((unsigned)pos)];
+    for (unsigned m = 0; m < k; m++) out[m] = OriginalId(neighbors[m]);
   }
+  final_graph_.Assign(std::move(offsets), std::move(ids));
+  for (unsigned &ep : eps_) ep = OriginalId(ep);
+}
 
-  if (id == nd_) return;  // No Unlinked Node
+void IndexSSG::RelayoutOptGraph(size_t old_nd) {
+  std::vector<unsigned> old_to_new;
+  if (!new_to_old_.empty()) {
+    for (size_t i = old_nd; i < nd_; i++) new_to_old_.push_back((unsigned)i);
+    old_to_new.resize(nd_);
+    for (unsigned i = 0; i < nd_; i++) old_to_new[new_to_old_[i]] = i;
+    for (unsigned &ep : eps_) ep = old_to_new[ep];
+  }
+#ifdef ADA_NNS
+  // The old nodes keep their positions, so their hashes are kept with the
+  // hash function and only the new nodes are hashed.
+  const size_t hash_len = hash_bitwidth_ >> 3;
+  const size_t hash_function_size = dimension_ * hash_bitwidth_ * sizeof(float);
+  std::vector<char> hashes;
+  if (HasHashes()) {
+    hashes.resize(hash_len * old_nd + hash_function_size);
+    std::memcpy(hashes.data(), hashed_set_, hash_len * old_nd);
+    std::memcpy(hashes.data() + hash_len * old_nd, hash_function_,
+                hash_function_size);
+  }
+#endif
+  neighbor_len = (width + 1) * sizeof(unsigned);
+  node_size = data_len + neighbor_len;
+  FreeOptGraph();
+  opt_graph_ = opt_memory_.Allocate(OptGraphBytes(), memory_policy_);
+  for (size_t begin = 0; begin < nd_; begin += kStreamRows) {
+    FillNodes(data_ + begin * dimension_, begin,
+              std::min(kStreamRows, nd_ - begin), old_to_new);
+  }
+  CompactGraph().swap(final_graph_);
+  opt_memory_.Replicate(0, node_size * nd_);
+#ifdef ADA_NNS
+  if (!hashes.empty()) {
+    hashed_set_ = (unsigned *)(opt_graph_ + node_size * nd_);
+    hash_function_ = (float *)(opt_graph_ + node_size * nd_ + hash_len * nd_);
+    std::memcpy(hashed_set_, hashes.data(), hash_len * old_nd);
+    std::memcpy(hash_function_, hashes.data() + hash_len * old_nd,
+                hash_function_size);
+    HashNodes(old_nd, nd_);
+    ReplicateHashes();
+  }
+#endif
+}
 
-  std::vector<Neighbor> tmp, pool;
-  get_neighbors(data_ + dimension_ * id, parameter, tmp, pool);
-  std::sort(pool.begin(), pool.end());
+std::vector<unsigned> IndexSSG::SampleRows() const {
+  size_t max_samples = 0;
+  if (use_pca_) max_samples = kPCASamples;
+  if (metric_ == PQ) max_samples = std::max(max_samples, kPQSamples);
+  std::vector<unsigned> ids(nd_);
+  for (unsigned i = 0; i < nd_; i++) ids[i] = i;
+  std::mt19937 rng(1234);
+  std::shuffle(ids.begin(), ids.end(), rng);
+  ids.resize(std::min(nd_, max_samples));
+  std::sort(ids.begin(), ids.end());
+  return ids;
+}
+
+std::vector<unsigned> IndexSSG::PrepareOptGraph(
+    const std::vector<float> &samples) {
+  const size_t num_samples = samples.size() / dimension_;
+  opt_search_ = SelectOptSearch((unsigned)dimension_, metric_, encoding_);
+  if (use_pca_) {
+    pca_.Train(samples.data(), num_samples, (unsigned)dimension_,
+               kPCASamples);
+  }
+  quantizer_.Init(encoding_, (unsigned)dimension_);
+  if (metric_ == PQ) TrainProductQuantizer(samples.data(), num_samples);
+  data_len = sizeof(float) + CodeSize();
+  // Node i of opt_graph_ holds original node new_to_old_[i]; neighbor ids
+  // and eps_ are renumbered.
+  std::vector<unsigned> old_to_new;
+  if (reorder_) {
+    ReorderGraph();
+    old_to_new.resize(nd_);
+    for (unsigned i = 0; i < nd_; i++) old_to_new[new_to_old_[i]] = i;
+    for (unsigned &ep : eps_) ep = old_to_new[ep];
+  } else {
+    new_to_old_.clear();
+  }
+  neighbor_len = (width + 1) * sizeof(unsigned);
+  node_size = data_len + neighbor_len;
+  FreeOptGraph();
+  opt_graph_ = opt_memory_.Allocate(OptGraphBytes(), memory_policy_);
+  return old_to_new;
+}
 
-  bool found = false;
-  for (unsigned i = 0; i < pool.size(); i++) {
-    if (flag[pool[i].id]) {
-      // std::cout << pool[i].id << '\n';
-      root = pool[i].id;
-      found = true;
-      break;
+void IndexSSG::FillNodes(const float *rows, size_t begin, size_t n,
+                         const std::vector<unsigned> &old_to_new) {
+  const DistanceFastL2 *dist_fast = &dist_fast_;
+#pragma omp parallel
+  {
+    // unit, rotated and decoded rows
+    std::vector<float> buf(3 * dimension_);
+    float *decoded = buf.data() + 2 * dimension_;
+#pragma omp for schedule(static)
+    for (size_t r = 0; r < n; r++) {
+      const unsigned old = (unsigned)(begin + r);
+      const unsigned pos = old_to_new.empty() ? old : old_to_new[old];
+      char *cur_node_offset = opt_graph_ + pos * node_size;
+      char *cur_data = cur_node_offset + sizeof(float);
+      const float *row = TransformedRow(rows + r * dimension_, buf.data(),
+                                        buf.data() + dimension_);
+      EncodeRow(row, cur_data);
+      // The norm of the vector as stored, so the score of an encoded node
+      // is that of its decoded vector.
+      if (EncodedVectors()) {
+        DecodeRow(cur_data, decoded);
+        row = decoded;
+      }
+      // For INNER_PRODUCT the stored |x|^2 is 0, so nodes rank by -2<q,x>.
+      // PQ scores do not use it.
+      float cur_norm = metric_ == INNER_PRODUCT || metric_ == PQ
+                           ? 0
+                           : dist_fast->norm(row, dimension_);
+      std::memcpy(cur_node_offset, &cur_norm, sizeof(float));
+
+      cur_node_offset += data_len;
+      CompactGraph::Row neighbors = final_graph_[old];
+      unsigned k = neighbors.size();
+      std::memcpy(cur_node_offset, &k, sizeof(unsigned));
+      unsigned *ids = (unsigned *)(cur_node_offset + sizeof(unsigned));
+      if (old_to_new.empty()) {
+        std::memcpy(ids, neighbors.data(), k * sizeof(unsigned));
+      } else {
+        for (unsigned m = 0; m < k; m++) ids[m] = old_to_new[neighbors[m]];
+      }
     }
   }
-  if (!found) {
-    for (int retry = 0; retry < 1000; ++retry) {
-      unsigned rid = rand() % nd_;
-      if (flag[rid]) {
-        root = rid;
-        break;
+  final_graph_.ReleaseRows(begin, begin + n);
+}
+
+void IndexSSG::ReorderGraph() {
+  // Breadth-first order from the entry points, so a node's neighbors mostly
+  // land in nearby nodes of opt_graph_. Nodes not reached from eps_ start
+  // new traversals in id order.
+  new_to_old_.clear();
+  new_to_old_.reserve(nd_);
+  boost::dynamic_bitset<> visited(nd_);
+  auto traverse = [&](unsigned root) {
+    if (visited[root]) return;
+    visited[root] = true;
+    size_t head = new_to_old_.size();
+    new_to_old_.push_back(root);
+    for (; head < new_to_old_.size(); head++) {
+      for (unsigned id : final_graph_[new_to_old_[head]]) {
+        if (visited[id]) continue;
+        visited[id] = true;
+        new_to_old_.push_back(id);
       }
     }
+  };
+  for (unsigned ep : eps_) traverse(ep);
+  for (unsigned i = 0; i < nd_; i++) traverse(i);
+}
+
+void IndexSSG::UpdateRange(const float *rows, size_t n,
+                           std::vector<float> &min,
+                           std::vector<float> &max) const {
+  // Per-dimension range of the rows as stored, merged across threads.
+#pragma omp parallel
+  {
+    std::vector<float> buf(2 * dimension_);
+    std::vector<float> local_min(min), local_max(max);
+#pragma omp for schedule(static)
+    for (size_t r = 0; r < n; r++) {
+      const float *row = TransformedRow(rows + r * dimension_, buf.data(),
+                                        buf.data() + dimension_);
+      for (unsigned j = 0; j < dimension_; j++) {
+        local_min[j] = std::min(local_min[j], row[j]);
+        local_max[j] = std::max(local_max[j], row[j]);
+      }
+    }
+#pragma omp critical
+    for (unsigned j = 0; j < dimension_; j++) {
+      min[j] = std::min(min[j], local_min[j]);
+      max[j] = std::max(max[j], local_max[j]);
+    }
   }
-  final_graph_[root].push_back(id);
 }
 
-bool IndexSSG::check_edge(unsigned h, unsigned t) {
-  bool flag = true;
-  for (unsigned i = 0; i < final_graph_[h].size(); i++) {
-    if (t == final_graph_[h][i]) flag = false;
+void IndexSSG::TrainProductQuantizer(const float *samples, size_t n) {
+  std::vector<float> rows(n * dimension_);
+#pragma omp parallel
+  {
+    std::vector<float> buf(2 * dimension_);
+#pragma omp for schedule(static)
+    for (size_t s = 0; s < n; s++) {
+      const float *row = TransformedRow(samples + s * dimension_, buf.data(),
+                                        buf.data() + dimension_);
+      std::memcpy(&rows[s * dimension_], row, dimension_ * sizeof(float));
+    }
   }
-  return flag;
+  unsigned num_subspaces = pq_subspaces_ ? pq_subspaces_
+                                         : std::max(1u, (unsigned)dimension_ / 4);
+  pq_.Train(rows.data(), n, (unsigned)dimension_, num_subspaces,
+            kPQIterations);
 }
 
-void IndexSSG::strong_connect(const Parameters &parameter) {
-  unsigned n_try = parameter.Get<unsigned>("n_try");
-  std::vector<std::pair<unsigned, unsigned>> edges_all;
-  std::mutex edge_lock;
+size_t IndexSSG::CodeSize() const {
+  return metric_ == PQ ? pq_.code_size() : quantizer_.code_size();
+}
 
-#pragma omp parallel for
-  for (unsigned nt = 0; nt < n_try; nt++) {
-    unsigned root = rand() % nd_;
-    boost::dynamic_bitset<> flags{nd_, 0};
-    unsigned unlinked_cnt = 0;
-    std::vector<std::pair<unsigned, unsigned>> edges;
-
-    while (unlinked_cnt < nd_) {
-      DFS(flags, edges, root, unlinked_cnt);
-      // std::cout << unlinked_cnt << '\n';
-      if (unlinked_cnt >= nd_) break;
-      findroot(flags, root, parameter);
-      // std::cout << "new root"<<":"<<root << '\n';
-    }
-
-    LockGuard guard(edge_lock);
-
-    for (unsigned i = 0; i < edges.size(); i++) {
-      edges_all.push_back(edges[i]);
-    }
-  }
-  unsigned ecnt = 0;
-  for (unsigned e = 0; e < edges_all.size(); e++) {
-    unsigned start = edges_all[e].first;
-    unsigned end = edges_all[e].second;
-    unsigned flag = 1;
-    for (unsigned j = 0; j < final_graph_[start].size(); j++) {
-      if (end == final_graph_[start][j]) {
-        flag = 0;
+void IndexSSG::EncodeRow(const float *row, char *code) const {
+  if (metric_ == PQ) {
+    pq_.Encode(row, (uint8_t *)code);
+  } else {
+    quantizer_.Encode(row, code);
+  }
+}
+
+void IndexSSG::DecodeRow(const char *code, float *row) const {
+  if (metric_ == PQ) {
+    pq_.Decode((const uint8_t *)code, row);
+  } else {
+    quantizer_.Decode(code, row);
+  }
+}
+
+void IndexSSG::InitThreadContexts() {
+  generation_++;
+  thread_contexts_.clear();
+  thread_contexts_.resize(kMaxSearchThreads);
+}
+
+void IndexSSG::MarkReachable(std::vector<unsigned> &frontier,
+                             std::vector<uint8_t> &reached) const {
+  std::vector<unsigned> next;
+  while (!frontier.empty()) {
+    next.clear();
+    const int64_t size = (int64_t)frontier.size();
+    // Most components left over are small: their levels stay on one thread.
+#pragma omp parallel if (size >= kParallelFrontier)
+    {
+      std::vector<unsigned> local;
+#pragma omp for schedule(dynamic, 64) nowait
+      for (int64_t i = 0; i < size; i++) {
+        for (unsigned id : final_graph_[frontier[i]]) {
+          if (__atomic_load_n(&reached[id], __ATOMIC_RELAXED)) continue;
+          if (__sync_bool_compare_and_swap(&reached[id], 0, 1)) {
+            local.push_back(id);
+          }
+        }
       }
+#pragma omp critical(mark_reachable)
+      next.insert(next.end(), local.begin(), local.end());
     }
-    if (flag) {
-      final_graph_[start].push_back(end);
-      ecnt++;
+    frontier.swap(next);
+  }
+}
+
+void IndexSSG::SearchFromEntryPoints(unsigned q, unsigned L,
+                                     CandidatePool &retset,
+                                     BuildContext &ctx) const {
+  const float *query = data_ + dimension_ * (size_t)q;
+  SparseVisitedSet &visited = ctx.visited;
+  std::vector<unsigned> &ids = ctx.batch_ids;
+  std::vector<const float *> &vecs = ctx.batch_vecs;
+  std::vector<float> &dists = ctx.batch_dists;
+  retset.Init(std::max<unsigned>(L, (unsigned)eps_.size()));
+  visited.Reset();
+  ctx.pool.clear();
+  ids.clear();
+  vecs.clear();
+  for (unsigned ep : eps_) {
+    if (visited.Get(ep)) continue;
+    visited.Set(ep);
+    ids.push_back(ep);
+    vecs.push_back(data_ + dimension_ * (size_t)ep);
+  }
+  // Distances of the gathered ids to query, also recorded in ctx.pool.
+  auto score = [&]() {
+    dists.resize(ids.size());
+    distance_->compare_rows_batch(query, q, vecs.data(), ids.data(),
+                                  (unsigned)ids.size(), (unsigned)dimension_,
+                                  dists.data());
+    for (unsigned m = 0; m < ids.size(); m++) {
+      ctx.pool.push_back(Neighbor(ids[m], dists[m], true));
     }
+  };
+  score();
+  for (unsigned m = 0; m < ids.size(); m++) {
+    retset.PushUnsorted(ids[m], dists[m]);
   }
-  for (size_t i = 0; i < nd_; ++i) {
-    if (final_graph_[i].size() > width) {
-      width = final_graph_[i].size();
+  retset.Sort();
+  unsigned n;
+  while (retset.PopUnexpanded(n)) {
+    ids.clear();
+    vecs.clear();
+    for (unsigned id : final_graph_[n]) {
+      if (visited.Get(id)) continue;
+      visited.Set(id);
+      ids.push_back(id);
+      vecs.push_back(data_ + dimension_ * (size_t)id);
     }
+    score();
+    for (unsigned m = 0; m < ids.size(); m++) retset.Insert(ids[m], dists[m]);
+  }
+}
+
+unsigned IndexSSG::NearestReachable(unsigned q, unsigned L,
+                                    CandidatePool &retset,
+                                    BuildContext &ctx) const {
+  // Every node the search meets is reachable from eps_.
+  SearchFromEntryPoints(q, L, retset, ctx);
+  for (unsigned i = 0; i < retset.size(); i++) {
+    unsigned id = retset.id(i);
+    if (final_graph_.degree(id) < final_graph_.capacity(id)) return id;
   }
+  return retset.id(0);
 }
 
-void IndexSSG::DFS_expand(const Parameters &parameter) {
+void IndexSSG::RepairConnectivity(const Parameters &parameter) {
   unsigned n_try = parameter.Get<unsigned>("n_try");
-  unsigned range = parameter.Get<unsigned>("R");
+  unsigned L = parameter.Get<unsigned>("L");
 
   std::vector<unsigned> ids(nd_);
   for(unsigned i=0; i<nd_; i++){
     ids[i]=i;
   }
   std::random_shuffle(ids.begin(), ids.end());
-  for(unsigned i=0; i<n_try; i++){
-    eps_.push_back(ids[i]);
-    //std::cout << eps_[i] << '\n';
+  eps_.assign(ids.begin(), ids.begin() + std::min<size_t>(n_try, nd_));
+  LinkUnreachable(L);
+}
+
+void IndexSSG::LinkUnreachable(unsigned L) {
+  // Breadth-first from all entry points at once. Each node left over, in
+  // id order, then roots a component: a traversal from it marks only the
+  // nodes it newly reaches. The root is linked from its nearest node
+  // reachable from eps_ (one with a free slot if the search finds any).
+  // The searches run in parallel, before any link is added, so they only
+  // meet nodes reachable from eps_; the links are added in root order.
+  std::vector<uint8_t> reached(nd_, 0);
+  std::vector<unsigned> frontier;
+  for (unsigned ep : eps_) {
+    if (!reached[ep]) frontier.push_back(ep);
+    reached[ep] = 1;
+  }
+  MarkReachable(frontier, reached);
+
+  std::vector<unsigned> roots;
+  for (unsigned u = 0; u < nd_; u++) {
+    if (reached[u]) continue;
+    roots.push_back(u);
+    reached[u] = 1;
+    frontier.assign(1, u);
+    MarkReachable(frontier, reached);
   }
-#pragma omp parallel for
-  for(unsigned i=0; i<n_try; i++){
-    unsigned rootid = eps_[i];
-    boost::dynamic_bitset<> flags{nd_, 0};
-    std::queue<unsigned> myqueue;
-    myqueue.push(rootid);
-    flags[rootid]=true;
-
-    std::vector<unsigned> uncheck_set(1);
-
-    while(uncheck_set.size() >0){
-      while(!myqueue.empty()){
-        unsigned q_front=myqueue.front();
-        myqueue.pop();
-
-        for(unsigned j=0; j<final_graph_[q_front].size(); j++){
-          unsigned child = final_graph_[q_front][j];
-          if(flags[child])continue;
-          flags[child] = true;
-          myqueue.push(child);
-        }
-      }
 
-      uncheck_set.clear();
-      for(unsigned j=0; j<nd_; j++){
-        if(flags[j])continue;
-        uncheck_set.push_back(j);
-      }
-      //std::cout <<i<<":"<< uncheck_set.size() << '\n';
-      if(uncheck_set.size()>0){
-        for(unsigned j=0; j<nd_; j++){
-          if(flags[j] && final_graph_[j].size()<range){
-            final_graph_[j].push_back(uncheck_set[0]);
-            break;
-          }
-        }
-        myqueue.push(uncheck_set[0]);
-        flags[uncheck_set[0]]=true;
-      }
+  std::vector<unsigned> from(roots.size());
+  const int64_t num_roots = (int64_t)roots.size();
+#pragma omp parallel if (num_roots > 1)
+  {
+    CandidatePool retset;
+    BuildContext ctx(2 * (size_t)L);
+#pragma omp for schedule(dynamic, 1)
+    for (int64_t r = 0; r < num_roots; r++) {
+      from[r] = NearestReachable(roots[r], L, retset, ctx);
+    }
+  }
+  std::vector<std::pair<unsigned, unsigned>> full_rows;
+  for (size_t r = 0; r < roots.size(); r++) {
+    if (!final_graph_.Append(from[r], roots[r])) {
+      full_rows.push_back(std::make_pair(from[r], roots[r]));
     }
   }
+  final_graph_.AddEdges(full_rows);
+  width = std::max(width, final_graph_.max_degree());
+  std::cerr << "Linked " << roots.size() << " unreachable components"
+            << std::endl;
 }
 
 #ifdef ADA_NNS 
 void IndexSSG::GenerateHashFunction (char* file_name) {
-  DistanceFastL2* dist_fast = (DistanceFastL2*) distance_;
+  const DistanceFastL2* dist_fast = &dist_fast_;
   std::normal_distribution<float> norm_dist (0.0, 1.0);
   std::mt19937 gen(rand());
   uint64_t hash_len = (hash_bitwidth_ >> 3);
   hash_function_ = (float*)(opt_graph_ + node_size * nd_ + hash_len * nd_);
-  float hash_function_norm[hash_bitwidth_ - 1];
+  std::vector<float> hash_function_norm(hash_bitwidth_);
 
   std::cerr << "GenerateHashFunction" << std::endl;
   auto s = std::chrono::high_resolution_clock::now();
@@ -877,39 +2146,27 @@ void IndexSSG::GenerateHashFunction (char* file_name) {
   file_hash_function.write((char*)&hash_bitwidth_, sizeof(unsigned int));
   file_hash_function.write((char*)hash_function_, dimension_ * hash_bitwidth_ * sizeof(float));
   file_hash_function.close();
+  ReplicateHashes();
 }
 void IndexSSG::GenerateHashedSet (char* file_name) {
-  DistanceFastL2* dist_fast = (DistanceFastL2*) distance_;
   uint64_t hash_len = (hash_bitwidth_ >> 3);
 
   std::cerr << "GenerateHashedSet" << std::endl;
   auto s = std::chrono::high_resolution_clock::now();
-#pragma omp parallel for schedule(dynamic, 1)
-  for (unsigned int i = 0; i < nd_; i++) {
-    hashed_set_ = (unsigned int*)(opt_graph_ + node_size * nd_ + hash_len * i);
-    float* vertex = (float *)(opt_graph_ + node_size * i + sizeof(float));
-    for (unsigned int num_integer = 0; num_integer < (hash_bitwidth_ >> 5); num_integer++) {
-      std::bitset<32> temp_bool;
-      for (unsigned int bit_count = 0; bit_count < 32; bit_count++) {
-        temp_bool.set(bit_count, (dist_fast->DistanceInnerProduct::compare(vertex, &hash_function_[dimension_ * (32 * num_integer + bit_count)], (unsigned)dimension_)) > 0);
-      }
-      for (unsigned bit_count = 0; bit_count < 32; bit_count++) {
-        hashed_set_[num_integer] = (unsigned)(temp_bool.to_ulong());
-      }
-    }
-  }
+  hashed_set_ = (unsigned int*)(opt_graph_ + node_size * nd_); 
+  HashNodes(0, nd_);
   auto e = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> diff = e - s;
 //    std::cout << "HashedSet generation time: " << diff.count() * 1000 << std::endl;;
 
   std::ofstream file_hashed_set(file_name, std::ios::binary | std::ios::out);
-  hashed_set_ = (unsigned int*)(opt_graph_ + node_size * nd_); 
   for (unsigned int i = 0; i < nd_; i++) {
     for (unsigned int j = 0; j < (hash_len >> 2); j++) { 
       file_hashed_set.write((char*)(hashed_set_ + (hash_len >> 2) * i + j), 4);
     }
   }
   file_hashed_set.close();
+  ReplicateHashes();
 }
 bool IndexSSG::ReadHashFunction (char* file_name) {
   std::ifstream file_hash_function(file_name, std::ios::binary);
@@ -926,6 +2183,7 @@ bool IndexSSG::ReadHashFunction (char* file_name) {
     hash_function_ = (float*)(opt_graph_ + node_size * nd_ + hash_len * nd_);
     file_hash_function.read((char*)hash_function_, dimension_ * hash_bitwidth_ * sizeof(float));
     file_hash_function.close();
+    ReplicateHashes();
     return true;
   }
   else {
@@ -944,7 +2202,7 @@ bool IndexSSG::ReadHashedSet (char* file_name) {
       }
     }
     file_hashed_set.close();
-    
+    ReplicateHashes();
     return true;
   }
   else {
@@ -952,8 +2210,47 @@ bool IndexSSG::ReadHashedSet (char* file_name) {
   }
 }
 
+void IndexSSG::HashNodes(size_t begin, size_t end) {
+  const DistanceFastL2* dist_fast = &dist_fast_;
+  uint64_t hash_len = (hash_bitwidth_ >> 3);
+  const int64_t first = (int64_t)begin, last = (int64_t)end;
+#pragma omp parallel
+  {
+    // Encoded nodes are hashed by their decoded vectors.
+    std::vector<float> decoded(EncodedVectors() ? dimension_ : 0);
+#pragma omp for schedule(dynamic, 1)
+  for (int64_t i = first; i < last; i++) {
+    unsigned int* hashed = (unsigned int*)(opt_graph_ + node_size * nd_ + hash_len * i);
+    float* vertex = (float *)(opt_graph_ + node_size * i + sizeof(float));
+    if (EncodedVectors()) {
+      DecodeRow((const char *)vertex, decoded.data());
+      vertex = decoded.data();
+    }
+    for (unsigned int num_integer = 0; num_integer < (hash_bitwidth_ >> 5); num_integer++) {
+      std::bitset<32> temp_bool;
+      for (unsigned int bit_count = 0; bit_count < 32; bit_count++) {
+        temp_bool.set(bit_count, (dist_fast->DistanceInnerProduct::compare(vertex, &hash_function_[dimension_ * (32 * num_integer + bit_count)], (unsigned)dimension_)) > 0);
+      }
+      hashed[num_integer] = (unsigned)(temp_bool.to_ulong());
+    }
+  }
+  }
+}
+
+void IndexSSG::CheckHashes() const {
+  if (!HasHashes()) {
+    throw std::logic_error(
+        "IndexSSG: ADA-NNS search needs the hash function and hashed set");
+  }
+}
+
+void IndexSSG::ReplicateHashes() {
+  size_t nodes_bytes = node_size * nd_;
+  opt_memory_.Replicate(nodes_bytes, OptGraphBytes() - nodes_bytes);
+}
+
 void IndexSSG::QueryHash (const float* query, unsigned* hashed_query, unsigned hash_size) {
-  DistanceFastL2 *dist_fast = (DistanceFastL2 *)distance_;
+  const DistanceFastL2 *dist_fast = &dist_fast_;
   for (unsigned int num_integer = 0; num_integer < hash_size; num_integer++) {
     std::bitset<32> temp_bool;
     for (unsigned int bit_count = 0; bit_count < 32; bit_count++) {
@@ -965,12 +2262,13 @@ void IndexSSG::QueryHash (const float* query, unsigned* hashed_query, unsigned h
   }
 }
 
-unsigned int IndexSSG::CandidateSelection (const __m256i* hashed_query_avx, std::vector<HashNeighbor>& selected_pool, boost::dynamic_bitset<>& flags, const unsigned* neighbors, const unsigned MaxM, const unsigned hash_size) {
+template <typename Visited>
+unsigned int IndexSSG::CandidateSelection (const unsigned* hashed_query, const unsigned* hashed_set, std::vector<HashNeighbor>& selected_pool, const Visited& flags, const unsigned* neighbors, const unsigned MaxM, const unsigned hash_size) {
   unsigned int new_MaxM = 0;
   unsigned int selected_pool_size_limit = (unsigned int)ceil(MaxM * tau_);
   for (unsigned m = 0; m < MaxM; ++m) {
     unsigned int id = neighbors[m];
-    if (flags[id]) continue;
+    if (flags.Get(id)) continue;
     HashNeighbor cat_hamming_id (id, 0);
     selected_pool[new_MaxM] = cat_hamming_id;
     new_MaxM++;
@@ -983,10 +2281,11 @@ unsigned int IndexSSG::CandidateSelection (const __m256i* hashed_query_avx, std:
   for (; prefetch_counter < new_MaxM; prefetch_counter++) {
     unsigned int id = selected_pool[prefetch_counter].id;
     for (unsigned n = 0; n < hash_size; n += 8)
-      _mm_prefetch(hashed_set_ + hash_size * id + n, _MM_HINT_T0);
+      _mm_prefetch(hashed_set + hash_size * id + n, _MM_HINT_T0);
   }
 
-  uint64_t hamming_result[4];
+  unsigned (*hamming)(const unsigned *, const unsigned *, unsigned) =
+      GetDistanceKernels().hamming;
   unsigned int selected_pool_size = 0;
   HashNeighbor hamming_distance_max(0, 0);
   std::vector<HashNeighbor>::iterator index;
@@ -999,31 +2298,8 @@ unsigned int IndexSSG::CandidateSelection (const __m256i* hashed_query_avx, std:
 //      prefetch_counter++;
 //    }isited
     unsigned int id = selected_pool[m].id;
-    unsigned int hamming_distance = 0;
-    unsigned int* hashed_set_address = hashed_set_ + hash_size * id;
-#ifdef __AVX__
-    for (unsigned int i = 0; i < (hash_size >> 3); i++) {
-      __m256i hashed_set_avx, hamming_result_avx;
-      hashed_set_avx = _mm256_loadu_si256((__m256i*)(hashed_set_address));
-      hamming_result_avx = _mm256_xor_si256(hashed_query_avx[i], hashed_set_avx);
-#ifdef __AVX512VPOPCNTDQ__
-      hamming_result_avx = _mm256_popcnt_epi64(hamming_result_avx);
-      _mm256_storeu_si256((__m256i*)&hamming_result, hamming_result_avx);
-      for (unsigned int j = 0; j < 4; j++)
-        hamming_distance += hamming_result[j];
-#else
-      _mm256_storeu_si256((__m256i*)&hamming_result, hamming_result_avx);
-      for (unsigned int j = 0; j < 4; j++)
-        hamming_distance += _popcnt64(hamming_result[j]);
-#endif
-      hashed_set_address += 8;
-    }
-#else
-    for (unsigned int num_integer = 0; num_integer < hash_bitwidth / 32; num_integer++) {
-      unsigned int hamming_result = hashed_query[num_integer] ^ hashed_set_address[num_integer]; 
-      hamming_distance += __builtin_popcount(hamming_result);
-    }
-#endif
+    unsigned int hamming_distance =
+        hamming(hashed_query, hashed_set + hash_size * id, hash_size);
     HashNeighbor cat_hamming_id(id, hamming_distance);
     if ((selected_pool_size_limit < selected_pool_size) && (hamming_distance < hamming_distance_max.distance) ) {
       selected_pool[selected_pool_size] = selected_pool[hamming_distance_max.id];
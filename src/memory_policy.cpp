@@ -0,0 +1,229 @@
+#include "memory_policy.h"
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+
+namespace efanna2e {
+
+// mbind(2) modes, from <linux/mempolicy.h>.
+static const int kMpolBind = 2;
+static const int kMpolInterleave = 3;
+static const size_t kHugePageSize = 2 << 20;
+// Bytes copied at a time by the threads of Replicate().
+static const size_t kReplicateChunk = 4 << 20;
+
+namespace {
+
+struct NumaTopology {
+  std::vector<int> nodes;
+  std::vector<int> cpu_node;                // CPU -> node
+  std::vector<std::vector<int>> node_cpus;  // node -> CPUs
+};
+
+// Parses a sysfs list such as "0-3,8-11".
+std::vector<int> ParseList(const std::string &text) {
+  std::vector<int> ids;
+  std::stringstream ss(text);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty()) continue;
+    size_t dash = range.find('-');
+    int first = std::atoi(range.c_str());
+    int last = dash == std::string::npos ? first
+                                         : std::atoi(range.c_str() + dash + 1);
+    for (int id = first; id <= last; id++) ids.push_back(id);
+  }
+  return ids;
+}
+
+std::string ReadFile(const std::string &path) {
+  std::ifstream in(path);
+  std::string text;
+  std::getline(in, text);
+  return text;
+}
+
+NumaTopology ReadTopology() {
+  NumaTopology topology;
+  const std::string root = "/sys/devices/system/node/";
+  topology.nodes = ParseList(ReadFile(root + "online"));
+  if (topology.nodes.empty()) topology.nodes.push_back(0);
+  topology.node_cpus.resize(topology.nodes.back() + 1);
+  for (int node : topology.nodes) {
+    std::vector<int> cpus = ParseList(
+        ReadFile(root + "node" + std::to_string(node) + "/cpulist"));
+    for (int cpu : cpus) {
+      if (cpu >= (int)topology.cpu_node.size()) {
+        topology.cpu_node.resize(cpu + 1, topology.nodes[0]);
+      }
+      topology.cpu_node[cpu] = node;
+    }
+    topology.node_cpus[node] = cpus;
+  }
+  return topology;
+}
+
+const NumaTopology &Topology() {
+  static const NumaTopology topology = ReadTopology();
+  return topology;
+}
+
+// Applies an mbind(2) policy over nodes to [addr, addr + size).
+bool Mbind(void *addr, size_t size, int mode, const std::vector<int> &nodes) {
+#ifdef SYS_mbind
+  const size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(nodes.back() / bits + 1, 0);
+  for (int node : nodes) mask[node / bits] |= 1UL << (node % bits);
+  // The kernel reads maxnode - 1 bits.
+  return syscall(SYS_mbind, addr, size, mode, mask.data(),
+                 mask.size() * bits + 1, 0) == 0;
+#else
+  (void)addr, (void)size, (void)mode, (void)nodes;
+  return false;
+#endif
+}
+
+// Anonymous mapping of size bytes at a multiple of align. Returns nullptr
+// on failure.
+char *MapAligned(size_t size, size_t align) {
+  size_t mapped = size + align;
+  void *base = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) return nullptr;
+  char *begin = (char *)base;
+  char *addr = (char *)(((size_t)begin + align - 1) & ~(align - 1));
+  if (addr > begin) munmap(begin, addr - begin);
+  char *end = begin + mapped;
+  if (end > addr + size) munmap(addr + size, end - (addr + size));
+  return addr;
+}
+
+}  // namespace
+
+const std::vector<int> &NumaNodes() { return Topology().nodes; }
+
+int CurrentNumaNode() {
+  const NumaTopology &topology = Topology();
+  int cpu = sched_getcpu();
+  if (cpu < 0 || cpu >= (int)topology.cpu_node.size()) {
+    return topology.nodes[0];
+  }
+  return topology.cpu_node[cpu];
+}
+
+bool BindThreadToNumaNode(int node) {
+  const NumaTopology &topology = Topology();
+  if (node < 0 || node >= (int)topology.node_cpus.size() ||
+      topology.node_cpus[node].empty()) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : topology.node_cpus[node]) {
+    if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+  }
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+ScopedNumaBinding::ScopedNumaBinding(int node) {
+  bound_ = sched_getaffinity(0, sizeof(saved_), &saved_) == 0 &&
+           BindThreadToNumaNode(node);
+}
+
+ScopedNumaBinding::~ScopedNumaBinding() {
+  if (bound_) sched_setaffinity(0, sizeof(saved_), &saved_);
+}
+
+char *PlacedMemory::Allocate(size_t size, MemoryPolicy policy) {
+  Free();
+  size_ = size;
+  const std::vector<int> &nodes = NumaNodes();
+  const size_t huge_size = (size + kHugePageSize - 1) & ~(kHugePageSize - 1);
+  size_t copies = 1;
+  if (policy == MEMORY_REPLICATE) copies = nodes.size();
+  for (size_t c = 0; c < copies; c++) {
+    Block block = {nullptr, 0};
+    if (policy == MEMORY_HUGETLB) {
+      void *addr = mmap(NULL, huge_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE |
+                            MAP_HUGETLB,
+                        -1, 0);
+      if (addr != MAP_FAILED) block = {(char *)addr, huge_size};
+      // Otherwise the hugetlbfs pool is too small: fall back to THP.
+    }
+    if (block.addr == nullptr && policy != MEMORY_DEFAULT) {
+      block.addr = MapAligned(huge_size, kHugePageSize);
+      block.mapped = huge_size;
+      if (block.addr == nullptr) {
+        Free();
+        throw std::bad_alloc();
+      }
+      // The placement must be set before the pages are first touched.
+      if (policy == MEMORY_INTERLEAVE && nodes.size() > 1) {
+        Mbind(block.addr, huge_size, kMpolInterleave, nodes);
+      } else if (policy == MEMORY_REPLICATE && nodes.size() > 1) {
+        Mbind(block.addr, huge_size, kMpolBind,
+              std::vector<int>(1, nodes[c]));
+      }
+#ifdef MADV_HUGEPAGE
+      madvise(block.addr, huge_size, MADV_HUGEPAGE);
+#endif
+    }
+    if (block.addr == nullptr) {
+      block.addr = (char *)malloc(size);
+      if (block.addr == nullptr && size != 0) throw std::bad_alloc();
+    }
+    blocks_.push_back(block);
+  }
+  node_block_.assign(nodes.back() + 1, 0);
+  if (copies > 1) {
+    for (size_t c = 0; c < copies; c++) node_block_[nodes[c]] = (int)c;
+  }
+  return blocks_[0].addr;
+}
+
+void PlacedMemory::Free() {
+  for (Block &block : blocks_) {
+    if (block.mapped) {
+      munmap(block.addr, block.mapped);
+    } else {
+      free(block.addr);
+    }
+  }
+  blocks_.clear();
+  node_block_.clear();
+  size_ = 0;
+}
+
+void PlacedMemory::Replicate(size_t offset, size_t size) {
+  if (blocks_.size() < 2 || size == 0) return;
+  const char *src = blocks_[0].addr + offset;
+  const size_t num_chunks = (size + kReplicateChunk - 1) / kReplicateChunk;
+  for (size_t c = 1; c < blocks_.size(); c++) {
+    char *dst = blocks_[c].addr + offset;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < num_chunks; i++) {
+      size_t begin = i * kReplicateChunk;
+      std::memcpy(dst + begin, src + begin,
+                  std::min(kReplicateChunk, size - begin));
+    }
+  }
+}
+
+char *PlacedMemory::local() const {
+  if (blocks_.size() < 2) return data();
+  int node = CurrentNumaNode();
+  if (node < 0 || node >= (int)node_block_.size()) return data();
+  return blocks_[node_block_[node]].addr;
+}
+
+}  // namespace efanna2e
@@ -0,0 +1,237 @@
+#include "pca.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <random>
+
+#include "distance_kernels.h"
+
+namespace efanna2e {
+
+// Householder reduction of the symmetric matrix v (n x n, row-major) to
+// tridiagonal form: on return d holds the diagonal, e the subdiagonal in
+// e[1..n-1] and v the accumulated orthogonal transformation. Follows the
+// EISPACK tred2 routine.
+static void Tridiagonalize(std::vector<double> &v, std::vector<double> &d,
+                           std::vector<double> &e, int n) {
+#define V(r, c) v[(size_t)(r) * n + (c)]
+  for (int j = 0; j < n; j++) d[j] = V(n - 1, j);
+
+  for (int i = n - 1; i > 0; i--) {
+    double scale = 0.0, h = 0.0;
+    for (int k = 0; k < i; k++) scale += std::fabs(d[k]);
+    if (scale == 0.0) {
+      e[i] = d[i - 1];
+      for (int j = 0; j < i; j++) {
+        d[j] = V(i - 1, j);
+        V(i, j) = 0.0;
+        V(j, i) = 0.0;
+      }
+    } else {
+      for (int k = 0; k < i; k++) {
+        d[k] /= scale;
+        h += d[k] * d[k];
+      }
+      double f = d[i - 1];
+      double g = std::sqrt(h);
+      if (f > 0) g = -g;
+      e[i] = scale * g;
+      h = h - f * g;
+      d[i - 1] = f - g;
+      for (int j = 0; j < i; j++) e[j] = 0.0;
+
+      for (int j = 0; j < i; j++) {
+        f = d[j];
+        V(j, i) = f;
+        g = e[j] + V(j, j) * f;
+        for (int k = j + 1; k <= i - 1; k++) {
+          g += V(k, j) * d[k];
+          e[k] += V(k, j) * f;
+        }
+        e[j] = g;
+      }
+      f = 0.0;
+      for (int j = 0; j < i; j++) {
+        e[j] /= h;
+        f += e[j] * d[j];
+      }
+      double hh = f / (h + h);
+      for (int j = 0; j < i; j++) e[j] -= hh * d[j];
+      for (int j = 0; j < i; j++) {
+        f = d[j];
+        g = e[j];
+        for (int k = j; k <= i - 1; k++) V(k, j) -= (f * e[k] + g * d[k]);
+        d[j] = V(i - 1, j);
+        V(i, j) = 0.0;
+      }
+    }
+    d[i] = h;
+  }
+
+  for (int i = 0; i < n - 1; i++) {
+    V(n - 1, i) = V(i, i);
+    V(i, i) = 1.0;
+    double h = d[i + 1];
+    if (h != 0.0) {
+      for (int k = 0; k <= i; k++) d[k] = V(k, i + 1) / h;
+      for (int j = 0; j <= i; j++) {
+        double g = 0.0;
+        for (int k = 0; k <= i; k++) g += V(k, i + 1) * V(k, j);
+        for (int k = 0; k <= i; k++) V(k, j) -= g * d[k];
+      }
+    }
+    for (int k = 0; k <= i; k++) V(k, i + 1) = 0.0;
+  }
+  for (int j = 0; j < n; j++) {
+    d[j] = V(n - 1, j);
+    V(n - 1, j) = 0.0;
+  }
+  V(n - 1, n - 1) = 1.0;
+  e[0] = 0.0;
+#undef V
+}
+
+// Implicit QL iterations on the tridiagonal matrix (d, e). w holds the
+// transposed transformation from Tridiagonalize(), so the rotations update
+// contiguous rows; on return row i of w is the eigenvector of eigenvalue d[i].
+// Follows the EISPACK tql2 routine.
+static void TridiagonalQL(std::vector<double> &w, std::vector<double> &d,
+                          std::vector<double> &e, int n) {
+  for (int i = 1; i < n; i++) e[i - 1] = e[i];
+  e[n - 1] = 0.0;
+
+  double f = 0.0, tst1 = 0.0;
+  const double eps = std::pow(2.0, -52.0);
+  for (int l = 0; l < n; l++) {
+    tst1 = std::max(tst1, std::fabs(d[l]) + std::fabs(e[l]));
+    int m = l;
+    while (m < n - 1 && std::fabs(e[m]) > eps * tst1) m++;
+
+    if (m > l) {
+      do {
+        double g = d[l];
+        double p = (d[l + 1] - g) / (2.0 * e[l]);
+        double r = std::hypot(p, 1.0);
+        if (p < 0) r = -r;
+        d[l] = e[l] / (p + r);
+        d[l + 1] = e[l] * (p + r);
+        double dl1 = d[l + 1];
+        double h = g - d[l];
+        for (int i = l + 2; i < n; i++) d[i] -= h;
+        f += h;
+
+        p = d[m];
+        double c = 1.0, c2 = c, c3 = c;
+        double el1 = e[l + 1];
+        double s = 0.0, s2 = 0.0;
+        for (int i = m - 1; i >= l; i--) {
+          c3 = c2;
+          c2 = c;
+          s2 = s;
+          g = c * e[i];
+          h = c * p;
+          r = std::hypot(p, e[i]);
+          e[i + 1] = s * r;
+          s = e[i] / r;
+          c = p / r;
+          p = c * d[i] - s * g;
+          d[i + 1] = h + s * (c * g + s * d[i]);
+          double *wi = &w[(size_t)i * n], *wi1 = &w[(size_t)(i + 1) * n];
+          for (int k = 0; k < n; k++) {
+            h = wi1[k];
+            wi1[k] = s * wi[k] + c * h;
+            wi[k] = c * wi[k] - s * h;
+          }
+        }
+        p = -s * s2 * c3 * el1 * e[l] / dl1;
+        e[l] = s * p;
+        d[l] = c * p;
+      } while (std::fabs(e[l]) > eps * tst1);
+    }
+    d[l] = d[l] + f;
+    e[l] = 0.0;
+  }
+}
+
+void PCARotation::Train(const float *data, size_t n, unsigned dim,
+                        size_t max_samples) {
+  // Sample rows without replacement, then center them.
+  std::vector<size_t> rows(n);
+  std::iota(rows.begin(), rows.end(), 0);
+  size_t ns = std::min(n, max_samples);
+  if (ns < n) {
+    std::mt19937 rng(1234);
+    std::shuffle(rows.begin(), rows.end(), rng);
+    rows.resize(ns);
+  }
+  std::vector<double> mean(dim, 0.0);
+  for (size_t s = 0; s < ns; s++) {
+    const float *x = data + rows[s] * dim;
+    for (unsigned j = 0; j < dim; j++) mean[j] += x[j];
+  }
+  for (unsigned j = 0; j < dim; j++) mean[j] /= ns;
+  // Column-major copy, so each covariance entry is one contiguous dot product.
+  std::vector<float> cols((size_t)dim * ns);
+  for (size_t s = 0; s < ns; s++) {
+    const float *x = data + rows[s] * dim;
+    for (unsigned j = 0; j < dim; j++) {
+      cols[(size_t)j * ns + s] = (float)(x[j] - mean[j]);
+    }
+  }
+
+  const DistanceKernels &kernels = GetDistanceKernels();
+  int n_dim = (int)dim;
+  std::vector<double> v((size_t)dim * dim);
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int i = 0; i < n_dim; i++) {
+    for (int j = 0; j <= i; j++) {
+      double c = kernels.inner_product(&cols[(size_t)i * ns],
+                                       &cols[(size_t)j * ns], (unsigned)ns) /
+                 (double)ns;
+      v[(size_t)i * dim + j] = c;
+      v[(size_t)j * dim + i] = c;
+    }
+  }
+
+  std::vector<double> d(dim), e(dim);
+  Tridiagonalize(v, d, e, n_dim);
+  std::vector<double> w((size_t)dim * dim);
+  for (unsigned i = 0; i < dim; i++) {
+    for (unsigned j = 0; j < dim; j++) w[(size_t)j * dim + i] = v[(size_t)i * dim + j];
+  }
+  TridiagonalQL(w, d, e, n_dim);
+
+  std::vector<unsigned> order(dim);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&d](unsigned a, unsigned b) { return d[a] > d[b]; });
+  rotation_.resize((size_t)dim * dim);
+  for (unsigned i = 0; i < dim; i++) {
+    const double *axis = &w[(size_t)order[i] * dim];
+    for (unsigned j = 0; j < dim; j++) {
+      rotation_[(size_t)i * dim + j] = (float)axis[j];
+    }
+  }
+  dim_ = dim;
+}
+
+void PCARotation::Apply(const float *in, float *out) const {
+  const DistanceKernels &kernels = GetDistanceKernels(dim_);
+  for (unsigned i = 0; i < dim_; i++) {
+    out[i] = kernels.inner_product(&rotation_[(size_t)i * dim_], in, dim_);
+  }
+}
+
+void PCARotation::Save(std::ostream &out) const {
+  out.write((const char *)&dim_, sizeof(dim_));
+  out.write((const char *)rotation_.data(), rotation_.size() * sizeof(float));
+}
+
+void PCARotation::Load(std::istream &in) {
+  in.read((char *)&dim_, sizeof(dim_));
+  rotation_.resize((size_t)dim_ * dim_);
+  in.read((char *)rotation_.data(), rotation_.size() * sizeof(float));
+}
+
+}  // namespace efanna2e
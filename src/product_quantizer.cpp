@@ -0,0 +1,142 @@
+#include "product_quantizer.h"
+
+#include <algorithm>
+#include <limits>
+#include <random>
+
+#include "distance_kernels.h"
+
+namespace efanna2e {
+
+// Index of the centroid (k x d, row-major) nearest to x.
+static unsigned NearestCentroid(const DistanceKernels &kernels,
+                                const float *x, const float *centroids,
+                                unsigned k, unsigned d) {
+  unsigned best = 0;
+  float best_dist = std::numeric_limits<float>::max();
+  for (unsigned c = 0; c < k; c++) {
+    float dist = kernels.l2(x, centroids + (size_t)c * d, d);
+    if (dist < best_dist) {
+      best_dist = dist;
+      best = c;
+    }
+  }
+  return best;
+}
+
+// Lloyd's k-means on the n x d rows of x, seeded with k random rows. An
+// empty cluster is reseeded with a random row.
+static void KMeans(const DistanceKernels &kernels, const float *x, size_t n,
+                   unsigned d, unsigned k, unsigned iterations,
+                   std::mt19937 &rng, float *centroids) {
+  std::uniform_int_distribution<size_t> pick(0, n - 1);
+  std::vector<size_t> seeds(n);
+  for (size_t i = 0; i < n; i++) seeds[i] = i;
+  std::shuffle(seeds.begin(), seeds.end(), rng);
+  for (unsigned c = 0; c < k; c++) {
+    const float *row = x + seeds[c % n] * d;
+    std::copy(row, row + d, centroids + (size_t)c * d);
+  }
+
+  std::vector<unsigned> assign(n);
+  std::vector<double> sums((size_t)k * d);
+  std::vector<size_t> counts(k);
+  for (unsigned it = 0; it < iterations; it++) {
+    for (size_t i = 0; i < n; i++) {
+      assign[i] = NearestCentroid(kernels, x + i * d, centroids, k, d);
+    }
+    std::fill(sums.begin(), sums.end(), 0.0);
+    std::fill(counts.begin(), counts.end(), 0);
+    for (size_t i = 0; i < n; i++) {
+      double *sum = &sums[(size_t)assign[i] * d];
+      const float *row = x + i * d;
+      for (unsigned j = 0; j < d; j++) sum[j] += row[j];
+      counts[assign[i]]++;
+    }
+    for (unsigned c = 0; c < k; c++) {
+      float *centroid = centroids + (size_t)c * d;
+      if (counts[c] == 0) {
+        const float *row = x + pick(rng) * d;
+        std::copy(row, row + d, centroid);
+        continue;
+      }
+      for (unsigned j = 0; j < d; j++) {
+        centroid[j] = (float)(sums[(size_t)c * d + j] / counts[c]);
+      }
+    }
+  }
+}
+
+void ProductQuantizer::Train(const float *data, size_t n, unsigned dim,
+                             unsigned num_subspaces, unsigned iterations) {
+  dim_ = dim;
+  num_subspaces_ = std::max(1u, std::min(num_subspaces, dim));
+  offsets_.resize(num_subspaces_ + 1);
+  for (unsigned m = 0; m <= num_subspaces_; m++) {
+    offsets_[m] = (unsigned)((size_t)m * dim / num_subspaces_);
+  }
+  centroids_.assign((size_t)dim * kNumCentroids, 0.0f);
+
+  const DistanceKernels &kernels = GetDistanceKernels();
+  int num_groups = (int)num_subspaces_;
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int m = 0; m < num_groups; m++) {
+    const unsigned begin = offsets_[m], d = offsets_[m + 1] - begin;
+    std::vector<float> sub(n * d);
+    for (size_t i = 0; i < n; i++) {
+      std::copy(data + i * dim + begin, data + i * dim + begin + d,
+                &sub[i * d]);
+    }
+    std::mt19937 rng(1234 + m);
+    KMeans(kernels, sub.data(), n, d, kNumCentroids, iterations, rng,
+           &centroids_[(size_t)begin * kNumCentroids]);
+  }
+}
+
+void ProductQuantizer::Encode(const float *x, uint8_t *code) const {
+  const DistanceKernels &kernels = GetDistanceKernels();
+  std::fill(code, code + code_size(), 0);
+  for (unsigned m = 0; m < num_subspaces_; m++) {
+    const unsigned d = offsets_[m + 1] - offsets_[m];
+    code[m] = (uint8_t)NearestCentroid(kernels, x + offsets_[m],
+                                       centroid(m, 0), kNumCentroids, d);
+  }
+}
+
+void ProductQuantizer::Decode(const uint8_t *code, float *x) const {
+  for (unsigned m = 0; m < num_subspaces_; m++) {
+    const float *c = centroid(m, code[m]);
+    std::copy(c, c + (offsets_[m + 1] - offsets_[m]), x + offsets_[m]);
+  }
+}
+
+void ProductQuantizer::ComputeTable(const float *query, float *table) const {
+  const DistanceKernels &kernels = GetDistanceKernels();
+  for (unsigned m = 0; m < num_subspaces_; m++) {
+    const unsigned d = offsets_[m + 1] - offsets_[m];
+    const float *q = query + offsets_[m];
+    float *row = table + (size_t)m * kNumCentroids;
+    for (unsigned c = 0; c < kNumCentroids; c++) {
+      row[c] = kernels.l2(q, centroid(m, c), d);
+    }
+  }
+}
+
+void ProductQuantizer::Save(std::ostream &out) const {
+  out.write((const char *)&dim_, sizeof(dim_));
+  out.write((const char *)&num_subspaces_, sizeof(num_subspaces_));
+  out.write((const char *)offsets_.data(), offsets_.size() * sizeof(unsigned));
+  out.write((const char *)centroids_.data(),
+            centroids_.size() * sizeof(float));
+}
+
+void ProductQuantizer::Load(std::istream &in) {
+  in.read((char *)&dim_, sizeof(dim_));
+  in.read((char *)&num_subspaces_, sizeof(num_subspaces_));
+  offsets_.resize(num_subspaces_ + 1);
+  in.read((char *)offsets_.data(), offsets_.size() * sizeof(unsigned));
+  centroids_.resize((size_t)dim_ * kNumCentroids);
+  in.read((char *)centroids_.data(), centroids_.size() * sizeof(float));
+}
+
+}  // namespace efanna2e
@@ -16,6 +16,8 @@ using efanna2e::Parameters;
 using efanna2e::Index;
 using efanna2e::IndexRandom;
 using efanna2e::IndexSSG;
+using efanna2e::VectorEncoding;
+using efanna2e::MemoryPolicy;
 
 using array = py::array_t<float, py::array::c_style | py::array::forcecast>;
 
@@ -32,7 +34,22 @@ PYBIND11_MODULE(pyssg, m) {
         .value("L2", Metric::L2)
         .value("INNER_PRODUCT", Metric::INNER_PRODUCT)
         .value("FAST_L2", Metric::FAST_L2)
-        .value("PQ", Metric::PQ);
+        .value("PQ", Metric::PQ)
+        .value("COSINE", Metric::COSINE);
+
+    py::enum_<VectorEncoding>(m, "VectorEncoding")
+        .value("FP32", VectorEncoding::FP32)
+        .value("FP16", VectorEncoding::FP16)
+        .value("SQ8", VectorEncoding::SQ8)
+        .value("U8", VectorEncoding::U8)
+        .value("I8", VectorEncoding::I8);
+
+    py::enum_<MemoryPolicy>(m, "MemoryPolicy")
+        .value("DEFAULT", MemoryPolicy::MEMORY_DEFAULT)
+        .value("THP", MemoryPolicy::MEMORY_THP)
+        .value("HUGETLB", MemoryPolicy::MEMORY_HUGETLB)
+        .value("INTERLEAVE", MemoryPolicy::MEMORY_INTERLEAVE)
+        .value("REPLICATE", MemoryPolicy::MEMORY_REPLICATE);
 
     // Parameters
     // py::class_<Parameters>(m, "Parameters")
@@ -73,6 +90,10 @@ PYBIND11_MODULE(pyssg, m) {
 
         // .def("build", &IndexSSG::Build)  # Currently only search
 
+        /* Node vector storage, set before load */
+        .def("set_vector_encoding", &IndexSSG::SetVectorEncoding)
+        .def("set_memory_policy", &IndexSSG::SetMemoryPolicy)
+
         /* Load SSG graph along with data */
         .def("load", [](IndexSSG& index,
                         std::string graph, array data) {
@@ -83,6 +104,12 @@ PYBIND11_MODULE(pyssg, m) {
         /* Save graph to file */
         .def("save", &IndexSSG::Save)
 
+        /* Save the optimized graph, and map it back without the data */
+        .def("save_optimized", &IndexSSG::SaveOptimized)
+        .def("load_optimized", [](IndexSSG& index, std::string path) {
+            index.LoadOptimized(path.c_str());
+        })
+
         /* Do KNN search
             @param query: an 1-D numpy array represents query
             @param k: number of neighbors to search for
@@ -112,5 +139,56 @@ PYBIND11_MODULE(pyssg, m) {
             index.SearchWithOptGraph(query.data(), k, params, indices.data());
 
             return indices;
-        });
+        })
+
+        /* Do KNN search for a batch of queries in parallel
+            @param queries: a 2-D numpy array, one query per row
+            @param k: number of neighbors to search for
+            @param l: L parameter for search algorithm
+
+            @return a (nq, k) numpy array of neighbors' indices
+         */
+        .def("search_batch", [](IndexSSG& index, array queries, size_t k, unsigned l)
+                                -> py::array_t<unsigned> {
+            if (queries.ndim() != 2) {
+                throw py::value_error("Queries should be 2-D array");
+            }
+            if (queries.shape()[1] != index.GetDimension()) {
+                throw py::value_error("Dimension mismatch");
+            }
+
+            Parameters params;
+            params.Set<unsigned>("L_search", l);
+
+            size_t nq = queries.shape()[0];
+            py::array_t<unsigned> indices({nq, k});
+            {
+                py::gil_scoped_release release;
+                index.SearchBatch(queries.data(), nq, k, params,
+                                  indices.mutable_data(), nullptr);
+            }
+            return indices;
+        })
+
+        /* Add vectors to the index, numbered from its current size
+            @param data: a (n, dim) numpy array of the new vectors
+            @param l, r, angle: build parameters L, R and A for their links
+         */
+        .def("insert", [](IndexSSG& index, array data, unsigned l, unsigned r,
+                          float angle) {
+            if (data.ndim() != 2) {
+                throw py::value_error("Data should be 2-D array");
+            }
+            if (data.shape()[1] != index.GetDimension()) {
+                throw py::value_error("Dimension mismatch");
+            }
+
+            Parameters params;
+            params.Set<unsigned>("L", l);
+            params.Set<unsigned>("R", r);
+            params.Set<float>("A", angle);
+
+            py::gil_scoped_release release;
+            index.Insert(data.data(), data.shape()[0], params);
+        }, py::arg("data"), py::arg("l"), py::arg("r"), py::arg("angle"));
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "quantizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "distance_kernels.h"
+
+namespace efanna2e {
+
+void ScalarQuantizer::Init(VectorEncoding encoding, unsigned dim) {
+  encoding_ = encoding;
+  dim_ = dim;
+  const bool bytes = byte_codes();
+  min_.assign(bytes ? dim : 0, encoding == I8 ? -128.0f : 0.0f);
+  scale_.assign(bytes ? dim : 0, encoding == SQ8 ? 0.0f : 1.0f);
+}
+
+size_t ScalarQuantizer::code_size() const {
+  switch (encoding_) {
+    case FP16: return ((size_t)dim_ * sizeof(uint16_t) + 3) & ~(size_t)3;
+    case FP32: return (size_t)dim_ * sizeof(float);
+    default: return ((size_t)dim_ + 3) & ~(size_t)3;
+  }
+}
+
+void ScalarQuantizer::SetRange(const float *min, const float *max) {
+  for (unsigned j = 0; j < dim_; j++) {
+    min_[j] = min[j];
+    scale_[j] = (max[j] - min[j]) / 255.0f;
+  }
+}
+
+void ScalarQuantizer::Encode(const float *x, char *code) const {
+  std::memset(code, 0, code_size());
+  switch (encoding_) {
+    case FP16: {
+      uint16_t *out = (uint16_t *)code;
+      for (unsigned j = 0; j < dim_; j++) out[j] = FloatToHalf(x[j]);
+      break;
+    }
+    case FP32: std::memcpy(code, x, dim_ * sizeof(float)); break;
+    default: {
+      uint8_t *out = (uint8_t *)code;
+      for (unsigned j = 0; j < dim_; j++) {
+        float c = scale_[j] > 0 ? std::round((x[j] - min_[j]) / scale_[j]) : 0;
+        out[j] = (uint8_t)std::min(std::max(c, 0.0f), 255.0f);
+      }
+      break;
+    }
+  }
+}
+
+size_t ScalarQuantizer::CountClamped(const float *x) const {
+  if (!byte_codes()) return 0;
+  size_t clamped = 0;
+  for (unsigned j = 0; j < dim_; j++) {
+    float c = scale_[j] > 0 ? std::round((x[j] - min_[j]) / scale_[j]) : 0;
+    clamped += c < 0 || c > 255;
+  }
+  return clamped;
+}
+
+void ScalarQuantizer::Decode(const char *code, float *x) const {
+  switch (encoding_) {
+    case FP16: {
+      const uint16_t *in = (const uint16_t *)code;
+      for (unsigned j = 0; j < dim_; j++) x[j] = HalfToFloat(in[j]);
+      break;
+    }
+    case FP32: std::memcpy(x, code, dim_ * sizeof(float)); break;
+    default: {
+      const uint8_t *in = (const uint8_t *)code;
+      for (unsigned j = 0; j < dim_; j++) x[j] = min_[j] + scale_[j] * in[j];
+      break;
+    }
+  }
+}
+
+float ScalarQuantizer::PrepareQuery(const float *query, float *scaled) const {
+  float offset = 0;
+  for (unsigned j = 0; j < dim_; j++) {
+    scaled[j] = query[j] * scale_[j];
+    offset += query[j] * min_[j];
+  }
+  return offset;
+}
+
+void ScalarQuantizer::Save(std::ostream &out) const {
+  unsigned encoding = encoding_;
+  out.write((const char *)&encoding, sizeof(encoding));
+  out.write((const char *)&dim_, sizeof(dim_));
+  out.write((const char *)min_.data(), min_.size() * sizeof(float));
+  out.write((const char *)scale_.data(), scale_.size() * sizeof(float));
+}
+
+void ScalarQuantizer::Load(std::istream &in) {
+  unsigned encoding = FP32, dim = 0;
+  in.read((char *)&encoding, sizeof(encoding));
+  in.read((char *)&dim, sizeof(dim));
+  Init((VectorEncoding)encoding, dim);
+  in.read((char *)min_.data(), min_.size() * sizeof(float));
+  in.read((char *)scale_.data(), scale_.size() * sizeof(float));
+}
+
+}  // namespace efanna2e
@@ -1,12 +1,13 @@
 #include "util.h"
 
-#include <malloc.h>
 #include <algorithm>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <iostream>
+#include <new>
 #include <random>
+#include <stdexcept>
+
+#include "vecs_file.h"
 
 namespace efanna2e {
 
@@ -26,78 +27,71 @@ void GenRandom(std::mt19937& rng, unsigned* addr, unsigned size, unsigned N) {
   }
 }
 
-float* load_data(const char* filename, unsigned& num, unsigned& dim) {
-  std::ifstream in(filename, std::ios::binary);
-  if (!in.is_open()) {
-    std::cerr << "Open file error" << std::endl;
-    exit(-1);
-  }
-
-  in.read((char*)&dim, 4);
+// Rows of load_data() and load_data_aligned() start on this boundary.
+static const size_t kLoadAlignment = 32;
 
-  in.seekg(0, std::ios::end);
-  std::ios::pos_type ss = in.tellg();
-  size_t fsize = (size_t)ss;
-  num = (unsigned)(fsize / (dim + 1) / 4);
+static void* aligned_alloc_or_throw(size_t bytes) {
+  void* data = nullptr;
+  if (posix_memalign(&data, kLoadAlignment, std::max(bytes, (size_t)1))) {
+    throw std::bad_alloc();
+  }
+  return data;
+}
 
-  float* data = new float[(size_t)num * (size_t)dim];
+float* load_data(const char* filename, unsigned& num, unsigned& dim) {
+  VecsFile file(filename);
+  num = (unsigned)file.num();
+  dim = file.dim();
+  float* data = (float*)aligned_alloc_or_throw(file.num() * dim * sizeof(float));
+  file.ReadFloatRows(0, file.num(), data, dim);
+  return data;
+}
 
-  in.seekg(0, std::ios::beg);
-  for (size_t i = 0; i < num; i++) {
-    in.seekg(4, std::ios::cur);
-    in.read((char*)(data + i * dim), dim * sizeof(float));
+float* load_data_aligned(const char* filename, unsigned& num, unsigned& dim,
+                         size_t begin, size_t count) {
+  VecsFile file(filename);
+  if (begin > file.num()) {
+    throw std::out_of_range(std::string("rows out of range of ") + filename);
   }
-  in.close();
-
+  count = std::min(count, file.num() - begin);
+  num = (unsigned)count;
+  dim = data_align_dim(file.dim());
+  float* data = (float*)aligned_alloc_or_throw(count * dim * sizeof(float));
+  file.ReadFloatRows(begin, count, data, dim);
   return data;
 }
 
+void load_data_info(const char* filename, unsigned& num, unsigned& dim) {
+  VecsFile file(filename);
+  num = (unsigned)file.num();
+  dim = file.dim();
+}
+
 // SJ: load_data for groundtruth
 unsigned int* load_data_ivecs(const char* filename, unsigned& num, unsigned& dim) { 
-  std::ifstream in(filename, std::ios::binary);
-  if (!in.is_open()) {
-    std::cerr << "Open file error" << std::endl;
-    exit(-1);
+  VecsFile file(filename);
+  if (file.element_size() != sizeof(unsigned int)) {
+    throw std::runtime_error(std::string(filename) + " is not an ivecs file");
   }
-  in.read((char*)&dim, 4);
-  in.seekg(0, std::ios::end);
-  std::ios::pos_type ss = in.tellg();
-  size_t fsize = (size_t)ss;
-  num = (unsigned)(fsize / (dim + 1) / 4);
+  num = (unsigned)file.num();
+  dim = file.dim();
   unsigned int* data = new unsigned int[(size_t)num * (size_t)dim];
+  file.ReadRows(0, file.num(), data, dim);
+  return data;
+}
 
-  in.seekg(0, std::ios::beg);
-  for (size_t i = 0; i < num; i++) {
-    in.seekg(4, std::ios::cur);
-    in.read((char*)(data + i * dim), dim * 4);
-  }
-  in.close();
+// Rows are padded for the widest runtime-dispatched kernel rather than the
+// compile-time target, so the layout does not depend on build flags.
+#define DATA_ALIGN_FACTOR 8
 
-  return data;
+unsigned data_align_dim(unsigned dim) {
+  return (dim + DATA_ALIGN_FACTOR - 1) / DATA_ALIGN_FACTOR * DATA_ALIGN_FACTOR;
 }
 
 float* data_align(float* data_ori, unsigned point_num, unsigned& dim) {
-#ifdef __GNUC__
-#ifdef __AVX__
-#define DATA_ALIGN_FACTOR 8
-#else
-#ifdef __SSE2__
-#define DATA_ALIGN_FACTOR 4
-#else
-#define DATA_ALIGN_FACTOR 1
-#endif
-#endif
-#endif
-  float* data_new = 0;
-  unsigned new_dim =
-      (dim + DATA_ALIGN_FACTOR - 1) / DATA_ALIGN_FACTOR * DATA_ALIGN_FACTOR;
-#ifdef __APPLE__
-  data_new = new float[(size_t)new_dim * (size_t)point_num];
-#else
-  data_new =
-      (float*)memalign(DATA_ALIGN_FACTOR * 4,
-                       (size_t)point_num * (size_t)new_dim * sizeof(float));
-#endif
+  unsigned new_dim = data_align_dim(dim);
+  float* data_new = (float*)aligned_alloc_or_throw(
+      (size_t)point_num * (size_t)new_dim * sizeof(float));
 
   for (size_t i = 0; i < point_num; i++) {
     memcpy(data_new + i * new_dim, data_ori + i * dim, dim * sizeof(float));
@@ -105,13 +99,7 @@ float* data_align(float* data_ori, unsigned point_num, unsigned& dim) {
   }
 
   dim = new_dim;
-
-#ifdef __APPLE__
-  delete[] data_ori;
-#else
   free(data_ori);
-#endif
-
   return data_new;
 }
 
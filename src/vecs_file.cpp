@@ -0,0 +1,148 @@
+#include "vecs_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+namespace efanna2e {
+
+static bool EndsWith(const std::string &name, const char *suffix) {
+  size_t n = std::strlen(suffix);
+  return name.size() >= n && name.compare(name.size() - n, n, suffix) == 0;
+}
+
+VecsFile::VecsFile(const char *filename)
+    : filename_(filename), base_(nullptr), size_(0), num_(0), dim_(0) {
+  // Rows with their own dimension header, or one header for the file.
+  bool per_row = true;
+  type_ = FLOAT32;
+  if (EndsWith(filename_, ".ivecs")) {
+    type_ = INT32;
+  } else if (EndsWith(filename_, ".bvecs")) {
+    type_ = UINT8;
+  } else if (EndsWith(filename_, ".fbin")) {
+    per_row = false;
+  } else if (EndsWith(filename_, ".u8bin")) {
+    type_ = UINT8;
+    per_row = false;
+  } else if (EndsWith(filename_, ".i8bin")) {
+    type_ = INT8;
+    per_row = false;
+  }
+  element_size_ = type_ == UINT8 || type_ == INT8 ? 1 : 4;
+  data_offset_ = per_row ? 0 : 2 * sizeof(uint32_t);
+  row_header_ = per_row ? sizeof(uint32_t) : 0;
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("cannot open " + filename_);
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("cannot stat " + filename_);
+  }
+  size_ = (size_t)st.st_size;
+  if (size_ < data_offset_ + sizeof(uint32_t)) {
+    close(fd);
+    throw std::runtime_error(filename_ + " is empty");
+  }
+  void *base = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) throw std::runtime_error("cannot map " + filename_);
+  base_ = (char *)base;
+
+  uint32_t header[2];
+  std::memcpy(header, base_, per_row ? sizeof(uint32_t) : sizeof(header));
+  dim_ = per_row ? header[0] : header[1];
+  row_bytes_ = row_header_ + (size_t)dim_ * element_size_;
+  num_ = per_row ? size_ / row_bytes_ : header[0];
+  bool valid = dim_ != 0 && (per_row ? size_ % row_bytes_ == 0
+                                     : size_ >= data_offset_ + num_ * row_bytes_);
+  if (!valid) {
+    munmap(base_, size_);
+    throw std::runtime_error(filename_ + " is not a vector file of dimension " +
+                             std::to_string(dim_));
+  }
+}
+
+VecsFile::~VecsFile() {
+  if (base_ != nullptr) munmap(base_, size_);
+}
+
+template <typename CopyRow>
+void VecsFile::ForEachRow(size_t begin, size_t count, CopyRow copy) const {
+  if (begin > num_ || count > num_ - begin) {
+    throw std::out_of_range("rows out of range of " + filename_);
+  }
+  const char *rows = base_ + data_offset_ + begin * row_bytes_;
+#ifdef MADV_WILLNEED
+  // madvise needs a page-aligned start.
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t offset = (size_t)(rows - base_) & ~(page - 1);
+  madvise(base_ + offset, (size_t)(rows - base_) - offset + count * row_bytes_,
+          MADV_WILLNEED);
+#endif
+  const bool check = row_header_ != 0;
+  bool malformed = false;
+  int64_t n = (int64_t)count;
+#pragma omp parallel for schedule(static, 4096) reduction(||: malformed)
+  for (int64_t r = 0; r < n; r++) {
+    const char *row = rows + r * row_bytes_;
+    if (check) {
+      uint32_t row_dim;
+      std::memcpy(&row_dim, row, sizeof(uint32_t));
+      malformed = malformed || row_dim != dim_;
+    }
+    copy((size_t)r, row + row_header_);
+  }
+  if (malformed) {
+    throw std::runtime_error(filename_ + " has rows of differing dimension");
+  }
+}
+
+void VecsFile::ReadRows(size_t begin, size_t count, void *out,
+                        size_t stride) const {
+  if (stride < dim_) throw std::invalid_argument("stride below dimension");
+  const size_t row_size = (size_t)dim_ * element_size_;
+  const size_t out_size = stride * element_size_;
+  ForEachRow(begin, count, [&](size_t r, const char *values) {
+    char *dst = (char *)out + r * out_size;
+    std::memcpy(dst, values, row_size);
+    std::memset(dst + row_size, 0, out_size - row_size);
+  });
+}
+
+void VecsFile::ReadFloatRows(size_t begin, size_t count, float *out,
+                             size_t stride) const {
+  if (stride < dim_) throw std::invalid_argument("stride below dimension");
+  const ElementType type = type_;
+  const unsigned dim = dim_;
+  ForEachRow(begin, count, [&](size_t r, const char *values) {
+    float *dst = out + r * stride;
+    switch (type) {
+      case UINT8:
+        for (unsigned j = 0; j < dim; j++) dst[j] = (uint8_t)values[j];
+        break;
+      case INT8:
+        for (unsigned j = 0; j < dim; j++) dst[j] = (int8_t)values[j];
+        break;
+      case INT32:
+        for (unsigned j = 0; j < dim; j++) {
+          int32_t v;
+          std::memcpy(&v, values + 4 * j, sizeof(v));
+          dst[j] = (float)v;
+        }
+        break;
+      default:
+        std::memcpy(dst, values, dim * sizeof(float));
+        break;
+    }
+    std::fill(dst + dim, dst + stride, 0.0f);
+  });
+}
+
+}  // namespace efanna2e
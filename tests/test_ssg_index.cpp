@@ -10,6 +10,8 @@ int main(int argc, char** argv) {
   if (argc < 7) {
     std::cout << "./run data_file nn_graph_path L R Angle save_graph_file [seed]"
               << std::endl;
+    std::cout << "nn_graph_path - builds the kNN graph with NN-Descent"
+              << std::endl;
     exit(-1);
   }
 
@@ -23,8 +25,7 @@ int main(int argc, char** argv) {
 
   unsigned points_num, dim;
   float* data_load = nullptr;
-  data_load = efanna2e::load_data(argv[1], points_num, dim);
-  data_load = efanna2e::data_align(data_load, points_num, dim);
+  data_load = efanna2e::load_data_aligned(argv[1], points_num, dim);
 
   std::string nn_graph_path(argv[2]);
   unsigned L = (unsigned)atoi(argv[3]);
@@ -36,8 +37,16 @@ int main(int argc, char** argv) {
   std::cout << "Angle = " << A << std::endl;
   std::cout << "KNNG = " << nn_graph_path << std::endl;
 
-  efanna2e::IndexRandom init_index(dim, points_num);
-  efanna2e::IndexSSG index(dim, points_num, efanna2e::L2,
+#ifdef INCREMENTAL_INSERT
+  // Builds on the first half of the data and inserts the rest. The kNN
+  // graph of the first half is computed with NN-Descent.
+  unsigned build_num = points_num / 2;
+  nn_graph_path = "-";
+#else
+  unsigned build_num = points_num;
+#endif
+  efanna2e::IndexRandom init_index(dim, build_num);
+  efanna2e::IndexSSG index(dim, build_num, efanna2e::L2,
                            (efanna2e::Index*)(&init_index));
 
   efanna2e::Parameters paras;
@@ -45,15 +54,25 @@ int main(int argc, char** argv) {
   paras.Set<unsigned>("R", R);
   paras.Set<float>("A", A);
   paras.Set<unsigned>("n_try", 10);
-  paras.Set<std::string>("nn_graph_path", nn_graph_path);
+  if (nn_graph_path != "-") {
+    paras.Set<std::string>("nn_graph_path", nn_graph_path);
+  }
 
   std::cerr << "Output SSG Path: " << argv[6] << std::endl;
 
   auto s = std::chrono::high_resolution_clock::now();
-  index.Build(points_num, data_load, paras);
+  index.Build(build_num, data_load, paras);
   auto e = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> diff = e - s;
   std::cout << "Build Time: " << diff.count() << "\n";
+#ifdef INCREMENTAL_INSERT
+  s = std::chrono::high_resolution_clock::now();
+  index.Insert(data_load + (size_t)build_num * dim, points_num - build_num,
+               paras);
+  e = std::chrono::high_resolution_clock::now();
+  diff = e - s;
+  std::cout << "Insert Time: " << diff.count() << "\n";
+#endif
 
   index.Save(argv[6]);
 
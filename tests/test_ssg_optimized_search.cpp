@@ -9,13 +9,12 @@
 #include "util.h"
 #include <omp.h>
 
-void save_result(char* filename, std::vector<std::vector<unsigned> >& results) {
+void save_result(char* filename, std::vector<unsigned>& results, unsigned GK) {
   std::ofstream out(filename, std::ios::binary | std::ios::out);
 
-  for (unsigned i = 0; i < results.size(); i++) {
-    unsigned GK = (unsigned)results[i].size();
+  for (size_t i = 0; i < results.size() / GK; i++) {
     out.write((char*)&GK, sizeof(unsigned));
-    out.write((char*)results[i].data(), GK * sizeof(unsigned));
+    out.write((char*)(results.data() + i * GK), GK * sizeof(unsigned));
   }
   out.close();
 }
@@ -58,21 +57,30 @@ int main(int argc, char** argv) {
 
   unsigned points_num, dim;
   float* data_load = nullptr;
-  data_load = efanna2e::load_data(argv[1], points_num, dim);
-  data_load = efanna2e::data_align(data_load, points_num, dim);
+#ifdef STREAM_OPTIMIZE
+  // The base vectors are streamed into the optimized graph, never loaded.
+  efanna2e::load_data_info(argv[1], points_num, dim);
+  dim = efanna2e::data_align_dim(dim);
+#else
+  data_load = efanna2e::load_data_aligned(argv[1], points_num, dim);
+#endif
 
   std::cerr << "Query Path: " << argv[2] << std::endl;
 
   unsigned query_num, query_dim;
   float* query_load = nullptr;
-  query_load = efanna2e::load_data(argv[2], query_num, query_dim);
-  query_load = efanna2e::data_align(query_load, query_num, query_dim);
+  query_load = efanna2e::load_data_aligned(argv[2], query_num, query_dim);
 
   assert(dim == query_dim);
 
   efanna2e::IndexRandom init_index(dim, points_num);
+#ifdef PRODUCT_QUANTIZATION
+  efanna2e::IndexSSG index(dim, points_num, efanna2e::PQ,
+                           (efanna2e::Index*)(&init_index));
+#else
   efanna2e::IndexSSG index(dim, points_num, efanna2e::FAST_L2,
                            (efanna2e::Index*)(&init_index));
+#endif
 
   std::cerr << "SSG Path: " << argv[3] << std::endl;
   std::cerr << "Result Path: " << argv[6] << std::endl;
@@ -88,12 +96,42 @@ int main(int argc, char** argv) {
 #endif
   omp_set_num_threads(num_threads);
 
+#ifdef MEMORY_POLICY
+  // 0 malloc, 1 THP, 2 hugetlbfs, 3 NUMA interleave, 4 per-node replicas
+  index.SetMemoryPolicy((efanna2e::MemoryPolicy)(MEMORY_POLICY));
+#endif
+#ifdef LOAD_OPTIMIZED
+  // argv[3] is a file written with -DSAVE_OPTIMIZED
+  index.LoadOptimized(argv[3], data_load);
+#else
   index.Load(argv[3]);
+#ifdef PCA_ROTATION
+  index.SetPCARotation(true);
+#endif
+#ifdef GRAPH_REORDER
+  index.SetGraphReordering(true);
+#endif
+#if defined(SQ8_ENCODING)
+  index.SetVectorEncoding(efanna2e::SQ8);
+#elif defined(FP16_ENCODING)
+  index.SetVectorEncoding(efanna2e::FP16);
+#elif defined(U8_ENCODING)
+  index.SetVectorEncoding(efanna2e::U8);
+#elif defined(I8_ENCODING)
+  index.SetVectorEncoding(efanna2e::I8);
+#endif
+#ifdef STREAM_OPTIMIZE
+  index.OptimizeGraphFromFile(argv[1]);
+#else
   index.OptimizeGraph(data_load);
+#endif
+#endif
 
 #ifdef ADA_NNS
-  char* hash_function_name = new char[strlen(argv[3]) + strlen(".hash_function_") + strlen(argv[9]) + 1];
-  char* hashed_set_name = new char[strlen(argv[3]) + strlen(".hashed_set") + strlen(argv[9]) + 1];
+  // An optimized index file may already carry the hashes.
+  if (!index.HasHashes()) {
+  char* hash_function_name = new char[strlen(argv[3]) + strlen(".hash_function_") + strlen(argv[9]) + strlen("b") + 1];
+  char* hashed_set_name = new char[strlen(argv[3]) + strlen(".hashed_set_") + strlen(argv[9]) + strlen("b") + 1];
   strcpy(hash_function_name, argv[3]);
   strcat(hash_function_name, ".hash_function_");
   strcat(hash_function_name, argv[9]);
@@ -115,6 +153,10 @@ int main(int argc, char** argv) {
   }
   delete[] hash_function_name;
   delete[] hashed_set_name;
+  }
+#endif
+#ifdef SAVE_OPTIMIZED
+  index.SaveOptimized((std::string(argv[3]) + ".opt").c_str());
 #endif
 
   unsigned L = (unsigned)atoi(argv[4]);
@@ -125,9 +167,14 @@ int main(int argc, char** argv) {
 
   efanna2e::Parameters paras;
   paras.Set<unsigned>("L_search", L);
+#ifdef EARLY_ABANDON
+  paras.Set<unsigned>("early_abandon", 1);
+#endif
+#ifdef RERANK
+  paras.Set<unsigned>("rerank", 1);
+#endif
 
-  std::vector<std::vector<unsigned> > res(query_num);
-  for (unsigned i = 0; i < query_num; i++) res[i].resize(K);
+  std::vector<unsigned> res((size_t)query_num * K);
 
 #ifdef THREAD_LATENCY
   std::vector<double> latency_stats(query_num, 0);
@@ -135,16 +182,9 @@ int main(int argc, char** argv) {
 #ifdef PROFILE
   index.SetTimer(num_threads);
 #endif
-  // [ARC-SJ]: Minor optimization of greedy search 
-  //           Allocate visited list once
-  //           For large-scale dataset (e.g., DEEP100M),
-  //           repeated allocation is a huge overhead
-  boost::dynamic_bitset<> flags{index.Get_nd(), 0};
   // Warm up
   for (int loop = 0; loop < 3; ++loop) {
-    for (unsigned i = 0; i < 10; ++i) {
-      index.SearchWithOptGraph(query_load + i * dim, flags, K, paras, res[i].data());
-    }
+    index.SearchBatch(query_load, std::min(query_num, 10U), K, paras, res.data(), nullptr);
   }
 
 #ifdef PROFILE
@@ -152,18 +192,23 @@ int main(int argc, char** argv) {
 #endif
 
   auto s = std::chrono::high_resolution_clock::now();
+#ifdef THREAD_LATENCY
+  // One reusable search context per worker thread
+  std::vector<efanna2e::SearchContext> contexts(num_threads);
+  for (unsigned t = 0; t < num_threads; t++) {
+    index.InitSearchContext(contexts[t], paras);
+  }
 #pragma omp parallel for schedule(dynamic, 1)
   for (unsigned i = 0; i < query_num; i++) {
-#ifdef THREAD_LATENCY
     auto query_start = std::chrono::high_resolution_clock::now();
-#endif
-    index.SearchWithOptGraph(query_load + i * dim, flags, K, paras, res[i].data());
-#ifdef THREAD_LATENCY
+    index.SearchWithOptGraph(query_load + i * dim, contexts[omp_get_thread_num()], K, res.data() + (size_t)i * K);
    auto query_end = std::chrono::high_resolution_clock::now();
    std::chrono::duration<double> query_diff = query_end - query_start;
    latency_stats[i] = query_diff.count() * 1000000;
-#endif
   }
+#else
+  index.SearchBatch(query_load, query_num, K, paras, res.data(), nullptr);
+#endif
   auto e = std::chrono::high_resolution_clock::now();
   std::chrono::duration<double> diff = e - s;
 
@@ -171,7 +216,7 @@ int main(int argc, char** argv) {
   std::cerr << "Search Time: " << diff.count() << std::endl;
   std::cerr << "QPS: " << query_num / diff.count() << std::endl;
 
-  save_result(argv[6], res);
+  save_result(argv[6], res, K);
 
 #ifdef EVAL_RECALL
   unsigned int* ground_truth_load = NULL;
@@ -183,13 +228,13 @@ int main(int argc, char** argv) {
     for (unsigned int j = 0; j < K; j++) {
       for (unsigned int k = 0; k < K; k++) {
         if (sub_id == -1) {
-          if (res[i][j] == *(ground_truth_load + i * ground_truth_dim + k)) {
+          if (res[(size_t)i * K + j] == *(ground_truth_load + i * ground_truth_dim + k)) {
             topk_hit++;
             break;
           }
         }
         else { // [ARC-SJ] Recall for deep100M_16T
-          if (res[i][j] + (6250000 * sub_id) == *(ground_truth_load + i * ground_truth_dim + k)) {
+          if (res[(size_t)i * K + j] + (6250000 * sub_id) == *(ground_truth_load + i * ground_truth_dim + k)) {
             topk_hit++;
             break;
           }